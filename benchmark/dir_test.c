@@ -0,0 +1,186 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <dirent.h>
+
+#include "tfs_mount.h"
+
+/*
+ * Directory index: fill one directory well past its DIR_LINEAR_BLOCKS
+ * linear blocks, so it is converted to the hashed form and its leaves
+ * split over and over, then check every name by lookup and by readdir,
+ * before and after a remount, as entries come and go.
+ */
+
+/* Short timeouts send lookups to TFS rather than answering them from the kernel's caches */
+#define MOUNT_OPTS "entry_timeout=0,negative_timeout=0,attr_timeout=0"
+
+#define N_FILES 1000
+#define FSPATHLEN 256
+#define FILEPERM 0666
+#define DIRPERM 0755
+
+/* Long names fill leaves sooner, so there are more splits */
+#define NAME_FMT "a-fairly-long-directory-entry-name-%05d"
+
+static char present[N_FILES];
+
+/* Every name that should be there looks up, and nothing else does */
+static int check_lookup(void) {
+
+	int i;
+	struct stat st;
+	char path[FSPATHLEN];
+
+	for (i = 0; i < N_FILES; i++) {
+		sprintf(path, "%s/" NAME_FMT, TESTDIR "/files", i);
+		if ((stat(path, &st) == 0) != present[i]) {
+			printf("%s: %s \n", path, present[i] ? "missing" : "still there");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* readdir lists every name that should be there exactly once */
+static int check_readdir(void) {
+
+	char seen[N_FILES];
+	struct dirent *d;
+	DIR *dir;
+	int i, n;
+
+	memset(seen, 0, sizeof(seen));
+	if ((dir = opendir(TESTDIR "/files")) == NULL) {
+		perror("opendir");
+		return -1;
+	}
+	while ((d = readdir(dir)) != NULL) {
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) {
+			continue;
+		}
+		if (sscanf(d->d_name, NAME_FMT, &n) != 1 || n < 0 || n >= N_FILES || !present[n] || seen[n]) {
+			printf("readdir: unexpected %s \n", d->d_name);
+			closedir(dir);
+			return -1;
+		}
+		seen[n] = 1;
+	}
+	closedir(dir);
+
+	for (i = 0; i < N_FILES; i++) {
+		if (present[i] && !seen[i]) {
+			printf("readdir: " NAME_FMT " not listed \n", i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int check(void) {
+	return check_lookup() == 0 && check_readdir() == 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+
+	int i, fd;
+	char path[FSPATHLEN];
+
+	if (tfs_fresh_image() < 0 || tfs_mount(MOUNT_OPTS) < 0) {
+		printf("TEST 1: Mount failure \n");
+		exit(1);
+	}
+	if (mkdir(TESTDIR "/files", DIRPERM) < 0) {
+		perror("mkdir");
+		printf("TEST 1: Directory create failure \n");
+		exit(1);
+	}
+	printf("TEST 1: Directory create Success \n");
+
+
+	for (i = 0; i < N_FILES; i++) {
+		sprintf(path, "%s/" NAME_FMT, TESTDIR "/files", i);
+		if ((fd = creat(path, FILEPERM)) < 0) {
+			perror("creat");
+			printf("TEST 2: File create failure at %d \n", i);
+			exit(1);
+		}
+		close(fd);
+		present[i] = 1;
+	}
+	/* A name that is there already is found, not added twice */
+	sprintf(path, "%s/" NAME_FMT, TESTDIR "/files", 7);
+	if (open(path, O_WRONLY | O_CREAT | O_EXCL, FILEPERM) >= 0 || errno != EEXIST || check() < 0) {
+		printf("TEST 2: Directory lookup failure \n");
+		exit(1);
+	}
+	printf("TEST 2: Directory lookup Success \n");
+
+
+	/* The index as it is on disk */
+	if (tfs_unmount() < 0 || tfs_mount(MOUNT_OPTS) < 0 || check() < 0) {
+		printf("TEST 3: Directory remount failure \n");
+		exit(1);
+	}
+	printf("TEST 3: Directory remount Success \n");
+
+
+	/* Every other entry goes, then comes back */
+	for (i = 0; i < N_FILES; i += 2) {
+		sprintf(path, "%s/" NAME_FMT, TESTDIR "/files", i);
+		if (unlink(path) < 0) {
+			perror("unlink");
+			printf("TEST 4: File unlink failure \n");
+			exit(1);
+		}
+		present[i] = 0;
+	}
+	if (check() < 0) {
+		printf("TEST 4: Directory unlink failure \n");
+		exit(1);
+	}
+	for (i = 0; i < N_FILES; i += 4) {
+		sprintf(path, "%s/" NAME_FMT, TESTDIR "/files", i);
+		if ((fd = creat(path, FILEPERM)) < 0) {
+			perror("creat");
+			printf("TEST 4: File create failure \n");
+			exit(1);
+		}
+		close(fd);
+		present[i] = 1;
+	}
+	if (check() < 0 || tfs_unmount() < 0 || tfs_mount(MOUNT_OPTS) < 0 || check() < 0) {
+		printf("TEST 4: Directory unlink failure \n");
+		exit(1);
+	}
+	printf("TEST 4: Directory unlink Success \n");
+
+
+	if (rmdir(TESTDIR "/files") == 0 || errno != ENOTEMPTY) {
+		printf("TEST 5: Directory remove failure \n");
+		exit(1);
+	}
+	for (i = 0; i < N_FILES; i++) {
+		sprintf(path, "%s/" NAME_FMT, TESTDIR "/files", i);
+		if (present[i] && unlink(path) < 0) {
+			perror("unlink");
+			printf("TEST 5: File unlink failure \n");
+			exit(1);
+		}
+		present[i] = 0;
+	}
+	if (check() < 0 || rmdir(TESTDIR "/files") < 0 || tfs_unmount() < 0) {
+		perror("rmdir");
+		printf("TEST 5: Directory remove failure \n");
+		exit(1);
+	}
+	printf("TEST 5: Directory remove Success \n");
+
+	printf("Directory test completed \n");
+	return 0;
+}
@@ -0,0 +1,176 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <dirent.h>
+
+#include "tfs_mount.h"
+
+/*
+ * Journal replay: fsync some files, kill the server before the journal is
+ * checkpointed, and check that the remount replays it and finds them all.
+ * A long commit interval keeps the commit thread from checkpointing the
+ * journal on its own while the test runs.
+ */
+
+#define MOUNT_OPTS "commit_interval=3600"
+
+#define N_FILES 100
+#define BLOCKSIZE 4096
+#define FSPATHLEN 256
+#define ITERS 16
+#define FILEPERM 0666
+#define DIRPERM 0755
+
+char buf[BLOCKSIZE];
+
+/* Number of transactions the last mount replayed, from the statistics file */
+static long replayed(void) {
+
+	char line[512];
+	long n = -1;
+	FILE *f = fopen(TESTDIR "/.tfs/stats", "r");
+
+	if (!f) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		char *p = strstr(line, " transactions replayed");
+		if (strncmp(line, "Journal:", 8) == 0 && p) {
+			while (p > line && p[-1] >= '0' && p[-1] <= '9') {
+				p--;
+			}
+			n = atol(p);
+		}
+	}
+	fclose(f);
+	return n;
+}
+
+int main(int argc, char **argv) {
+
+	int i, j, fd;
+	struct stat st;
+	char path[FSPATHLEN];
+
+	if (tfs_fresh_image() < 0 || tfs_mount(MOUNT_OPTS) < 0) {
+		printf("TEST 1: Mount failure \n");
+		exit(1);
+	}
+	printf("TEST 1: Mount Success \n");
+
+
+	/* A file of ITERS blocks and a directory of files, all made durable */
+	if ((fd = creat(TESTDIR "/file", FILEPERM)) < 0) {
+		perror("creat");
+		printf("TEST 2: File write failure \n");
+		exit(1);
+	}
+	for (i = 0; i < ITERS; i++) {
+		memset(buf, 0x61 + i, BLOCKSIZE);
+		if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE) {
+			printf("TEST 2: File write failure \n");
+			exit(1);
+		}
+	}
+	if (mkdir(TESTDIR "/files", DIRPERM) < 0) {
+		perror("mkdir");
+		printf("TEST 2: Directory create failure \n");
+		exit(1);
+	}
+	for (i = 0; i < N_FILES; i++) {
+		int f;
+		sprintf(path, "%s%d", TESTDIR "/files/file", i);
+		if ((f = creat(path, FILEPERM)) < 0 || write(f, path, strlen(path)) != (ssize_t) strlen(path)) {
+			perror("creat");
+			printf("TEST 2: File create failure \n");
+			exit(1);
+		}
+		close(f);
+	}
+	if (fsync(fd) < 0) {
+		perror("fsync");
+		printf("TEST 2: fsync failure \n");
+		exit(1);
+	}
+	close(fd);
+	printf("TEST 2: Write and fsync Success \n");
+
+
+	/* Crash: nothing after the fsync gets a chance to reach its home */
+	if (tfs_kill() < 0) {
+		printf("TEST 3: Kill failure \n");
+		exit(1);
+	}
+	printf("TEST 3: Kill Success \n");
+
+
+	if (tfs_mount(MOUNT_OPTS) < 0) {
+		printf("TEST 4: Remount failure \n");
+		exit(1);
+	}
+	if (replayed() <= 0) {
+		printf("TEST 4: Journal replay failure, %ld transactions replayed \n", replayed());
+		exit(1);
+	}
+	printf("TEST 4: Journal replay Success, %ld transactions replayed \n", replayed());
+
+
+	/* Everything fsync promised is back */
+	if ((fd = open(TESTDIR "/file", O_RDONLY)) < 0 || fstat(fd, &st) < 0 || st.st_size != ITERS * BLOCKSIZE) {
+		perror("open");
+		printf("TEST 5: File read failure \n");
+		exit(1);
+	}
+	for (i = 0; i < ITERS; i++) {
+		memset(buf, 0, BLOCKSIZE);
+		if (read(fd, buf, BLOCKSIZE) != BLOCKSIZE) {
+			printf("TEST 5: File read failure \n");
+			exit(1);
+		}
+		for (j = 0; j < BLOCKSIZE; j++) {
+			if (buf[j] != 0x61 + i) {
+				printf("TEST 5: File data failure at block %d \n", i);
+				exit(1);
+			}
+		}
+	}
+	close(fd);
+	printf("TEST 5: File read Success \n");
+
+	for (i = 0; i < N_FILES; i++) {
+		sprintf(path, "%s%d", TESTDIR "/files/file", i);
+		memset(buf, 0, BLOCKSIZE);
+		if ((fd = open(path, O_RDONLY)) < 0 || read(fd, buf, BLOCKSIZE) != (ssize_t) strlen(path) || strcmp(buf, path) != 0) {
+			perror(path);
+			printf("TEST 6: Directory replay failure \n");
+			exit(1);
+		}
+		close(fd);
+	}
+	printf("TEST 6: Directory replay Success \n");
+
+
+	/* And it still takes changes */
+	for (i = 0; i < N_FILES; i++) {
+		sprintf(path, "%s%d", TESTDIR "/files/file", i);
+		if (unlink(path) < 0) {
+			perror("unlink");
+			printf("TEST 7: Cleanup failure \n");
+			exit(1);
+		}
+	}
+	if (rmdir(TESTDIR "/files") < 0 || unlink(TESTDIR "/file") < 0 || tfs_unmount() < 0) {
+		perror("rmdir");
+		printf("TEST 7: Cleanup failure \n");
+		exit(1);
+	}
+	printf("TEST 7: Cleanup Success \n");
+
+	printf("Journal test completed \n");
+	return 0;
+}
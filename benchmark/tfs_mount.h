@@ -0,0 +1,99 @@
+#ifndef TFS_MOUNT_H
+#define TFS_MOUNT_H
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/*
+ * Helpers for tests that run their own TFS: the server is started in the
+ * foreground from WORKDIR, so it keeps its DISKFILE there rather than
+ * touching the one next to the binary, and can be killed and remounted.
+ */
+
+/* You need to change these macros to your TFS build and mount point */
+#define TFS_BIN "../tfs"
+#define TESTDIR "/tmp/lhs52/mountdir"
+#define WORKDIR "/tmp/lhs52/testimage"
+
+#define MOUNT_WAIT_SECS 10
+
+static char tfs_path[PATH_MAX];
+static pid_t tfs_pid = -1;
+
+/* Start from an empty image */
+static inline int tfs_fresh_image(void) {
+
+	if (!realpath(TFS_BIN, tfs_path)) {
+		perror(TFS_BIN);
+		return -1;
+	}
+	mkdir(WORKDIR, 0755);
+	if (unlink(WORKDIR "/DISKFILE") < 0 && errno != ENOENT) {
+		perror(WORKDIR "/DISKFILE");
+		return -1;
+	}
+	return 0;
+}
+
+/* Mount the image and wait until the file system answers */
+static inline int tfs_mount(const char *opts) {
+
+	struct stat st;
+	int i;
+
+	if ((tfs_pid = fork()) < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (tfs_pid == 0) {
+		if (chdir(WORKDIR) < 0) {
+			perror(WORKDIR);
+			_exit(1);
+		}
+		execl(tfs_path, "tfs", "-f", "-o", opts, TESTDIR, (char *) NULL);
+		perror(tfs_path);
+		_exit(1);
+	}
+
+	/* The statistics directory only exists on a mounted TFS */
+	for (i = 0; i < MOUNT_WAIT_SECS * 10; i++) {
+		if (stat(TESTDIR "/.tfs", &st) == 0) {
+			return 0;
+		}
+		if (waitpid(tfs_pid, NULL, WNOHANG) == tfs_pid) {
+			break;
+		}
+		usleep(100000);
+	}
+	printf("TFS did not come up on %s\n", TESTDIR);
+	return -1;
+}
+
+/* Unmount cleanly; the server exits once the kernel lets go */
+static inline int tfs_unmount(void) {
+
+	if (system("fusermount -u " TESTDIR " 2>/dev/null || fusermount3 -u " TESTDIR) != 0) {
+		return -1;
+	}
+	return waitpid(tfs_pid, NULL, 0) == tfs_pid ? 0 : -1;
+}
+
+/* Kill the server as a crash would, leaving whatever it had not written home */
+static inline int tfs_kill(void) {
+
+	if (kill(tfs_pid, SIGKILL) < 0 || waitpid(tfs_pid, NULL, 0) != tfs_pid) {
+		return -1;
+	}
+	/* The dead connection still holds the mount point until it is detached */
+	system("fusermount -uz " TESTDIR " 2>/dev/null || fusermount3 -uz " TESTDIR);
+	return 0;
+}
+
+#endif
@@ -16,27 +16,854 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#ifdef TFS_IO_URING
+#include <liburing.h>
+#endif
 
 #include "block.h"
 
-//Disk size set to 32MB
-#define DISK_SIZE	32*1024*1024
-
 int diskfile = -1;
 
-//Creates a file which is your new emulated disk
-void dev_init(const char* diskfile_path) {
+//Block size of the open image, set from its superblock before the cache is set up
+uint32_t dev_block_size = BLOCK_SIZE_MIN;
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+//Most dirty neighbours written out together with an evicted buffer
+#define WRITEBACK_CLUSTER 32
+
+//A run of physically consecutive blocks moved in one device request
+struct dev_run {
+    blk_t       blkno;              /* first block of the run */
+    int         n;                  /* blocks in the run */
+    char        **bufs;             /* one BLOCK_SIZE buffer per block */
+    int         err;                /* set by dev_submit() if the run failed */
+};
+
+static int dev_backend = DEV_BACKEND_PREAD;
+
+/*
+ * Mapped image
+ *
+ * With the mmap backend the whole image is mapped shared and the page
+ * cache stands in for the buffer cache: block reads and writes are plain
+ * copies, and bio_map() lets callers read blocks in place. Writes only
+ * widen the dirty range, which bio_flush() pushes out with msync().
+ *
+ * Copies hold a lock striped by block number, so a block still moves
+ * as a unit like a pread/pwrite would: a thread reading one inode out of
+ * a table block never sees another thread's rewrite of it half done.
+ *
+ * The mapping sits at the start of an address range reserved for the
+ * largest size the image may grow to, so dev_grow() can map the new tail
+ * in place and pointers handed out by bio_map() never move.
+ */
+#define DEV_MAP_STRIPES 64
+
+static char *dev_map;
+static size_t dev_map_size;
+static size_t dev_map_reserved;
+static uint64_t dev_size_limit;
+static int dev_map_flags;
+static blk_t dev_map_lo = INT64_MAX, dev_map_hi = -1;
+static pthread_mutex_t dev_map_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t dev_map_stripe[DEV_MAP_STRIPES];
+
+//Copy to or from the mapping; blocks past its end read as zeroes and cannot be written
+static int dev_map_xfer(blk_t blkno, void *buf, int write) {
+    size_t off = (size_t) blkno * BLOCK_SIZE;
+
+    if (blkno < 0 || off + BLOCK_SIZE > __atomic_load_n(&dev_map_size, __ATOMIC_ACQUIRE)) {
+        if (write) {
+            fprintf(stderr, "block_write failed: block %ld is past the end of the image\n", (long) blkno);
+            return -1;
+        }
+        memset(buf, 0, BLOCK_SIZE);
+        return BLOCK_SIZE;
+    }
+    pthread_mutex_t *stripe = &dev_map_stripe[blkno % DEV_MAP_STRIPES];
+    pthread_mutex_lock(stripe);
+    if (!write) {
+        memcpy(buf, dev_map + off, BLOCK_SIZE);
+        pthread_mutex_unlock(stripe);
+        return BLOCK_SIZE;
+    }
+    memcpy(dev_map + off, buf, BLOCK_SIZE);
+    pthread_mutex_unlock(stripe);
+
+    pthread_mutex_lock(&dev_map_lock);
+    if (blkno < dev_map_lo)
+        dev_map_lo = blkno;
+    if (blkno > dev_map_hi)
+        dev_map_hi = blkno;
+    pthread_mutex_unlock(&dev_map_lock);
+    return BLOCK_SIZE;
+}
+
+//Collapse a run of block buffers into iovecs, merging neighbours in memory
+static int dev_build_iov(char **bufs, int n, struct iovec *iov) {
+    int i, niov = 0;
+
+    for (i = 0; i < n; i++) {
+        if (niov > 0 && (char *) iov[niov - 1].iov_base + iov[niov - 1].iov_len == bufs[i]) {
+            iov[niov - 1].iov_len += BLOCK_SIZE;
+        } else {
+            iov[niov].iov_base = bufs[i];
+            iov[niov].iov_len = BLOCK_SIZE;
+            niov++;
+        }
+    }
+    return niov;
+}
+
+//Zero the part of a short read past the end of the image
+static void dev_zero_tail(struct iovec *iov, int niov, ssize_t done) {
+    int i;
+
+    for (i = 0; i < niov; i++) {
+        if (done >= (ssize_t) iov[i].iov_len) {
+            done -= iov[i].iov_len;
+            continue;
+        }
+        memset((char *) iov[i].iov_base + done, 0, iov[i].iov_len - done);
+        done = 0;
+    }
+}
+
+/*
+ * Vectored device I/O
+ *
+ * Transfer n physically consecutive blocks starting at blkno to or from
+ * the buffers in bufs with a single preadv/pwritev. Buffers that happen
+ * to be adjacent in memory are merged into one iovec. A read that runs
+ * past the end of the image is zero-filled, as bio_read() does.
+ */
+static int dev_xferv_sync(blk_t blkno, char **bufs, int n, int write) {
+    struct iovec iov[n];
+    int niov = dev_build_iov(bufs, n, iov);
+
+    off_t offset = (off_t) blkno * BLOCK_SIZE;
+    ssize_t total = (ssize_t) n * BLOCK_SIZE;
+    ssize_t retstat = write ? pwritev(diskfile, iov, niov, offset) : preadv(diskfile, iov, niov, offset);
+    if (retstat < 0) {
+        perror(write ? "block_write failed" : "block_read failed");
+        return -1;
+    }
+    if (retstat < total) {
+        if (write) {
+            return -1;
+        }
+        dev_zero_tail(iov, niov, retstat);
+    }
+    return n;
+}
+
+//Transfer a batch of runs one preadv/pwritev at a time
+static int dev_submit_sync(struct dev_run *runs, int nruns, int write) {
+    int i, retstat = 0;
+
+    for (i = 0; i < nruns; i++) {
+        runs[i].err = dev_xferv_sync(runs[i].blkno, runs[i].bufs, runs[i].n, write) < 0;
+        if (runs[i].err)
+            retstat = -1;
+    }
+    return retstat;
+}
+
+#ifdef TFS_IO_URING
+static int dev_submit_uring(struct dev_run *runs, int nruns, int write);
+#endif
+
+/*
+ * Transfer a batch of runs. The pread backend issues one preadv/pwritev
+ * per run; the io_uring backend queues them all and waits once, so the
+ * device sees the whole batch at the same time. A run that fails has its
+ * err set and the batch as a whole returns -1.
+ */
+static int dev_submit(struct dev_run *runs, int nruns, int write) {
+#ifdef TFS_IO_URING
+    if (dev_backend == DEV_BACKEND_URING && nruns > 0) {
+        return dev_submit_uring(runs, nruns, write);
+    }
+#endif
+    return dev_submit_sync(runs, nruns, write);
+}
+
+static int dev_xferv(blk_t blkno, char **bufs, int n, int write) {
+    struct dev_run run = { blkno, n, bufs, 0 };
+
+    return dev_submit(&run, 1, write) < 0 ? -1 : n;
+}
+
+/*
+ * Buffer cache
+ *
+ * A fixed pool of block-sized buffers, hashed by block number and
+ * reclaimed with the CLOCK algorithm. Writes are write-back: bio_write
+ * only dirties the buffer, and dirty buffers reach the disk on eviction
+ * or when bio_flush() is called.
+ *
+ * bc_lock guards the whole cache. A miss drops it around the pread so
+ * other threads keep hitting; the filesystem never reads a block while
+ * another thread writes it, so the block read cannot go stale meanwhile.
+ */
+struct buf {
+    blk_t       blkno;              /* cached block number, -1 if unused */
+    uint8_t     dirty;              /* buffer differs from the disk copy */
+    uint8_t     ref;                /* CLOCK reference bit */
+    uint8_t     prefetched;         /* brought in by readahead and not used yet */
+    struct buf  *hnext;             /* next buffer in the hash chain */
+    char        *data;              /* BLOCK_SIZE bytes of block data */
+};
+
+struct bcache {
+    struct buf  *bufs;
+    struct buf  **htable;
+    int         nbufs;
+    int         hmask;
+    int         hand;
+    struct bcache_stats stats;
+};
+
+static struct bcache bc;
+static pthread_mutex_t bc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int bhash(blk_t blkno) {
+    return (int) (((uint64_t) blkno * 0x9E3779B97F4A7C15ull) >> 32) & bc.hmask;
+}
+
+static struct buf *bcache_lookup(blk_t blkno) {
+    struct buf *b;
+    for (b = bc.htable[bhash(blkno)]; b; b = b->hnext) {
+        if (b->blkno == blkno)
+            return b;
+    }
+    return NULL;
+}
+
+//A lookup found b; credit readahead if it brought b in for a read, or count it wasted if b is overwritten
+static inline void bcache_touch(struct buf *b, int read) {
+    b->ref = 1;
+    if (b->prefetched) {
+        b->prefetched = 0;
+        if (read)
+            bc.stats.ra_hits++;
+        else
+            bc.stats.ra_waste++;
+    }
+}
+
+static void bcache_unhash(struct buf *b) {
+    struct buf **pp = &bc.htable[bhash(b->blkno)];
+    while (*pp != b)
+        pp = &(*pp)->hnext;
+    *pp = b->hnext;
+    b->hnext = NULL;
+}
+
+//Write back a run of dirty buffers holding consecutive blocks, in one pwritev
+static int bcache_writeback_run(struct buf **run, int n) {
+    char *bufs[n];
+    int i;
+
+    for (i = 0; i < n; i++)
+        bufs[i] = run[i]->data;
+    if (dev_xferv(run[0]->blkno, bufs, n, 1) < 0)
+        return -1;
+
+    for (i = 0; i < n; i++)
+        run[i]->dirty = 0;
+    bc.stats.ndirty -= n;
+    bc.stats.writebacks += n;
+    return 0;
+}
+
+//Write back a dirty buffer along with the dirty buffers around it on disk
+static int bcache_writeback(struct buf *b) {
+    struct buf *run[2 * WRITEBACK_CLUSTER + 1];
+    struct buf *nb;
+    int first = WRITEBACK_CLUSTER, last = WRITEBACK_CLUSTER;
+
+    run[first] = b;
+    while (first > 0 && (nb = bcache_lookup(run[first]->blkno - 1)) && nb->dirty)
+        run[--first] = nb;
+    while (last < 2 * WRITEBACK_CLUSTER && (nb = bcache_lookup(run[last]->blkno + 1)) && nb->dirty)
+        run[++last] = nb;
+
+    return bcache_writeback_run(run + first, last - first + 1);
+}
+
+//Pick a buffer for blkno with the CLOCK hand, writing back its old contents
+static struct buf *bcache_alloc(blk_t blkno) {
+    struct buf *b;
+    for (;;) {
+        b = &bc.bufs[bc.hand];
+        bc.hand = (bc.hand + 1) % bc.nbufs;
+        if (b->ref) {
+            b->ref = 0;
+            continue;
+        }
+        break;
+    }
+
+    if (b->blkno >= 0) {
+        if (b->dirty && bcache_writeback(b) < 0)
+            return NULL;
+        bcache_unhash(b);
+        bc.stats.evictions++;
+        if (b->prefetched)
+            bc.stats.ra_waste++;
+    }
+
+    b->blkno = blkno;
+    b->ref = 1;
+    b->prefetched = 0;
+    b->hnext = bc.htable[bhash(blkno)];
+    bc.htable[bhash(blkno)] = b;
+    return b;
+}
+
+//Set up a cache of nblocks buffers; 0 disables caching, as does a mapped image
+int bcache_init(int nblocks) {
+    int i, hsize;
+
+    if (bc.nbufs > 0 || nblocks <= 0 || dev_map) {
+        return 0;
+    }
+
+    for (hsize = 1; hsize < nblocks; hsize <<= 1)
+        ;
+
+    bc.bufs = (struct buf *) calloc(nblocks, sizeof(struct buf));
+    bc.htable = (struct buf **) calloc(hsize, sizeof(struct buf *));
+    char *pool = (char *) malloc((size_t) nblocks * BLOCK_SIZE);
+    if (!bc.bufs || !bc.htable || !pool) {
+        free(bc.bufs);
+        free(bc.htable);
+        free(pool);
+        memset(&bc, 0, sizeof(bc));
+        return -1;
+    }
+
+    for (i = 0; i < nblocks; i++) {
+        bc.bufs[i].blkno = -1;
+        bc.bufs[i].data = pool + (size_t) i * BLOCK_SIZE;
+    }
+    bc.nbufs = nblocks;
+    bc.hmask = hsize - 1;
+    bc.hand = 0;
+    memset(&bc.stats, 0, sizeof(bc.stats));
+    bc.stats.nbufs = nblocks;
+    return 0;
+}
+
+static int bcache_cmp(const void *a, const void *b) {
+    blk_t x = (*(struct buf **) a)->blkno, y = (*(struct buf **) b)->blkno;
+    return x < y ? -1 : x > y;
+}
+
+//msync the blocks written since the last flush, so they are on disk when this returns
+static int dev_map_flush() {
+    blk_t lo, hi;
+
+    pthread_mutex_lock(&dev_map_lock);
+    lo = dev_map_lo;
+    hi = dev_map_hi;
+    dev_map_lo = INT64_MAX;
+    dev_map_hi = -1;
+    pthread_mutex_unlock(&dev_map_lock);
+
+    if (hi < lo) {
+        return 0;
+    }
+    if (msync(dev_map + (size_t) lo * BLOCK_SIZE, (size_t) (hi - lo + 1) * BLOCK_SIZE, MS_SYNC) < 0) {
+        perror("disk_msync failed");
+        //Leave the range dirty so the next flush retries it
+        pthread_mutex_lock(&dev_map_lock);
+        if (lo < dev_map_lo)
+            dev_map_lo = lo;
+        if (hi > dev_map_hi)
+            dev_map_hi = hi;
+        pthread_mutex_unlock(&dev_map_lock);
+        return -1;
+    }
+    return 0;
+}
+
+//Write every dirty buffer back to the disk, in block order
+int bio_flush() {
+    int i, len, n = 0, nruns = 0, retstat = 0;
+
+    if (dev_map) {
+        return dev_map_flush();
+    }
+
+    pthread_mutex_lock(&bc_lock);
+    if (bc.stats.ndirty == 0) {
+        pthread_mutex_unlock(&bc_lock);
+        return 0;
+    }
+
+    struct buf **dirty = (struct buf **) malloc(bc.stats.ndirty * sizeof(struct buf *));
+    char **bufs = (char **) malloc(bc.stats.ndirty * sizeof(char *));
+    struct dev_run *runs = (struct dev_run *) malloc(bc.stats.ndirty * sizeof(struct dev_run));
+    if (!dirty || !bufs || !runs) {
+        pthread_mutex_unlock(&bc_lock);
+        free(dirty);
+        free(bufs);
+        free(runs);
+        return -1;
+    }
+    for (i = 0; i < bc.nbufs; i++) {
+        if (bc.bufs[i].dirty)
+            dirty[n++] = &bc.bufs[i];
+    }
+    qsort(dirty, n, sizeof(struct buf *), bcache_cmp);
+
+    //Each run of consecutive blocks is one request, and all runs go out as one batch
+    for (i = 0; i < n; i++)
+        bufs[i] = dirty[i]->data;
+    for (i = 0; i < n; i += len) {
+        for (len = 1; i + len < n && len < IOV_MAX && dirty[i + len]->blkno == dirty[i + len - 1]->blkno + 1; len++)
+            ;
+        runs[nruns].blkno = dirty[i]->blkno;
+        runs[nruns].n = len;
+        runs[nruns].bufs = bufs + i;
+        nruns++;
+    }
+    retstat = dev_submit(runs, nruns, 1);
+
+    for (i = 0; i < nruns; i++) {
+        if (runs[i].err)
+            continue;
+        for (len = 0; len < runs[i].n; len++)
+            dirty[runs[i].bufs - bufs + len]->dirty = 0;
+        bc.stats.ndirty -= runs[i].n;
+        bc.stats.writebacks += runs[i].n;
+    }
+    pthread_mutex_unlock(&bc_lock);
+    free(dirty);
+    free(bufs);
+    free(runs);
+    return retstat;
+}
+
+void bcache_stats(struct bcache_stats *stats) {
+    pthread_mutex_lock(&bc_lock);
+    memcpy(stats, &bc.stats, sizeof(struct bcache_stats));
+    pthread_mutex_unlock(&bc_lock);
+}
+
+static void bcache_destroy() {
+    if (bc.nbufs == 0) {
+        return;
+    }
+    bio_flush();
+    free(bc.bufs[0].data);
+    free(bc.bufs);
+    free(bc.htable);
+    memset(&bc, 0, sizeof(bc));
+}
+
+//Pass the DEV_MMAP_* access pattern on for part of the mapping
+static void dev_map_advise(char *p, size_t len) {
+    if (dev_map_flags & DEV_MMAP_RANDOM)
+        madvise(p, len, MADV_RANDOM);
+    if (dev_map_flags & DEV_MMAP_SEQUENTIAL)
+        madvise(p, len, MADV_SEQUENTIAL);
+    if (dev_map_flags & DEV_MMAP_WILLNEED)
+        madvise(p, len, MADV_WILLNEED);
+}
+
+//Map the open image; if that fails the device stays on pread/pwrite
+static void dev_map_image() {
+    struct stat st;
+    int i, flags = MAP_SHARED;
+    size_t reserve;
+    char *map, *base;
+
+    if (fstat(diskfile, &st) < 0 || st.st_size < BLOCK_SIZE) {
+        perror("disk_mmap failed");
+        dev_backend = DEV_BACKEND_PREAD;
+        return;
+    }
+
+    //Without room to grow in place the image is mapped as it is and cannot grow while mapped
+    reserve = dev_size_limit > (uint64_t) st.st_size ? dev_size_limit : (size_t) st.st_size;
+    base = (char *) mmap(NULL, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        base = NULL;
+        reserve = st.st_size;
+    } else {
+        flags |= MAP_FIXED;
+    }
+    if (dev_map_flags & DEV_MMAP_POPULATE)
+        flags |= MAP_POPULATE;
+    map = (char *) mmap(base, st.st_size, PROT_READ | PROT_WRITE, flags, diskfile, 0);
+    if (map == MAP_FAILED) {
+        perror("disk_mmap failed");
+        if (base)
+            munmap(base, reserve);
+        dev_backend = DEV_BACKEND_PREAD;
+        return;
+    }
+
+    //The page cache now caches the image; a buffer cache on top would only double it
+    bcache_destroy();
+    for (i = 0; i < DEV_MAP_STRIPES; i++)
+        pthread_mutex_init(&dev_map_stripe[i], NULL);
+    dev_map = map;
+    dev_map_size = st.st_size;
+    dev_map_reserved = reserve;
+    dev_map_advise(dev_map, dev_map_size);
+}
+
+static void dev_unmap_image() {
+    bio_flush();
+    munmap(dev_map, dev_map_reserved);
+    dev_map = NULL;
+    dev_map_size = 0;
+    dev_map_reserved = 0;
+}
+
+#ifdef TFS_IO_URING
+/*
+ * io_uring backend
+ *
+ * Every thread that touches the device gets its own ring, so FUSE worker
+ * threads never contend on a submission queue. Each ring registers the
+ * image fd and, when the buffer cache is up, the cache pool as a fixed
+ * buffer: writeback of dirty cache buffers then goes out as WRITE_FIXED,
+ * without the kernel pinning pages on every request. All
+ * runs of a batch are queued before a single submit, and the caller then
+ * reaps completions, sleeping in the kernel or busy-polling the CQ.
+ *
+ * dev_close() retires every ring by bumping uring_gen; a thread notices
+ * the stale generation on its next request and sets up a fresh ring.
+ */
+struct dev_ring {
+    struct io_uring     ring;
+    int                 fixed_file;     /* image fd registered at index 0 */
+    int                 fixed_buf;      /* cache pool registered at index 0 */
+    struct dev_ring     *next;
+};
+
+//One SQE in flight: a whole run, or one pool-resident piece of it
+struct dev_sqe {
+    struct dev_run      *run;
+    struct iovec        *iov;
+    int                 niov;
+    ssize_t             len;
+};
+
+static int uring_depth = DEV_URING_DEFAULT_DEPTH;
+static int uring_flags;
+static int uring_gen;
+static struct dev_ring *uring_rings;
+static pthread_mutex_t uring_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct dev_ring *tls_ring;
+static __thread int tls_ring_gen;
+
+static int uring_setup(struct io_uring *ring) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    if (uring_flags & DEV_URING_SQPOLL) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = 1000;
+    }
+    return io_uring_queue_init_params(uring_depth, ring, &p);
+}
+
+static struct dev_ring *uring_get() {
+    struct dev_ring *r;
+    struct iovec pool;
+
+    if (tls_ring && tls_ring_gen == __atomic_load_n(&uring_gen, __ATOMIC_ACQUIRE)) {
+        return tls_ring;
+    }
+
+    pthread_mutex_lock(&uring_lock);
+    r = (struct dev_ring *) calloc(1, sizeof(struct dev_ring));
+    if (!r || uring_setup(&r->ring) < 0) {
+        free(r);
+        pthread_mutex_unlock(&uring_lock);
+        return NULL;
+    }
+    r->fixed_file = io_uring_register_files(&r->ring, &diskfile, 1) == 0;
+    if (bc.nbufs > 0) {
+        //Fails once RLIMIT_MEMLOCK is used up; the ring then just reads into the pool unregistered
+        pool.iov_base = bc.bufs[0].data;
+        pool.iov_len = (size_t) bc.nbufs * BLOCK_SIZE;
+        r->fixed_buf = io_uring_register_buffers(&r->ring, &pool, 1) == 0;
+    }
+    r->next = uring_rings;
+    uring_rings = r;
+    tls_ring = r;
+    tls_ring_gen = uring_gen;
+    pthread_mutex_unlock(&uring_lock);
+    return r;
+}
+
+static void uring_destroy() {
+    struct dev_ring *r;
+
+    pthread_mutex_lock(&uring_lock);
+    while ((r = uring_rings) != NULL) {
+        uring_rings = r->next;
+        io_uring_queue_exit(&r->ring);
+        free(r);
+    }
+    __atomic_add_fetch(&uring_gen, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&uring_lock);
+}
+
+//Take a broken ring out of use; this thread sets up a new one next time
+static void uring_retire(struct dev_ring *r) {
+    struct dev_ring **pp;
+
+    pthread_mutex_lock(&uring_lock);
+    for (pp = &uring_rings; *pp && *pp != r; pp = &(*pp)->next)
+        ;
+    if (*pp)
+        *pp = r->next;
+    pthread_mutex_unlock(&uring_lock);
+    io_uring_queue_exit(&r->ring);
+    free(r);
+    tls_ring = NULL;
+}
+
+static inline int uring_in_pool(struct dev_ring *r, const struct iovec *iov) {
+    if (!r->fixed_buf)
+        return 0;
+    char *base = bc.bufs[0].data;
+    return (char *) iov->iov_base >= base &&
+        (char *) iov->iov_base + iov->iov_len <= base + (size_t) bc.nbufs * BLOCK_SIZE;
+}
+
+//Take one completion off the ring and account it to its run
+static int uring_reap(struct dev_ring *r, int write) {
+    struct io_uring_cqe *cqe;
+    struct dev_sqe *ds;
+    int ret;
+
+    for (;;) {
+        if (uring_flags & DEV_URING_CQPOLL)
+            ret = io_uring_peek_cqe(&r->ring, &cqe);
+        else
+            ret = io_uring_wait_cqe(&r->ring, &cqe);
+        if (ret == 0)
+            break;
+        if (ret != -EAGAIN && ret != -EINTR) {
+            fprintf(stderr, "io_uring wait failed: %s\n", strerror(-ret));
+            return -1;
+        }
+    }
+
+    ds = (struct dev_sqe *) io_uring_cqe_get_data(cqe);
+    ret = cqe->res;
+    io_uring_cqe_seen(&r->ring, cqe);
+
+    if (ret < 0) {
+        fprintf(stderr, "%s failed: %s\n", write ? "block_write" : "block_read", strerror(-ret));
+        ds->run->err = 1;
+    } else if (ret < ds->len) {
+        if (write)
+            ds->run->err = 1;
+        else
+            dev_zero_tail(ds->iov, ds->niov, ret);
+    }
+    return 0;
+}
+
+//Hand the queued SQEs to the kernel; queued drops by the number it took
+static int uring_push(struct dev_ring *r, int *queued) {
+    int ret;
+
+    do {
+        ret = io_uring_submit(&r->ring);
+    } while (ret == -EINTR || ret == -EAGAIN);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring submit failed: %s\n", strerror(-ret));
+        return -1;
+    }
+    *queued -= ret < *queued ? ret : *queued;
+    return 0;
+}
+
+static int dev_submit_uring(struct dev_run *runs, int nruns, int write) {
+    struct dev_ring *r = uring_get();
+    struct io_uring_sqe *sqe;
+    struct iovec *iov;
+    struct dev_sqe *sqes;
+    int i, j, k, niov, total = 0, nsqe = 0, inflight = 0, queued = 0, retstat = 0;
+    int fd;
+    off_t off;
+
+    if (!r) {
+        //No ring for this thread (out of memory or locked pages), do it synchronously
+        return dev_submit_sync(runs, nruns, write);
+    }
+
+    for (i = 0; i < nruns; i++)
+        total += runs[i].n;
+    iov = (struct iovec *) malloc(total * sizeof(struct iovec));
+    sqes = (struct dev_sqe *) malloc(total * sizeof(struct dev_sqe));
+    if (!iov || !sqes) {
+        free(iov);
+        free(sqes);
+        return dev_submit_sync(runs, nruns, write);
+    }
+    fd = r->fixed_file ? 0 : diskfile;
+
+    for (i = 0, k = 0; i < nruns; i++) {
+        runs[i].err = 0;
+        niov = dev_build_iov(runs[i].bufs, runs[i].n, iov + k);
+        off = (off_t) runs[i].blkno * BLOCK_SIZE;
+
+        //A run living entirely in the registered pool goes out as fixed-buffer pieces
+        for (j = 0; j < niov && uring_in_pool(r, &iov[k + j]); j++)
+            ;
+        int fixed = j == niov;
+
+        for (j = 0; j < niov; j++) {
+            //Never have more in flight than the CQ can hold
+            if (inflight == uring_depth) {
+                if (uring_push(r, &queued) < 0 || uring_reap(r, write) < 0)
+                    goto fail;
+                inflight--;
+            }
+            //A full SQ (the kernel may round it down, or SQPOLL not have caught up) is emptied first
+            while ((sqe = io_uring_get_sqe(&r->ring)) == NULL) {
+                if (uring_push(r, &queued) < 0)
+                    goto fail;
+            }
+            struct dev_sqe *ds = &sqes[nsqe++];
+            ds->run = &runs[i];
+            ds->iov = &iov[k + j];
+            ds->niov = fixed ? 1 : niov - j;
+            ds->len = 0;
+            for (int m = 0; m < ds->niov; m++)
+                ds->len += ds->iov[m].iov_len;
+
+            if (fixed && write)
+                io_uring_prep_write_fixed(sqe, fd, ds->iov->iov_base, ds->len, off, 0);
+            else if (fixed)
+                io_uring_prep_read_fixed(sqe, fd, ds->iov->iov_base, ds->len, off, 0);
+            else if (write)
+                io_uring_prep_writev(sqe, fd, ds->iov, ds->niov, off);
+            else
+                io_uring_prep_readv(sqe, fd, ds->iov, ds->niov, off);
+            if (r->fixed_file)
+                sqe->flags |= IOSQE_FIXED_FILE;
+            io_uring_sqe_set_data(sqe, ds);
+            inflight++;
+            queued++;
+            off += ds->len;
+            if (!fixed)
+                break;
+        }
+        k += niov;
+    }
+
+    if (uring_push(r, &queued) < 0)
+        goto fail;
+    while (inflight > 0) {
+        if (uring_reap(r, write) < 0)
+            goto fail;
+        inflight--;
+    }
+
+    for (i = 0; i < nruns; i++) {
+        if (runs[i].err)
+            retstat = -1;
+    }
+    free(iov);
+    free(sqes);
+    return retstat;
+
+fail:
+    //The kernel may still be using the iovecs and buffers of what it took: wait
+    //for those as long as the ring answers, then tear the ring down, which
+    //cancels the rest, and give this thread a new one
+    while (inflight > queued && uring_reap(r, write) == 0)
+        inflight--;
+    uring_retire(r);
+    for (i = 0; i < nruns; i++)
+        runs[i].err = 1;
+    free(iov);
+    free(sqes);
+    return -1;
+}
+#endif
+
+//Choose the device backend; called before the disk is opened
+int dev_set_backend(int backend, int depth, int flags) {
+    if (backend == DEV_BACKEND_PREAD) {
+        dev_backend = DEV_BACKEND_PREAD;
+        return 0;
+    }
+    if (backend == DEV_BACKEND_MMAP) {
+        dev_map_flags = flags;
+        dev_backend = DEV_BACKEND_MMAP;
+        return 0;
+    }
+#ifdef TFS_IO_URING
+    if (backend == DEV_BACKEND_URING) {
+        struct io_uring probe;
+
+        uring_depth = depth > 0 ? depth : DEV_URING_DEFAULT_DEPTH;
+        uring_flags = flags;
+        //Make sure the kernel allows rings of this shape before committing to them
+        if (uring_setup(&probe) < 0) {
+            return -1;
+        }
+        io_uring_queue_exit(&probe);
+        dev_backend = DEV_BACKEND_URING;
+        return 0;
+    }
+#else
+    (void) depth;
+#endif
+    return -1;
+}
+
+//Choose the block size; called before the cache is set up and any block is moved
+int dev_set_block_size(uint32_t size) {
+    if (size < BLOCK_SIZE_MIN || size > BLOCK_SIZE_MAX || (size & (size - 1)) || bc.nbufs > 0) {
+        return -1;
+    }
+    dev_block_size = size;
+    return 0;
+}
+
+//Creates a file of size bytes which is your new emulated disk; it starts out all holes
+void dev_init(const char* diskfile_path, uint64_t size) {
     if (diskfile >= 0) {
 		return;
     }
     
-    diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    diskfile = open(diskfile_path, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
     if (diskfile < 0) {
 		perror("disk_open failed");
 		exit(EXIT_FAILURE);
     }
 	
-    ftruncate(diskfile, DISK_SIZE);
+    if (ftruncate(diskfile, size) < 0) {
+		perror("disk_truncate failed");
+		exit(EXIT_FAILURE);
+    }
+    if (dev_backend == DEV_BACKEND_MMAP) {
+        dev_map_image();
+    }
 }
 
 //Function to open the disk file
@@ -49,36 +876,1536 @@ int dev_open(const char* diskfile_path) {
     if (diskfile < 0) {
 		perror("disk_open failed");
 		return -1;
+    }
+    if (dev_backend == DEV_BACKEND_MMAP) {
+        dev_map_image();
     }
 	return 0;
 }
 
+/*
+ * Set the largest size in bytes the image may grow to. A mapped image is
+ * mapped again with that much address space behind it; call this before
+ * any pointer into the mapping is handed out.
+ */
+void dev_set_size_limit(uint64_t limit) {
+    dev_size_limit = limit;
+    if (dev_map && dev_map_reserved < limit) {
+        dev_unmap_image();
+        dev_map_image();
+    }
+}
+
+//Extend the image to size bytes, mapping the new tail behind the current mapping
+int dev_grow(uint64_t size) {
+    struct stat st;
+
+    if (fstat(diskfile, &st) < 0) {
+        perror("disk_grow failed");
+        return -1;
+    }
+    if ((uint64_t) st.st_size < size && ftruncate(diskfile, size) < 0) {
+        perror("disk_grow failed");
+        return -1;
+    }
+    if (dev_map && size > dev_map_size) {
+        int flags = MAP_SHARED | MAP_FIXED | (dev_map_flags & DEV_MMAP_POPULATE ? MAP_POPULATE : 0);
+        if (size > dev_map_reserved ||
+            mmap(dev_map + dev_map_size, size - dev_map_size, PROT_READ | PROT_WRITE, flags, diskfile, dev_map_size) == MAP_FAILED) {
+            fprintf(stderr, "disk_grow failed: no room to grow the mapping\n");
+            return -1;
+        }
+        dev_map_advise(dev_map + dev_map_size, size - dev_map_size);
+        __atomic_store_n(&dev_map_size, size, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+//Read bytes at off straight from the image, for the superblock before the block size is known
+int dev_peek(off_t off, void *buf, size_t len) {
+    if (pread(diskfile, buf, len, off) != (ssize_t) len) {
+        return -1;
+    }
+    return 0;
+}
+
 void dev_close() {
     if (diskfile >= 0) {
+		if (dev_map) {
+			dev_unmap_image();
+		}
+		bcache_destroy();
+#ifdef TFS_IO_URING
+		uring_destroy();
+#endif
 		close(diskfile);
+		diskfile = -1;
     }
 }
 
-//Read a block from the disk
-int bio_read(const int block_num, void *buf) {
+//Make everything written so far durable
+int dev_sync() {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat <= 0) {
-		memset (buf, 0, BLOCK_SIZE);
-		if (retstat < 0)
-			perror("block_read failed");
-    }
 
+    if (dev_map && dev_map_flush() < 0)
+        retstat = -1;
+    if (fdatasync(diskfile) < 0) {
+        perror("disk_sync failed");
+        retstat = -1;
+    }
     return retstat;
 }
 
-//Write a block to the disk
-int bio_write(const int block_num, const void *buf) {
-    int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat < 0) {
-		    perror("block_write failed");
+/*
+ * Metadata journal
+ *
+ * Metadata blocks are written with bio_write_meta() and never go straight
+ * home. The latest image of each is kept in the journal overlay, which
+ * bio_read() looks at first, and is added to the running transaction.
+ * jnl_commit() seals the running transaction and writes it to the journal
+ * region as one sequential record: descriptor blocks listing the block
+ * numbers, the block images, and a commit block with a checksum over the
+ * rest. Records are copied to the blocks' home locations later, in block
+ * order, by jnl_checkpoint(), which then frees their journal space. At
+ * mount jnl_open() replays every complete record still in the journal, so
+ * the metadata on disk is always the result of whole transactions.
+ *
+ * Filesystem operations bracket their changes with jnl_start() and
+ * jnl_stop(). A commit waits for the operations in flight and holds new
+ * ones off while the caller pushes its in-memory metadata into the
+ * transaction, so no transaction holds half an operation, and everything
+ * that finished since the last commit goes out in the same journal write.
+ *
+ * File data is not journalled: it is written in place and flushed before
+ * the commit record that refers to it. A metadata block that is freed and
+ * then written as file data is revoked, so neither the checkpoint nor a
+ * replay writes an older image of it over the data.
+ *
+ * jnl_lock guards the overlay, the transactions and the counters;
+ * jnl_commit_lock serializes commits and checkpoints. jnl_lock is taken
+ * before bc_lock.
+ */
+#define JNL_MAGIC           0x4A4E4C31
+#define JNL_DESC_MAGIC      0x4A444553
+#define JNL_COMMIT_MAGIC    0x4A434D54
+#define JNL_HASH            1024
+
+//Block 0 of the journal region; the rest is a circular log of records
+struct jnl_super {
+    uint32_t    magic;
+    uint32_t    tail;               /* log position of the oldest live record */
+    uint64_t    seq;                /* transaction id of that record */
+};
+
+//First block of a record; blk[] runs on into further descriptor blocks
+struct jnl_desc {
+    uint32_t    magic;
+    uint32_t    ndesc;              /* descriptor blocks in the record */
+    uint32_t    nblocks;            /* block images following them */
+    uint32_t    nrevoke;            /* revoked block numbers after the logged ones */
+    uint64_t    tid;
+    uint64_t    blk[];
+};
+
+//Last block of a record
+struct jnl_commit {
+    uint32_t    magic;
+    uint32_t    checksum;           /* over the descriptor blocks and images */
+    uint64_t    tid;
+};
+
+//Latest image of a metadata block that has not reached its home yet
+struct jbuf {
+    blk_t       blkno;
+    uint64_t    tid;                /* transaction that last wrote it */
+    char        *data;
+    struct jbuf *hnext;
+};
+
+//A committed record waiting to be checkpointed
+struct jtxn {
+    uint64_t    tid;
+    uint32_t    pos;                /* where the record starts in the log */
+    uint32_t    len;                /* record length in blocks */
+    int         nblocks;
+    blk_t       *blk;               /* home of each image, -1 once revoked */
+    uint64_t    revoked;            /* last transaction that revoked one of them */
+    char        *record;            /* the whole record as written */
+    struct jtxn *next;
+};
+
+static struct journal {
+    int         active;
+    blk_t       start;              /* first block of the region */
+    uint32_t    size;               /* blocks in the log, after the journal superblock */
+    uint32_t    head;               /* log position the next record goes to */
+    uint32_t    tail;
+    uint32_t    used;               /* log blocks held by live records */
+    uint64_t    seq;
+    struct jbuf **htable;
+    uint32_t    nbufs;              /* overlay entries, read unlocked by bio_read() */
+    uint64_t    tid;                /* running transaction */
+    struct jbuf **run;              /* blocks it logs */
+    int         nrun, caprun;
+    blk_t       *revoke;            /* blocks it revokes */
+    int         nrevoke, caprevoke;
+    uint32_t    updates;            /* operations in flight */
+    int         locked;             /* a commit is holding new operations off */
+    int         ckpt_busy;          /* a checkpoint is writing blocks home */
+    uint64_t    committed;          /* last transaction made durable */
+    uint64_t    failed;             /* last transaction whose commit hit an error */
+    struct jtxn *oldest, *newest;   /* committed records not checkpointed yet */
+    struct jnl_stats stats;
+} jnl;
+
+static pthread_mutex_t jnl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t jnl_commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jnl_cond = PTHREAD_COND_INITIALIZER;
+static __thread int jnl_depth;
+
+static inline int jhash(blk_t blkno) {
+    return (int) (((uint64_t) blkno * 0x9E3779B97F4A7C15ull) >> 32) & (JNL_HASH - 1);
+}
+
+static struct jbuf *jnl_lookup(blk_t blkno) {
+    struct jbuf *jb;
+    for (jb = jnl.htable[jhash(blkno)]; jb; jb = jb->hnext) {
+        if (jb->blkno == blkno)
+            return jb;
+    }
+    return NULL;
+}
+
+static void jnl_drop(struct jbuf *jb) {
+    struct jbuf **pp = &jnl.htable[jhash(jb->blkno)];
+    while (*pp != jb)
+        pp = &(*pp)->hnext;
+    *pp = jb->hnext;
+    __atomic_store_n(&jnl.nbufs, jnl.nbufs - 1, __ATOMIC_RELAXED);
+    free(jb->data);
+    free(jb);
+}
+
+static uint32_t jnl_checksum(const char *p, size_t len) {
+    uint32_t h = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= (uint8_t) p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+//Move n blocks to or from log position pos, wrapping at the end of the log
+static int jnl_xfer(uint32_t pos, char *data, uint32_t n, int write) {
+    struct dev_run runs[2];
+    char *bufs[n];
+    uint32_t i, first = jnl.size - pos < n ? jnl.size - pos : n;
+    int nruns = 0;
+
+    for (i = 0; i < n; i++)
+        bufs[i] = data + (size_t) i * BLOCK_SIZE;
+    if (dev_map) {
+        for (i = 0; i < n; i++) {
+            if (dev_map_xfer(jnl.start + 1 + (pos + i) % jnl.size, bufs[i], write) < 0)
+                return -1;
+        }
+        return 0;
+    }
+    runs[nruns++] = (struct dev_run) { jnl.start + 1 + pos, first, bufs, 0 };
+    if (first < n)
+        runs[nruns++] = (struct dev_run) { jnl.start + 1, n - first, bufs + first, 0 };
+    return dev_submit(runs, nruns, write);
+}
+
+//Move one block of the journal region, through the mapping if there is one
+static int jnl_dev_xfer(blk_t blkno, char *buf, int write) {
+    char *bufs[1] = { buf };
+    return dev_map ? dev_map_xfer(blkno, buf, write) : dev_xferv(blkno, bufs, 1, write);
+}
+
+static int jnl_write_super() {
+    char *block = calloc(1, BLOCK_SIZE);
+    struct jnl_super *js = (struct jnl_super *) block;
+    int retstat;
+
+    if (!block)
+        return -1;
+    js->magic = JNL_MAGIC;
+    js->tail = jnl.tail;
+    js->seq = jnl.seq;
+    retstat = jnl_dev_xfer(jnl.start, block, 1);
+    free(block);
+    return retstat < 0 ? -1 : 0;
+}
+
+static int jnl_blk_cmp(const void *a, const void *b) {
+    blk_t x = **(blk_t **) a, y = **(blk_t **) b;
+    return x < y ? -1 : x > y;
+}
+
+//Write the images of a record home, in block order, skipping revoked blocks
+static int jnl_write_home(struct jtxn *t) {
+    blk_t **order = (blk_t **) malloc(t->nblocks * sizeof(blk_t *) + 1);
+    char **bufs = (char **) malloc(t->nblocks * sizeof(char *) + 1);
+    struct dev_run *runs = (struct dev_run *) malloc(t->nblocks * sizeof(struct dev_run) + 1);
+    char *images;
+    int i, n = 0, nruns = 0, retstat = 0;
+
+    if (!order || !bufs || !runs) {
+        retstat = -1;
+        goto out;
+    }
+    images = t->record + (size_t) (t->len - t->nblocks - 1) * BLOCK_SIZE;
+    for (i = 0; i < t->nblocks; i++) {
+        if (t->blk[i] >= 0)
+            order[n++] = &t->blk[i];
     }
+    qsort(order, n, sizeof(blk_t *), jnl_blk_cmp);
+    for (i = 0; i < n; i++) {
+        bufs[i] = images + (size_t) (order[i] - t->blk) * BLOCK_SIZE;
+        if (dev_map) {
+            if (dev_map_xfer(*order[i], bufs[i], 1) < 0)
+                retstat = -1;
+            continue;
+        }
+        if (nruns > 0 && *order[i] == runs[nruns - 1].blkno + runs[nruns - 1].n && runs[nruns - 1].n < IOV_MAX) {
+            runs[nruns - 1].n++;
+        } else {
+            runs[nruns++] = (struct dev_run) { *order[i], 1, bufs + i, 0 };
+        }
+    }
+    if (nruns > 0 && dev_submit(runs, nruns, 1) < 0)
+        retstat = -1;
+    pthread_mutex_lock(&jnl_lock);
+    jnl.stats.checkpointed += n;
+    pthread_mutex_unlock(&jnl_lock);
+
+out:
+    free(order);
+    free(bufs);
+    free(runs);
     return retstat;
 }
 
+//Forget a record whose images are home: overlay entries it holds the latest image of go too
+static void jnl_retire(struct jtxn *t) {
+    struct jbuf *jb;
+    int i;
+
+    for (i = 0; i < t->nblocks; i++) {
+        if (t->blk[i] >= 0 && (jb = jnl_lookup(t->blk[i])) != NULL && jb->tid == t->tid)
+            jnl_drop(jb);
+    }
+    free(t->blk);
+    free(t->record);
+    free(t);
+}
+
+/*
+ * Checkpoint the oldest records until at most keep log blocks are in use.
+ * Their blocks are made durable at home before the journal superblock
+ * lets go of the records. A record with a block revoked by a transaction
+ * that is not durable yet has to stay: until that transaction commits, a
+ * crash must still replay the image the checkpoint skipped. Caller holds
+ * jnl_commit_lock.
+ */
+static int jnl_checkpoint_locked(uint32_t keep) {
+    struct jtxn *t;
+    int done = 0, retstat = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&jnl_lock);
+        t = jnl.oldest;
+        if (!t || jnl.used <= keep || t->revoked > jnl.committed) {
+            pthread_mutex_unlock(&jnl_lock);
+            break;
+        }
+        //Revokes wait, so the record's block list holds still meanwhile
+        jnl.ckpt_busy = 1;
+        pthread_mutex_unlock(&jnl_lock);
+
+        retstat = jnl_write_home(t) < 0 || dev_sync() < 0 ? -1 : 0;
+
+        pthread_mutex_lock(&jnl_lock);
+        jnl.ckpt_busy = 0;
+        if (retstat == 0) {
+            jnl.oldest = t->next;
+            if (!jnl.oldest)
+                jnl.newest = NULL;
+            jnl.used -= t->len;
+            jnl.tail = (t->pos + t->len) % jnl.size;
+            jnl.seq = t->tid + 1;
+            jnl_retire(t);
+            done++;
+        }
+        pthread_cond_broadcast(&jnl_cond);
+        pthread_mutex_unlock(&jnl_lock);
+        if (retstat < 0)
+            break;
+    }
+
+    if (done > 0 && (jnl_write_super() < 0 || dev_sync() < 0))
+        retstat = -1;
+    return retstat;
+}
+
+int jnl_checkpoint(uint32_t keep) {
+    int retstat;
+
+    if (!jnl.active)
+        return 0;
+    pthread_mutex_lock(&jnl_commit_lock);
+    retstat = jnl_checkpoint_locked(keep);
+    pthread_mutex_unlock(&jnl_commit_lock);
+    return retstat;
+}
+
+//Lay out a fresh, empty journal in nblocks blocks from start
+int jnl_format(blk_t start, uint32_t nblocks) {
+    char *block = calloc(1, BLOCK_SIZE);
+    int retstat;
+
+    if (!block)
+        return -1;
+    jnl.start = start;
+    jnl.size = nblocks - 1;
+    jnl.tail = 0;
+    jnl.seq = 1;
+    //A zeroed first log block can never pass for a record
+    retstat = jnl_dev_xfer(start + 1, block, 1) < 0 || jnl_write_super() < 0 ? -1 : 0;
+    free(block);
+    return retstat;
+}
+
+/*
+ * Read the record at log position pos if it is complete and newer than
+ * transaction tid; returns its length or 0. Empty transactions leave no
+ * record, so ids only ever increase along the log, and a leftover from
+ * an earlier pass around it is older than what precedes it.
+ */
+static uint32_t jnl_read_record(uint32_t pos, uint64_t tid, char **record) {
+    char *block = malloc(BLOCK_SIZE);
+    struct jnl_desc *d = (struct jnl_desc *) block;
+    uint32_t len = 0;
+    char *r = NULL;
+
+    *record = NULL;
+    if (!block || jnl_xfer(pos, block, 1, 0) < 0)
+        goto out;
+    if (d->magic != JNL_DESC_MAGIC || d->tid < tid || d->ndesc == 0 ||
+        (uint64_t) d->ndesc + d->nblocks + 1 > jnl.size ||
+        sizeof(struct jnl_desc) + ((uint64_t) d->nblocks + d->nrevoke) * sizeof(uint64_t) > (uint64_t) d->ndesc * BLOCK_SIZE)
+        goto out;
+
+    len = d->ndesc + d->nblocks + 1;
+    if (!(r = malloc((size_t) len * BLOCK_SIZE)) || jnl_xfer(pos, r, len, 0) < 0) {
+        len = 0;
+        goto out;
+    }
+    struct jnl_commit *c = (struct jnl_commit *) (r + (size_t) (len - 1) * BLOCK_SIZE);
+    if (c->magic != JNL_COMMIT_MAGIC || c->tid != ((struct jnl_desc *) r)->tid ||
+        c->checksum != jnl_checksum(r, (size_t) (len - 1) * BLOCK_SIZE)) {
+        len = 0;
+        goto out;
+    }
+    *record = r;
+    r = NULL;
+
+out:
+    free(r);
+    free(block);
+    return len;
+}
+
+/*
+ * Replay the complete records in the journal, oldest first, skipping
+ * images revoked by a later record, then empty the journal.
+ */
+static int jnl_replay() {
+    struct jtxn *first = NULL, **link = &first, *t, *u;
+    uint32_t pos = jnl.tail, scanned = 0, len;
+    uint64_t tid = jnl.seq;
+    char *record;
+    int i, k, retstat = 0;
+
+    while (scanned < jnl.size && (len = jnl_read_record(pos, tid, &record)) > 0) {
+        if (scanned + len > jnl.size) {
+            free(record);
+            break;
+        }
+        if (!(t = calloc(1, sizeof(struct jtxn)))) {
+            free(record);
+            retstat = -1;
+            break;
+        }
+        t->tid = ((struct jnl_desc *) record)->tid;
+        t->pos = pos;
+        t->len = len;
+        t->record = record;
+        *link = t;
+        link = &t->next;
+        pos = (pos + len) % jnl.size;
+        scanned += len;
+        tid = t->tid + 1;
+    }
+
+    for (t = first; t && retstat == 0; t = t->next) {
+        struct jnl_desc *d = (struct jnl_desc *) t->record;
+        if (!(t->blk = malloc(d->nblocks * sizeof(blk_t) + 1))) {
+            retstat = -1;
+            break;
+        }
+        t->nblocks = d->nblocks;
+        for (i = 0; i < t->nblocks; i++) {
+            t->blk[i] = d->blk[i];
+            //A later record that revokes the block means the image is stale
+            for (u = t->next; u && t->blk[i] >= 0; u = u->next) {
+                struct jnl_desc *ud = (struct jnl_desc *) u->record;
+                for (k = 0; k < (int) ud->nrevoke; k++) {
+                    if (ud->blk[ud->nblocks + k] == (uint64_t) t->blk[i]) {
+                        t->blk[i] = -1;
+                        break;
+                    }
+                }
+            }
+        }
+        if (jnl_write_home(t) < 0)
+            retstat = -1;
+        jnl.stats.replayed++;
+    }
+
+    while (first) {
+        t = first->next;
+        free(first->blk);
+        free(first->record);
+        free(first);
+        first = t;
+    }
+    if (retstat < 0 || dev_sync() < 0)
+        return -1;
+
+    jnl.tail = pos;
+    jnl.seq = tid;
+    return jnl_write_super() < 0 || dev_sync() < 0 ? -1 : 0;
+}
+
+//Start journalling into the region of nblocks blocks at start, replaying what it holds
+int jnl_open(blk_t start, uint32_t nblocks) {
+    char *block = malloc(BLOCK_SIZE);
+    struct jnl_super *js = (struct jnl_super *) block;
+    int retstat = -1;
+
+    memset(&jnl, 0, sizeof(jnl));
+    if (!block)
+        return -1;
+    jnl.start = start;
+    jnl.size = nblocks - 1;
+    if (jnl_dev_xfer(start, block, 0) < 0 ||
+        js->magic != JNL_MAGIC || js->tail >= jnl.size) {
+        fprintf(stderr, "journal superblock at block %ld is damaged\n", (long) start);
+        goto out;
+    }
+    jnl.tail = js->tail;
+    jnl.seq = js->seq;
+    if (jnl_replay() < 0)
+        goto out;
+    if (jnl.stats.replayed > 0)
+        printf("Journal: replayed %lu transactions\n", jnl.stats.replayed);
+
+    if (!(jnl.htable = calloc(JNL_HASH, sizeof(struct jbuf *))))
+        goto out;
+    jnl.head = jnl.tail;
+    jnl.tid = jnl.seq;
+    jnl.committed = jnl.seq - 1;
+    jnl.failed = jnl.committed;
+    jnl.stats.size = jnl.size;
+    jnl.active = 1;
+    retstat = 0;
+
+out:
+    free(block);
+    return retstat;
+}
+
+//Checkpoint everything and stop journalling; metadata writes go straight to the cache again
+int jnl_close() {
+    struct jbuf *jb, *next;
+    int i, retstat;
+
+    if (!jnl.active)
+        return 0;
+    retstat = jnl_checkpoint(0);
+    pthread_mutex_lock(&jnl_lock);
+    for (i = 0; i < JNL_HASH; i++) {
+        for (jb = jnl.htable[i]; jb; jb = next) {
+            next = jb->hnext;
+            free(jb->data);
+            free(jb);
+        }
+    }
+    while (jnl.oldest) {
+        struct jtxn *t = jnl.oldest->next;
+        free(jnl.oldest->blk);
+        free(jnl.oldest->record);
+        free(jnl.oldest);
+        jnl.oldest = t;
+    }
+    free(jnl.htable);
+    free(jnl.run);
+    free(jnl.revoke);
+    jnl.htable = NULL;
+    jnl.run = NULL;
+    jnl.revoke = NULL;
+    jnl.nbufs = 0;
+    jnl.active = 0;
+    pthread_mutex_unlock(&jnl_lock);
+    return retstat;
+}
+
+//Join the running transaction; a commit in progress makes this wait
+void jnl_start() {
+    if (!jnl.active || jnl_depth++ > 0)
+        return;
+    pthread_mutex_lock(&jnl_lock);
+    while (jnl.locked)
+        pthread_cond_wait(&jnl_cond, &jnl_lock);
+    jnl.updates++;
+    jnl.stats.handles++;
+    pthread_mutex_unlock(&jnl_lock);
+}
+
+void jnl_stop() {
+    if (!jnl.active || jnl_depth == 0 || --jnl_depth > 0)
+        return;
+    pthread_mutex_lock(&jnl_lock);
+    if (--jnl.updates == 0 && jnl.locked)
+        pthread_cond_broadcast(&jnl_cond);
+    pthread_mutex_unlock(&jnl_lock);
+}
+
+//The transaction changes made now belong to
+uint64_t jnl_tid() {
+    uint64_t tid;
+    pthread_mutex_lock(&jnl_lock);
+    tid = jnl.tid;
+    pthread_mutex_unlock(&jnl_lock);
+    return tid;
+}
+
+/*
+ * Wait until transaction tid is durable. Returns -1 if it never made it,
+ * or if the commit that carried it (or a later one) hit an error.
+ */
+int jnl_wait(uint64_t tid) {
+    int retstat;
+
+    pthread_mutex_lock(&jnl_lock);
+    while (jnl.active && jnl.committed < tid)
+        pthread_cond_wait(&jnl_cond, &jnl_lock);
+    retstat = jnl.committed < tid || jnl.failed >= tid ? -1 : 0;
+    pthread_mutex_unlock(&jnl_lock);
+    return retstat;
+}
+
+void jnl_stats(struct jnl_stats *stats) {
+    pthread_mutex_lock(&jnl_lock);
+    memcpy(stats, &jnl.stats, sizeof(struct jnl_stats));
+    stats->tid = jnl.tid;
+    stats->committed = jnl.committed;
+    stats->used = jnl.used;
+    stats->running = jnl.nrun + jnl.nrevoke;
+    pthread_mutex_unlock(&jnl_lock);
+}
+
+//Turn the running transaction into a record and start a new one. Caller holds jnl_lock.
+static struct jtxn *jnl_seal() {
+    struct jtxn *t;
+    uint32_t entries = jnl.nrun + jnl.nrevoke;
+    uint32_t ndesc = (sizeof(struct jnl_desc) + entries * sizeof(uint64_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int i;
+
+    if (entries == 0)
+        return NULL;
+    if (!(t = calloc(1, sizeof(struct jtxn))) ||
+        !(t->blk = malloc(jnl.nrun * sizeof(blk_t) + 1)) ||
+        !(t->record = calloc(ndesc + jnl.nrun + 1, BLOCK_SIZE))) {
+        if (t)
+            free(t->blk);
+        free(t);
+        return NULL;
+    }
+    t->tid = jnl.tid;
+    t->nblocks = jnl.nrun;
+    t->len = ndesc + jnl.nrun + 1;
+
+    struct jnl_desc *d = (struct jnl_desc *) t->record;
+    d->magic = JNL_DESC_MAGIC;
+    d->ndesc = ndesc;
+    d->nblocks = jnl.nrun;
+    d->nrevoke = jnl.nrevoke;
+    d->tid = t->tid;
+    char *images = t->record + (size_t) ndesc * BLOCK_SIZE;
+    for (i = 0; i < jnl.nrun; i++) {
+        d->blk[i] = t->blk[i] = jnl.run[i]->blkno;
+        memcpy(images + (size_t) i * BLOCK_SIZE, jnl.run[i]->data, BLOCK_SIZE);
+    }
+    for (i = 0; i < jnl.nrevoke; i++)
+        d->blk[jnl.nrun + i] = jnl.revoke[i];
+
+    struct jnl_commit *c = (struct jnl_commit *) (t->record + (size_t) (t->len - 1) * BLOCK_SIZE);
+    c->magic = JNL_COMMIT_MAGIC;
+    c->tid = t->tid;
+    c->checksum = jnl_checksum(t->record, (size_t) (t->len - 1) * BLOCK_SIZE);
+
+    jnl.stats.logged += jnl.nrun;
+    jnl.nrun = 0;
+    jnl.nrevoke = 0;
+    return t;
+}
+
+/*
+ * Commit the running transaction. Once the operations in flight are done,
+ * prepare() is called with new ones held off, to push in-memory metadata
+ * into the transaction. The transaction is then sealed, file data written
+ * so far is flushed, and the record is written to the log and made
+ * durable, checkpointing older records first if the log is too full.
+ * Must not be called inside jnl_start()/jnl_stop().
+ */
+int jnl_commit(int (*prepare)(void)) {
+    struct jtxn *t;
+    uint64_t tid;
+    int retstat = 0;
+
+    if (!jnl.active) {
+        if (prepare && prepare() < 0)
+            retstat = -1;
+        return bio_flush() < 0 ? -1 : retstat;
+    }
+
+    pthread_mutex_lock(&jnl_commit_lock);
+    pthread_mutex_lock(&jnl_lock);
+    jnl.locked = 1;
+    while (jnl.updates > 0)
+        pthread_cond_wait(&jnl_cond, &jnl_lock);
+    pthread_mutex_unlock(&jnl_lock);
+
+    if (prepare && prepare() < 0)
+        retstat = -1;
+
+    pthread_mutex_lock(&jnl_lock);
+    tid = jnl.tid;
+    t = jnl_seal();
+    if (!t && jnl.nrun + jnl.nrevoke > 0) {
+        //No memory for the record: leave the transaction running
+        jnl.locked = 0;
+        pthread_cond_broadcast(&jnl_cond);
+        pthread_mutex_unlock(&jnl_lock);
+        pthread_mutex_unlock(&jnl_commit_lock);
+        return -1;
+    }
+    jnl.tid++;
+    jnl.locked = 0;
+    pthread_cond_broadcast(&jnl_cond);
+    pthread_mutex_unlock(&jnl_lock);
+
+    /*
+     * Ordered mode: file data is durable before the record that points
+     * at it is written. The record itself needs no barrier before its
+     * commit block: replay checks the commit block's checksum over the
+     * descriptor and images, so a record torn by a crash is ignored.
+     */
+    if (bio_flush() < 0)
+        retstat = -1;
+    if (t && dev_sync() < 0)
+        retstat = -1;
+
+    if (t) {
+        if (t->len > jnl.size - jnl.used && jnl_checkpoint_locked(t->len < jnl.size ? jnl.size - t->len : 0) < 0)
+            retstat = -1;
+        if (t->len <= jnl.size - jnl.used) {
+            t->pos = jnl.head;
+            if (jnl_xfer(t->pos, t->record, t->len, 1) < 0)
+                t->len = 0;
+        } else {
+            t->len = 0;
+        }
+        /*
+         * A record that cannot be logged is written home directly, and
+         * older records must not put back what it replaced. This loses
+         * atomicity for the transaction, so it is only a last resort.
+         */
+        if (t->len == 0) {
+            struct jtxn *u;
+            int i, j;
+
+            fprintf(stderr, "journal: transaction %lu written home unlogged\n", t->tid);
+            pthread_mutex_lock(&jnl_lock);
+            for (u = jnl.oldest; u; u = u->next) {
+                for (i = 0; i < u->nblocks; i++) {
+                    for (j = 0; j < t->nblocks && u->blk[i] >= 0; j++) {
+                        if (u->blk[i] == t->blk[j])
+                            u->blk[i] = -1;
+                    }
+                }
+            }
+            pthread_mutex_unlock(&jnl_lock);
+            if (jnl_write_home(t) < 0)
+                retstat = -1;
+        }
+    }
+    if (dev_sync() < 0)
+        retstat = -1;
+
+    pthread_mutex_lock(&jnl_lock);
+    if (t && t->len > 0) {
+        if (jnl.newest)
+            jnl.newest->next = t;
+        else
+            jnl.oldest = t;
+        jnl.newest = t;
+        jnl.head = (t->pos + t->len) % jnl.size;
+        jnl.used += t->len;
+    } else if (t) {
+        jnl_retire(t);
+    }
+    jnl.committed = tid;
+    if (retstat < 0)
+        jnl.failed = tid;
+    jnl.stats.commits++;
+    pthread_cond_broadcast(&jnl_cond);
+    pthread_mutex_unlock(&jnl_lock);
+    pthread_mutex_unlock(&jnl_commit_lock);
+    return retstat;
+}
+
+//Overlay image of a metadata block, if it has one; returns 1 if buf was filled
+static int jnl_read(blk_t blkno, void *buf) {
+    struct jbuf *jb;
+
+    if (!jnl.active || __atomic_load_n(&jnl.nbufs, __ATOMIC_RELAXED) == 0)
+        return 0;
+    pthread_mutex_lock(&jnl_lock);
+    if ((jb = jnl_lookup(blkno)) != NULL)
+        memcpy(buf, jb->data, BLOCK_SIZE);
+    pthread_mutex_unlock(&jnl_lock);
+    return jb != NULL;
+}
+
+static int jnl_grow(void *arrp, int *cap, size_t size) {
+    void **arr = (void **) arrp;
+    int ncap = *cap ? *cap * 2 : 64;
+    void *grown = realloc(*arr, ncap * size);
+    if (!grown)
+        return -1;
+    *arr = grown;
+    *cap = ncap;
+    return 0;
+}
+
+/*
+ * Blocks [block_num, block_num + nblocks) are about to be written as file
+ * data. Any of them the journal still holds as metadata is dropped from
+ * the overlay and from the records awaiting checkpoint, and revoked in
+ * the running transaction so a replay leaves the data alone.
+ */
+static void jnl_revoke(blk_t block_num, int nblocks) {
+    struct jbuf *jb;
+    struct jtxn *t;
+    int i, j;
+
+    if (!jnl.active || __atomic_load_n(&jnl.nbufs, __ATOMIC_RELAXED) == 0)
+        return;
+    pthread_mutex_lock(&jnl_lock);
+    for (i = 0; i < nblocks; i++) {
+        if (!jnl_lookup(block_num + i))
+            continue;
+        while (jnl.ckpt_busy)
+            pthread_cond_wait(&jnl_cond, &jnl_lock);
+        if (!(jb = jnl_lookup(block_num + i)))
+            continue;
+
+        if (jb->tid == jnl.tid) {
+            for (j = 0; j < jnl.nrun && jnl.run[j] != jb; j++)
+                ;
+            if (j < jnl.nrun)
+                jnl.run[j] = jnl.run[--jnl.nrun];
+        }
+        for (t = jnl.oldest; t; t = t->next) {
+            for (j = 0; j < t->nblocks; j++) {
+                if (t->blk[j] == jb->blkno) {
+                    t->blk[j] = -1;
+                    t->revoked = jnl.tid;
+                }
+            }
+        }
+        if (jnl.nrevoke < jnl.caprevoke || jnl_grow(&jnl.revoke, &jnl.caprevoke, sizeof(blk_t)) == 0) {
+            jnl.revoke[jnl.nrevoke++] = jb->blkno;
+            jnl.stats.revoked++;
+        }
+        jnl_drop(jb);
+    }
+    pthread_mutex_unlock(&jnl_lock);
+}
+
+
+//Read a block from the disk
+static int bio_read_block(const blk_t block_num, void *buf) {
+    int retstat = 0;
+    struct buf *b = NULL;
+
+    if (jnl_read(block_num, buf)) {
+        return BLOCK_SIZE;
+    }
+    if (dev_map) {
+        return dev_map_xfer(block_num, buf, 0);
+    }
+
+    if (bc.nbufs > 0) {
+        pthread_mutex_lock(&bc_lock);
+        b = bcache_lookup(block_num);
+        if (b) {
+            bc.stats.hits++;
+            bcache_touch(b, 1);
+            memcpy(buf, b->data, BLOCK_SIZE);
+            pthread_mutex_unlock(&bc_lock);
+            return BLOCK_SIZE;
+        }
+        bc.stats.misses++;
+        pthread_mutex_unlock(&bc_lock);
+    }
+
+    char *bufs[1] = { (char *) buf };
+    if (dev_xferv(block_num, bufs, 1, 0) < 0) {
+		memset(buf, 0, BLOCK_SIZE);
+		return -1;
+    }
+    retstat = BLOCK_SIZE;
+
+    if (bc.nbufs > 0) {
+        //Another thread may have cached the block meanwhile; its copy is at least as new
+        pthread_mutex_lock(&bc_lock);
+        if ((b = bcache_lookup(block_num)) != NULL) {
+            memcpy(buf, b->data, BLOCK_SIZE);
+        } else if ((b = bcache_alloc(block_num)) != NULL) {
+            memcpy(b->data, buf, BLOCK_SIZE);
+        }
+        pthread_mutex_unlock(&bc_lock);
+    }
+
+    return retstat;
+}
+
+//Write a block to the disk
+static int bio_write_block(const blk_t block_num, const void *buf) {
+    int retstat = 0;
+
+    jnl_revoke(block_num, 1);
+    if (dev_map) {
+        return dev_map_xfer(block_num, (void *) buf, 1);
+    }
+
+    if (bc.nbufs > 0) {
+        pthread_mutex_lock(&bc_lock);
+        struct buf *b = bcache_lookup(block_num);
+        if (!b) {
+            b = bcache_alloc(block_num);
+        }
+        if (b) {
+            memcpy(b->data, buf, BLOCK_SIZE);
+            bcache_touch(b, 0);
+            if (!b->dirty) {
+                b->dirty = 1;
+                bc.stats.ndirty++;
+            }
+            pthread_mutex_unlock(&bc_lock);
+            return BLOCK_SIZE;
+        }
+        pthread_mutex_unlock(&bc_lock);
+    }
+
+    char *bufs[1] = { (char *) buf };
+    retstat = dev_xferv(block_num, bufs, 1, 1) < 0 ? -1 : (int) BLOCK_SIZE;
+    return retstat;
+}
+
+//Every block read or written is timed, whether the cache had it or not
+int bio_read(const blk_t block_num, void *buf) {
+    uint64_t start = stat_now();
+    int retstat = bio_read_block(block_num, buf);
+    stat_record(STAT_BIO_READ, start, retstat < 0, BLOCK_SIZE);
+    return retstat;
+}
+
+int bio_write(const blk_t block_num, const void *buf) {
+    uint64_t start = stat_now();
+    int retstat = bio_write_block(block_num, buf);
+    stat_record(STAT_BIO_WRITE, start, retstat < 0, BLOCK_SIZE);
+    return retstat;
+}
+
+/*
+ * Write a metadata block. With the journal open it joins the running
+ * transaction and only reaches its home through a checkpoint; the cached
+ * copy is updated under jnl_lock as well, so a reader that raced with us
+ * to the disk finds the new image when it goes to cache the old one.
+ */
+static int jnl_write_meta(const blk_t block_num, const void *buf) {
+    struct jbuf *jb;
+    struct buf *b;
+    int i;
+
+    pthread_mutex_lock(&jnl_lock);
+    if ((jb = jnl_lookup(block_num)) == NULL) {
+        if (!(jb = calloc(1, sizeof(struct jbuf))) || !(jb->data = malloc(BLOCK_SIZE))) {
+            free(jb);
+            pthread_mutex_unlock(&jnl_lock);
+            return -1;
+        }
+        jb->blkno = block_num;
+        jb->tid = 0;
+        jb->hnext = jnl.htable[jhash(block_num)];
+        jnl.htable[jhash(block_num)] = jb;
+        __atomic_store_n(&jnl.nbufs, jnl.nbufs + 1, __ATOMIC_RELAXED);
+    }
+    if (jb->tid != jnl.tid) {
+        if (jnl.nrun == jnl.caprun && jnl_grow(&jnl.run, &jnl.caprun, sizeof(struct jbuf *)) < 0) {
+            //Keep the old image, which an older record still holds, rather than half a transaction
+            if (jb->tid == 0)
+                jnl_drop(jb);
+            pthread_mutex_unlock(&jnl_lock);
+            return -1;
+        }
+        jnl.run[jnl.nrun++] = jb;
+        jb->tid = jnl.tid;
+    }
+    memcpy(jb->data, buf, BLOCK_SIZE);
+
+    //The block is metadata again: a revoke of it earlier in this transaction no longer holds
+    for (i = 0; i < jnl.nrevoke; i++) {
+        if (jnl.revoke[i] == block_num) {
+            jnl.revoke[i] = jnl.revoke[--jnl.nrevoke];
+            break;
+        }
+    }
+
+    if (bc.nbufs > 0 && !dev_map) {
+        pthread_mutex_lock(&bc_lock);
+        if ((b = bcache_lookup(block_num)) == NULL)
+            b = bcache_alloc(block_num);
+        if (b) {
+            memcpy(b->data, buf, BLOCK_SIZE);
+            bcache_touch(b, 0);
+            //Whatever file data was waiting to be written here is dead
+            if (b->dirty) {
+                b->dirty = 0;
+                bc.stats.ndirty--;
+            }
+        }
+        pthread_mutex_unlock(&bc_lock);
+    }
+    pthread_mutex_unlock(&jnl_lock);
+    return BLOCK_SIZE;
+}
+
+int bio_write_meta(const blk_t block_num, const void *buf) {
+    if (!jnl.active) {
+        return bio_write(block_num, buf);
+    }
+
+    uint64_t start = stat_now();
+    int retstat = jnl_write_meta(block_num, buf);
+    stat_record(STAT_BIO_WRITE_META, start, retstat < 0, BLOCK_SIZE);
+    return retstat;
+}
+
+
+/*
+ * Send the blocks of vec that have sel[] set to the device as one batch,
+ * a run per stretch of consecutive block numbers. On a failed read the
+ * run's sel[] entries are cleared, so the caller does not cache them.
+ */
+static int bio_submitv(const struct bio_vec *vec, uint8_t *sel, int n, int write) {
+    struct dev_run runbuf[64];
+    char *bufbuf[64];
+    struct dev_run *runs = n <= 64 ? runbuf : (struct dev_run *) malloc(n * sizeof(struct dev_run));
+    char **bufs = n <= 64 ? bufbuf : (char **) malloc(n * sizeof(char *));
+    int i, j, nruns = 0, retstat = 0;
+
+    if (!runs || !bufs) {
+        retstat = -1;
+        goto out;
+    }
+
+    for (i = 0; i < n; i = j) {
+        j = i + 1;
+        if (!sel[i])
+            continue;
+        bufs[i] = vec[i].buf;
+        for (; j < n && j - i < IOV_MAX && sel[j] && vec[j].blkno == vec[j - 1].blkno + 1; j++)
+            bufs[j] = vec[j].buf;
+        runs[nruns].blkno = vec[i].blkno;
+        runs[nruns].n = j - i;
+        runs[nruns].bufs = bufs + i;
+        nruns++;
+    }
+
+    retstat = dev_submit(runs, nruns, write);
+    if (!write) {
+        for (i = 0; i < nruns; i++) {
+            if (runs[i].err)
+                memset(sel + (runs[i].bufs - bufs), 0, runs[i].n);
+        }
+    }
+
+out:
+    if (runs != runbuf)
+        free(runs);
+    if (bufs != bufbuf)
+        free(bufs);
+    return retstat;
+}
+
+//Read a list of blocks, one preadv per run of consecutive block numbers the cache misses
+static int bio_readv_blocks(const struct bio_vec *vec, int n) {
+    int i, retstat = n;
+    uint8_t missbuf[64];
+    uint8_t *miss;
+    struct buf *b;
+
+    if (dev_map) {
+        for (i = 0; i < n; i++)
+            dev_map_xfer(vec[i].blkno, vec[i].buf, 0);
+        return n;
+    }
+
+    miss = n <= 64 ? missbuf : (uint8_t *) malloc(n);
+    if (!miss) {
+        return -1;
+    }
+
+    if (bc.nbufs > 0) {
+        pthread_mutex_lock(&bc_lock);
+        for (i = 0; i < n; i++) {
+            b = bcache_lookup(vec[i].blkno);
+            miss[i] = b == NULL;
+            if (b) {
+                bc.stats.hits++;
+                bcache_touch(b, 1);
+                memcpy(vec[i].buf, b->data, BLOCK_SIZE);
+            } else {
+                bc.stats.misses++;
+            }
+        }
+        pthread_mutex_unlock(&bc_lock);
+    } else {
+        memset(miss, 1, n);
+    }
+
+    //Every missed run goes to the device in one batch
+    if (bio_submitv(vec, miss, n, 0) < 0) {
+        retstat = -1;
+    }
+
+    if (bc.nbufs > 0) {
+        //As in bio_read(), a copy cached meanwhile is at least as new as ours
+        pthread_mutex_lock(&bc_lock);
+        for (i = 0; i < n; i++) {
+            if (!miss[i])
+                continue;
+            if ((b = bcache_lookup(vec[i].blkno)) != NULL) {
+                memcpy(vec[i].buf, b->data, BLOCK_SIZE);
+            } else if ((b = bcache_alloc(vec[i].blkno)) != NULL) {
+                memcpy(b->data, vec[i].buf, BLOCK_SIZE);
+            }
+        }
+        pthread_mutex_unlock(&bc_lock);
+    }
+
+    if (miss != missbuf)
+        free(miss);
+    return retstat;
+}
+
+//Write a list of blocks; what the cache cannot hold goes out with one pwritev per run
+static int bio_writev_blocks(const struct bio_vec *vec, int n) {
+    int i, retstat = n;
+    uint8_t directbuf[64];
+    uint8_t *direct;
+    struct buf *b;
+
+    for (i = 0; i < n; i++)
+        jnl_revoke(vec[i].blkno, 1);
+    if (dev_map) {
+        for (i = 0; i < n; i++) {
+            if (dev_map_xfer(vec[i].blkno, vec[i].buf, 1) < 0)
+                retstat = -1;
+        }
+        return retstat;
+    }
+
+    direct = n <= 64 ? directbuf : (uint8_t *) malloc(n);
+    if (!direct) {
+        return -1;
+    }
+    memset(direct, 1, n);
+
+    if (bc.nbufs > 0) {
+        pthread_mutex_lock(&bc_lock);
+        for (i = 0; i < n; i++) {
+            b = bcache_lookup(vec[i].blkno);
+            if (!b)
+                b = bcache_alloc(vec[i].blkno);
+            if (!b)
+                continue;
+            memcpy(b->data, vec[i].buf, BLOCK_SIZE);
+            bcache_touch(b, 0);
+            if (!b->dirty) {
+                b->dirty = 1;
+                bc.stats.ndirty++;
+            }
+            direct[i] = 0;
+        }
+        pthread_mutex_unlock(&bc_lock);
+    }
+
+    if (bio_submitv(vec, direct, n, 1) < 0) {
+        retstat = -1;
+    }
+
+    if (direct != directbuf)
+        free(direct);
+    return retstat;
+}
+
+//A vectored transfer is timed as one call moving all its blocks
+int bio_readv(const struct bio_vec *vec, int n) {
+    uint64_t start = stat_now();
+    int retstat = bio_readv_blocks(vec, n);
+    stat_record(STAT_BIO_READ, start, retstat < 0, (uint64_t) n * BLOCK_SIZE);
+    return retstat;
+}
+
+int bio_writev(const struct bio_vec *vec, int n) {
+    uint64_t start = stat_now();
+    int retstat = bio_writev_blocks(vec, n);
+    stat_record(STAT_BIO_WRITE, start, retstat < 0, (uint64_t) n * BLOCK_SIZE);
+    return retstat;
+}
+
+//Read nblocks consecutive blocks starting at block_num into buf
+int bio_read_blocks(const blk_t block_num, int nblocks, void *buf) {
+    struct bio_vec vecbuf[64];
+    struct bio_vec *vec = nblocks <= 64 ? vecbuf : (struct bio_vec *) malloc(nblocks * sizeof(struct bio_vec));
+    int i, retstat;
+
+    if (!vec) {
+        return -1;
+    }
+    for (i = 0; i < nblocks; i++) {
+        vec[i].blkno = block_num + i;
+        vec[i].buf = (char *) buf + (size_t) i * BLOCK_SIZE;
+    }
+    retstat = bio_readv(vec, nblocks);
+    if (vec != vecbuf)
+        free(vec);
+    return retstat;
+}
+
+//Write nblocks consecutive blocks starting at block_num from buf
+int bio_write_blocks(const blk_t block_num, int nblocks, const void *buf) {
+    struct bio_vec vecbuf[64];
+    struct bio_vec *vec = nblocks <= 64 ? vecbuf : (struct bio_vec *) malloc(nblocks * sizeof(struct bio_vec));
+    int i, retstat;
+
+    if (!vec) {
+        return -1;
+    }
+    for (i = 0; i < nblocks; i++) {
+        vec[i].blkno = block_num + i;
+        vec[i].buf = (char *) buf + (size_t) i * BLOCK_SIZE;
+    }
+    retstat = bio_writev(vec, nblocks);
+    if (vec != vecbuf)
+        free(vec);
+    return retstat;
+}
+
+//Address of a block inside the mapped image, or NULL when the image is not mapped
+void *bio_map(const blk_t block_num) {
+    if (!dev_map || block_num < 0 || (size_t) (block_num + 1) * BLOCK_SIZE > __atomic_load_n(&dev_map_size, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return dev_map + (size_t) block_num * BLOCK_SIZE;
+}
+
+/*
+ * Data that moves through the image fd directly, spliced to or from
+ * /dev/fuse, bypasses the buffer cache. Before blocks are read that way
+ * their dirty cached copies have to reach the disk, and before they are
+ * overwritten that way their cached copies have to go.
+ */
+
+//Write back dirty cached copies of a block range; returns the image fd to read it through
+int bio_export(const blk_t block_num, int nblocks) {
+    struct buf *run[IOV_MAX];
+    struct buf *b;
+    int i, n = 0, retstat = 0;
+
+    if (bc.nbufs > 0) {
+        pthread_mutex_lock(&bc_lock);
+        for (i = 0; i <= nblocks; i++) {
+            b = i < nblocks ? bcache_lookup(block_num + i) : NULL;
+            if (b)
+                bcache_touch(b, 1);
+            if (b && b->dirty && n < IOV_MAX) {
+                run[n++] = b;
+                continue;
+            }
+            if (n > 0 && bcache_writeback_run(run, n) < 0)
+                retstat = -1;
+            n = 0;
+            if (b && b->dirty)
+                run[n++] = b;
+        }
+        pthread_mutex_unlock(&bc_lock);
+    }
+    return retstat < 0 ? -1 : diskfile;
+}
+
+//Drop cached copies of a block range that is about to be rewritten through the image fd
+void bio_invalidate(const blk_t block_num, int nblocks) {
+    struct buf *b;
+    int i;
+
+    jnl_revoke(block_num, nblocks);
+    if (bc.nbufs == 0) {
+        return;
+    }
+    pthread_mutex_lock(&bc_lock);
+    for (i = 0; i < nblocks; i++) {
+        if ((b = bcache_lookup(block_num + i)) == NULL)
+            continue;
+        if (b->dirty) {
+            b->dirty = 0;
+            bc.stats.ndirty--;
+        }
+        bcache_touch(b, 0);
+        bcache_unhash(b);
+        b->blkno = -1;
+        b->ref = 0;
+    }
+    pthread_mutex_unlock(&bc_lock);
+}
+
+/*
+ * Readahead: read blocks into the cache before anyone asks for them. The
+ * misses go to the device as one batch, and the buffers are marked so a
+ * later use counts as a readahead hit and an eviction before any use as
+ * waste. As with bio_readv(), the caller guarantees nobody writes these
+ * blocks meanwhile. A mapped image, or an uncached one, only gets a hint
+ * for the kernel to start reading.
+ */
+int bio_prefetch(const blk_t block_num, int nblocks) {
+    struct bio_vec vecbuf[64];
+    uint8_t missbuf[64];
+    struct bio_vec *vec = NULL;
+    uint8_t *miss = NULL;
+    char *data = NULL;
+    struct buf *b;
+    int i, retstat = 0;
+
+    if (dev_map) {
+        char *p = bio_map(block_num);
+        if (p)
+            madvise(p, (size_t) nblocks * BLOCK_SIZE, MADV_WILLNEED);
+        return 0;
+    }
+    if (bc.nbufs == 0) {
+        return posix_fadvise(diskfile, (off_t) block_num * BLOCK_SIZE, (off_t) nblocks * BLOCK_SIZE, POSIX_FADV_WILLNEED) ? -1 : 0;
+    }
+
+    //Never let one readahead push out more than a quarter of the cache
+    if (nblocks > bc.nbufs / 4)
+        nblocks = bc.nbufs / 4;
+    if (nblocks <= 0)
+        return 0;
+
+    vec = nblocks <= 64 ? vecbuf : (struct bio_vec *) malloc(nblocks * sizeof(struct bio_vec));
+    miss = nblocks <= 64 ? missbuf : (uint8_t *) malloc(nblocks);
+    data = (char *) malloc((size_t) nblocks * BLOCK_SIZE);
+    if (!vec || !miss || !data) {
+        retstat = -1;
+        goto out;
+    }
+
+    int nmiss = 0;
+    pthread_mutex_lock(&bc_lock);
+    for (i = 0; i < nblocks; i++) {
+        vec[i].blkno = block_num + i;
+        vec[i].buf = data + (size_t) i * BLOCK_SIZE;
+        miss[i] = bcache_lookup(block_num + i) == NULL;
+        nmiss += miss[i];
+    }
+    pthread_mutex_unlock(&bc_lock);
+    if (nmiss == 0)
+        goto out;
+
+    if (bio_submitv(vec, miss, nblocks, 0) < 0)
+        retstat = -1;
+
+    pthread_mutex_lock(&bc_lock);
+    for (i = 0; i < nblocks; i++) {
+        if (!miss[i] || bcache_lookup(vec[i].blkno) != NULL)
+            continue;
+        if ((b = bcache_alloc(vec[i].blkno)) == NULL)
+            break;
+        memcpy(b->data, vec[i].buf, BLOCK_SIZE);
+        b->prefetched = 1;
+        bc.stats.ra_blocks++;
+    }
+    pthread_mutex_unlock(&bc_lock);
+
+out:
+    if (vec != vecbuf)
+        free(vec);
+    if (miss != missbuf)
+        free(miss);
+    free(data);
+    return retstat;
+}
+
+
+/*
+ * Call statistics
+ *
+ * Each thread counts into a block of its own, so recording a call takes
+ * no lock and shares no cache line with other threads; stat_sum() adds
+ * the blocks up. A thread's block is folded into stat_retired when it
+ * exits. Only the owning thread writes a counter, and with relaxed
+ * accesses a sum taken meanwhile sees each counter whole.
+ */
+struct stat_block {
+    struct lat_stats    s[STAT_MAX_SLOTS];
+    struct stat_block   *prev, *next;
+};
+
+static struct stat_block *stat_blocks;
+static struct lat_stats stat_retired[STAT_MAX_SLOTS];
+static pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stat_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stat_key;
+static __thread struct stat_block *stat_mine;
+
+static inline void stat_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static void stat_fold(struct lat_stats *sum, const struct lat_stats *s) {
+    int i;
+
+    sum->calls += __atomic_load_n(&s->calls, __ATOMIC_RELAXED);
+    sum->errors += __atomic_load_n(&s->errors, __ATOMIC_RELAXED);
+    sum->bytes += __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+    sum->ns += __atomic_load_n(&s->ns, __ATOMIC_RELAXED);
+    for (i = 0; i < STAT_BUCKETS; i++)
+        sum->hist[i] += __atomic_load_n(&s->hist[i], __ATOMIC_RELAXED);
+}
+
+static void stat_thread_exit(void *arg) {
+    struct stat_block *sb = (struct stat_block *) arg;
+    int i;
+
+    pthread_mutex_lock(&stat_lock);
+    for (i = 0; i < STAT_MAX_SLOTS; i++)
+        stat_fold(&stat_retired[i], &sb->s[i]);
+    if (sb->prev)
+        sb->prev->next = sb->next;
+    else
+        stat_blocks = sb->next;
+    if (sb->next)
+        sb->next->prev = sb->prev;
+    pthread_mutex_unlock(&stat_lock);
+    free(sb);
+}
+
+static void stat_key_init() {
+    pthread_key_create(&stat_key, stat_thread_exit);
+}
+
+static struct stat_block *stat_get() {
+    struct stat_block *sb = stat_mine;
+
+    if (sb)
+        return sb;
+    pthread_once(&stat_once, stat_key_init);
+    if ((sb = (struct stat_block *) calloc(1, sizeof(struct stat_block))) == NULL)
+        return NULL;
+    pthread_mutex_lock(&stat_lock);
+    sb->next = stat_blocks;
+    if (stat_blocks)
+        stat_blocks->prev = sb;
+    stat_blocks = sb;
+    pthread_mutex_unlock(&stat_lock);
+    pthread_setspecific(stat_key, sb);
+    stat_mine = sb;
+    return sb;
+}
+
+//Monotonic clock in nanoseconds, the start time stat_record() takes
+uint64_t stat_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//Count a call to slot that began at start, moved bytes and failed if failed is set
+void stat_record(int slot, uint64_t start, int failed, uint64_t bytes) {
+    struct stat_block *sb = stat_get();
+    uint64_t ns = stat_now() - start;
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+    if (!sb || slot < 0 || slot >= STAT_MAX_SLOTS)
+        return;
+    if (bucket >= STAT_BUCKETS)
+        bucket = STAT_BUCKETS - 1;
+
+    struct lat_stats *s = &sb->s[slot];
+    stat_add(&s->calls, 1);
+    if (failed)
+        stat_add(&s->errors, 1);
+    stat_add(&s->bytes, bytes);
+    stat_add(&s->ns, ns);
+    stat_add(&s->hist[bucket], 1);
+}
+
+//Add up slot over every thread, past and present
+void stat_sum(int slot, struct lat_stats *sum) {
+    struct stat_block *sb;
+
+    memset(sum, 0, sizeof(struct lat_stats));
+    if (slot < 0 || slot >= STAT_MAX_SLOTS)
+        return;
+    pthread_mutex_lock(&stat_lock);
+    stat_fold(sum, &stat_retired[slot]);
+    for (sb = stat_blocks; sb; sb = sb->next)
+        stat_fold(sum, &sb->s[slot]);
+    pthread_mutex_unlock(&stat_lock);
+}
+
+//Latency in nanoseconds that a fraction q of the calls stayed under, to the bucket
+uint64_t stat_percentile(const struct lat_stats *s, double q) {
+    uint64_t rank = (uint64_t) (q * s->calls), seen = 0;
+    int i;
+
+    if (s->calls == 0)
+        return 0;
+    if (rank >= s->calls)
+        rank = s->calls - 1;
+    for (i = 0; i < STAT_BUCKETS - 1; i++) {
+        seen += s->hist[i];
+        if (seen > rank)
+            break;
+    }
+    return (uint64_t) 2 << i;
+}
@@ -12,12 +12,136 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
-#define BLOCK_SIZE 4096
+#include <stdint.h>
+#include <sys/types.h>
 
-void dev_init(const char* diskfile_path);
+/*
+ * The block size is chosen when the image is made and recorded in its
+ * superblock, so BLOCK_SIZE is a variable: a power of two between
+ * BLOCK_SIZE_MIN and BLOCK_SIZE_MAX. Block numbers are 64-bit.
+ */
+#define BLOCK_SIZE_MIN 4096
+#define BLOCK_SIZE_MAX 65536
+
+extern uint32_t dev_block_size;
+#define BLOCK_SIZE dev_block_size
+
+typedef int64_t blk_t;
+
+//Default number of blocks held by the buffer cache
+#define BCACHE_DEFAULT_BLOCKS 1024
+
+struct bcache_stats {
+	uint64_t	hits;				/* bio_read served from the cache */
+	uint64_t	misses;				/* bio_read that had to go to disk */
+	uint64_t	evictions;			/* buffers reclaimed by the clock hand */
+	uint64_t	writebacks;			/* dirty buffers written to disk */
+	uint64_t	ra_blocks;			/* blocks brought in by bio_prefetch() */
+	uint64_t	ra_hits;			/* prefetched blocks later used */
+	uint64_t	ra_waste;			/* prefetched blocks evicted unused */
+	uint32_t	nbufs;				/* cache capacity in blocks */
+	uint32_t	ndirty;				/* buffers currently dirty */
+};
+
+//Device I/O backends, picked with dev_set_backend() before the disk is opened
+#define DEV_BACKEND_PREAD		0	/* synchronous pread/pwrite, always available */
+#define DEV_BACKEND_URING		1	/* io_uring, needs a build with TFS_IO_URING */
+#define DEV_BACKEND_MMAP		2	/* the image mapped into memory */
+
+#define DEV_URING_DEFAULT_DEPTH	64
+
+//io_uring backend flags
+#define DEV_URING_SQPOLL		0x1	/* a kernel thread polls the submission queue */
+#define DEV_URING_CQPOLL		0x2	/* busy-poll for completions instead of sleeping */
+
+//mmap backend flags
+#define DEV_MMAP_POPULATE		0x1	/* prefault the whole image at open (MAP_POPULATE) */
+#define DEV_MMAP_RANDOM			0x2	/* madvise(MADV_RANDOM): no kernel readaround */
+#define DEV_MMAP_SEQUENTIAL		0x4	/* madvise(MADV_SEQUENTIAL): aggressive readahead */
+#define DEV_MMAP_WILLNEED		0x8	/* madvise(MADV_WILLNEED): start reading it all in */
+
+struct jnl_stats {
+	uint64_t	commits;			/* journal commits, empty ones included */
+	uint64_t	handles;			/* operations that joined a transaction */
+	uint64_t	logged;				/* block images written to the journal */
+	uint64_t	revoked;			/* metadata blocks reused as file data */
+	uint64_t	checkpointed;		/* block images written home */
+	uint64_t	replayed;			/* transactions replayed at open */
+	uint64_t	tid;				/* running transaction */
+	uint64_t	committed;			/* last durable transaction */
+	uint32_t	used;				/* journal blocks held by live records */
+	uint32_t	size;				/* journal blocks in all */
+	uint32_t	running;			/* blocks logged or revoked by the running transaction */
+};
+
+/*
+ * Call counts and latencies, kept per thread and added up on demand.
+ * Slots below STAT_BLOCK_SLOTS are the block layer's own; a caller
+ * numbers its slots from there up to STAT_MAX_SLOTS. Bucket i of hist
+ * counts calls that took [2^i, 2^(i+1)) nanoseconds, the last one all
+ * longer calls too.
+ */
+#define STAT_BUCKETS			40
+#define STAT_MAX_SLOTS			32
+
+#define STAT_BIO_READ			0	/* bio_read() and bio_readv() */
+#define STAT_BIO_WRITE			1	/* bio_write() and bio_writev() */
+#define STAT_BIO_WRITE_META		2	/* bio_write_meta() into the journal */
+#define STAT_BLOCK_SLOTS		3
+
+struct lat_stats {
+	uint64_t	calls;
+	uint64_t	errors;				/* calls that failed */
+	uint64_t	bytes;				/* bytes the calls moved or asked for */
+	uint64_t	ns;					/* total latency */
+	uint64_t	hist[STAT_BUCKETS];	/* calls by log2 of their latency in ns */
+};
+
+//One block of a vectored transfer
+struct bio_vec {
+	blk_t		blkno;
+	void		*buf;				/* BLOCK_SIZE bytes */
+};
+
+int dev_set_backend(int backend, int depth, int flags);
+int dev_set_block_size(uint32_t size);
+void dev_init(const char* diskfile_path, uint64_t size);
 int dev_open(const char* diskfile_path);
+int dev_peek(off_t off, void *buf, size_t len);
+void dev_set_size_limit(uint64_t limit);
+int dev_grow(uint64_t size);
 void dev_close();
-int bio_read(const int block_num, void *buf);
-int bio_write(const int block_num, const void *buf);
+int bio_read(const blk_t block_num, void *buf);
+int bio_write(const blk_t block_num, const void *buf);
+int bio_readv(const struct bio_vec *vec, int n);
+int bio_writev(const struct bio_vec *vec, int n);
+int bio_read_blocks(const blk_t block_num, int nblocks, void *buf);
+int bio_write_blocks(const blk_t block_num, int nblocks, const void *buf);
+void *bio_map(const blk_t block_num);
+int bio_export(const blk_t block_num, int nblocks);
+void bio_invalidate(const blk_t block_num, int nblocks);
+int bio_prefetch(const blk_t block_num, int nblocks);
+
+int bcache_init(int nblocks);
+int bio_flush();
+void bcache_stats(struct bcache_stats *stats);
+int dev_sync();
+
+int bio_write_meta(const blk_t block_num, const void *buf);
+int jnl_format(blk_t start, uint32_t nblocks);
+int jnl_open(blk_t start, uint32_t nblocks);
+int jnl_close();
+void jnl_start();
+void jnl_stop();
+int jnl_commit(int (*prepare)(void));
+int jnl_checkpoint(uint32_t keep);
+uint64_t jnl_tid();
+int jnl_wait(uint64_t tid);
+void jnl_stats(struct jnl_stats *stats);
+
+uint64_t stat_now();
+void stat_record(int slot, uint64_t start, int failed, uint64_t bytes);
+void stat_sum(int slot, struct lat_stats *sum);
+uint64_t stat_percentile(const struct lat_stats *s, double q);
 
 #endif
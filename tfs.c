@@ -9,9 +9,9 @@
  *
  */
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 31
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -21,434 +21,3105 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <libgen.h>
+#include <sys/statvfs.h>
 #include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/xattr.h>
 
 #include "block.h"
 #include "tfs.h"
 
 char diskfile_path[PATH_MAX];
 
-// Declare your in-memory data structures here
-
-struct superblock sb;
+// Mount options, parsed from "-o name=value" before FUSE sees them
+struct tfs_options {
+	int cache_blocks;				/* buffer cache size in blocks */
+	int icache_size;				/* inode cache size in inodes */
+	int dcache_size;				/* dentry cache size in entries */
+	double entry_timeout;			/* seconds the kernel may cache a name lookup */
+	double attr_timeout;			/* seconds the kernel may cache attributes */
+	double negative_timeout;		/* seconds the kernel may cache a failed lookup, 0 not at all */
+	int writeback_cache;			/* let the kernel cache writes and send them in bulk */
+	int keep_cache;					/* keep cached file pages across opens */
+	int auto_cache;					/* keep them unless the file changed since it was last opened */
+	int async_read;					/* let the kernel send several reads of a file at once */
+	unsigned max_write;				/* largest write request in bytes */
+	unsigned max_read;				/* largest read request in bytes, 0 leaves it to the kernel */
+	unsigned max_pages;				/* pages a request may carry, capping both */
+	int io_uring;					/* use the io_uring device backend */
+	int uring_depth;				/* io_uring queue depth per thread */
+	int uring_sqpoll;				/* kernel-side submission queue polling */
+	int uring_cqpoll;				/* busy-poll the completion queue */
+	int mmap;						/* map the disk image instead of reading it */
+	int mmap_populate;				/* prefault the whole mapping at mount */
+	int mmap_advise;				/* DEV_MMAP_* access pattern hint */
+	int ra_window;					/* largest readahead window in blocks, 0 turns it off */
+	int ra_inflight;				/* readahead requests that may be queued at once */
+	int delalloc_blocks;			/* blocks a file may park before they are allocated, 0 turns it off */
+	int delalloc_total;				/* blocks all files together may park */
+	int fsync_mode;					/* FSYNC_* durability of fsync and of every operation */
+	int commit_interval;			/* seconds between background journal commits */
+	int grow_free;					/* grow the data region below this percentage free, 0 never */
+	int inline_data;				/* keep the data of new small files in their inode */
+	int log_level;					/* LOG_* level of the most detailed messages printed */
+};
 
+static struct tfs_options tfs_opts = {
+	.cache_blocks = BCACHE_DEFAULT_BLOCKS,
+	.icache_size = ICACHE_DEFAULT_INODES,
+	.dcache_size = DCACHE_DEFAULT_ENTRIES,
+	.entry_timeout = 1.0,
+	.attr_timeout = 1.0,
+	.async_read = 1,
+	.max_write = REQ_MAX_BYTES,
+	.max_pages = REQ_MAX_PAGES,
+	.uring_depth = DEV_URING_DEFAULT_DEPTH,
+	.ra_window = RA_DEFAULT_WINDOW,
+	.ra_inflight = RA_DEFAULT_INFLIGHT,
+	.delalloc_blocks = DA_DEFAULT_BLOCKS,
+	.delalloc_total = DA_DEFAULT_TOTAL,
+	.fsync_mode = FSYNC_GROUP,
+	.commit_interval = JNL_COMMIT_INTERVAL,
+	.grow_free = GROW_FREE_PERCENT,
+	.inline_data = 1,
+	.log_level = TFS_LOG_INFO,
+};
 
+#define TFS_OPT(t, p) { t, offsetof(struct tfs_options, p), 1 }
+#define TFS_OPT_VAL(t, p, v) { t, offsetof(struct tfs_options, p), v }
+
+static const struct fuse_opt tfs_opt_spec[] = {
+	TFS_OPT("cache_blocks=%d", cache_blocks),
+	TFS_OPT("icache_size=%d", icache_size),
+	TFS_OPT("dcache_size=%d", dcache_size),
+	TFS_OPT("entry_timeout=%lf", entry_timeout),
+	TFS_OPT("attr_timeout=%lf", attr_timeout),
+	TFS_OPT("negative_timeout=%lf", negative_timeout),
+	TFS_OPT("writeback_cache", writeback_cache),
+	TFS_OPT("keep_cache", keep_cache),
+	TFS_OPT("auto_cache", auto_cache),
+	TFS_OPT_VAL("async_read", async_read, 1),
+	TFS_OPT_VAL("sync_read", async_read, 0),
+	TFS_OPT("max_write=%u", max_write),
+	TFS_OPT("max_pages=%u", max_pages),
+	// FUSE also has to pass max_read to the kernel when mounting
+	TFS_OPT("max_read=%u", max_read),
+	FUSE_OPT_KEY("max_read=", FUSE_OPT_KEY_KEEP),
+	TFS_OPT("io_uring", io_uring),
+	TFS_OPT("uring_depth=%d", uring_depth),
+	TFS_OPT("uring_sqpoll", uring_sqpoll),
+	TFS_OPT("uring_cqpoll", uring_cqpoll),
+	TFS_OPT("ra_window=%d", ra_window),
+	TFS_OPT("ra_inflight=%d", ra_inflight),
+	TFS_OPT("delalloc_blocks=%d", delalloc_blocks),
+	TFS_OPT("delalloc_total=%d", delalloc_total),
+	TFS_OPT("mmap", mmap),
+	TFS_OPT("mmap_populate", mmap_populate),
+	TFS_OPT_VAL("mmap_advise=normal", mmap_advise, 0),
+	TFS_OPT_VAL("mmap_advise=random", mmap_advise, DEV_MMAP_RANDOM),
+	TFS_OPT_VAL("mmap_advise=sequential", mmap_advise, DEV_MMAP_SEQUENTIAL),
+	TFS_OPT_VAL("mmap_advise=willneed", mmap_advise, DEV_MMAP_WILLNEED),
+	TFS_OPT_VAL("fsync=async", fsync_mode, FSYNC_ASYNC),
+	TFS_OPT_VAL("fsync=group", fsync_mode, FSYNC_GROUP),
+	TFS_OPT_VAL("fsync=sync", fsync_mode, FSYNC_SYNC),
+	TFS_OPT("commit_interval=%d", commit_interval),
+	TFS_OPT("grow_free=%d", grow_free),
+	TFS_OPT("inline_data=%d", inline_data),
+	TFS_OPT("log_level=%d", log_level),
+	FUSE_OPT_END
+};
 
-/* 
- * Get available inode number from bitmap
+/*
+ * Print a message of the given LOG_* level if log_level lets it through.
+ * Messages above TFS_LOG_MAX ("make LOG_MAX=1") are not even compiled in.
  */
-int get_avail_ino() {
+#ifndef TFS_LOG_MAX
+#define TFS_LOG_MAX TFS_LOG_DEBUG
+#endif
 
-	// Step 1: Read inode bitmap from disk
-	bitmap_t ibitmap = (bitmap_t) malloc(4096);
+#define tfs_log_on(level) ((level) <= TFS_LOG_MAX && (level) <= tfs_opts.log_level)
 
-	bio_read(sb.i_bitmap_blk, ibitmap);
+#define tfs_log(level, ...) do { \
+	if(tfs_log_on(level)) { \
+		printf(__VA_ARGS__); \
+	} \
+} while(0)
 
-	// Step 2: Traverse inode bitmap to find an available slot
-	int ino = 0;
-	while(ino < MAX_INUM && get_bitmap(ibitmap, ino)){
-		ino++;		
-	} 
+/*
+ * Geometry tfs_mkfs() lays new images out with. Images are formatted with
+ * the defaults when none exists at mount, or with the ones given to -mkfs.
+ */
+struct mkfs_options {
+	uint64_t size;					/* image size in bytes */
+	uint32_t block_size;			/* bytes per block */
+	uint32_t inodes;				/* inodes in the inode table */
+	uint32_t journal_blocks;		/* journal blocks, 0 to size it from the image */
+	uint64_t max_size;				/* largest size the image may grow to, 0 for DEFAULT_GROW_FACTOR times size */
+	int format;						/* reformat even if the image exists */
+};
 
-	if(ino == MAX_INUM){
-		printf("Out of space");
-		return -1;
-	} else {
-		// Step 3: Update inode bitmap and write to disk 
-		set_bitmap(ibitmap, ino);
-		bio_write(sb.i_bitmap_blk, ibitmap);
-		return ino;
-	}
+static struct mkfs_options mkfs_opts = {
+	.size = DEFAULT_DISK_SIZE,
+	.block_size = DEFAULT_BLOCK_SIZE,
+	.inodes = DEFAULT_INUM,
+};
 
+// Parse a byte count with an optional K, M, G or T suffix; 0 if it is malformed
+static uint64_t parse_size(const char *arg) {
+
+	char *end;
+	uint64_t n = strtoull(arg, &end, 10);
+	const char *units = "KMGT", *u;
+	if(*end && (u = strchr(units, *end)) != NULL && end[1] == '\0') {
+		n <<= 10 * (u - units + 1);
+	} else if(*end) {
+		return 0;
+	}
+	return n;
 }
 
-/* 
- * Get available data block number from bitmap
+// Declare your in-memory data structures here
+
+struct superblock sb;
+
+/*
+ * In-memory copy of an on-disk bitmap. The words share the on-disk bit
+ * layout (bit i lives in byte i / 8), so whole blocks can be copied in and
+ * out. Changes are only recorded in dirty[] and written back lazily by
+ * bitmap_sync().
  */
-int get_avail_blkno() {
+struct mem_bitmap {
+	uint64_t *	words;
+	uint32_t	nbits;				/* number of usable bits */
+	uint32_t	nwords;
+	uint32_t	nblocks;			/* on-disk blocks backing the bitmap */
+	blk_t		blk;				/* first on-disk block */
+	uint32_t	hint;				/* word to resume the free-slot search from */
+	uint32_t	nfree;				/* number of clear bits */
+	uint8_t *	dirty;				/* per-block dirty flags */
+};
 
-	// Step 1: Read data block bitmap from disk
-	bitmap_t dbitmap = (bitmap_t) malloc(4096);
-	memset(dbitmap, 0, 4096);
-	bio_read(sb.d_bitmap_blk, dbitmap);
+struct mem_bitmap ibm;				/* inode bitmap */
+struct mem_bitmap dbm;				/* data block bitmap */
 
-	// Step 2: Traverse data block bitmap to find an available slot
-	int blockno = 0;	
-	while(blockno < MAX_DNUM && get_bitmap(dbitmap, blockno)){
-		blockno++;
-	}
-	if(blockno == MAX_DNUM){
-		printf("Out of space");
-		return -1;
-	} else {
-		// Step 3: Update data block bitmap and write to disk 
-		set_bitmap(dbitmap, blockno);
-		bio_write(sb.d_bitmap_blk, dbitmap);
-		return blockno;
-	}
+// Serializes every allocation, free and sync of either bitmap
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
 
-}
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+#define WORDS_PER_BLOCK (BLOCK_SIZE / sizeof(uint64_t))
 
-/* 
- * inode operations
+
+/*
+ * Set up an in-memory bitmap of nbits bits backed by the blocks starting at
+ * blk. If load is set, the current contents are read from disk; otherwise
+ * the bitmap starts out clear and every block is dirty.
  */
-int readi(uint16_t ino, struct inode *inode) {
+int bitmap_load(struct mem_bitmap *bm, blk_t blk, uint32_t nbits, int load) {
+
+	uint32_t i;
+
+	bm->nbits = nbits;
+	bm->nblocks = (nbits + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+	bm->nwords = (nbits + 63) / 64;
+	bm->blk = blk;
+	bm->hint = 0;
+	bm->words = (uint64_t *) calloc(bm->nblocks, BLOCK_SIZE);
+	bm->dirty = (uint8_t *) calloc(bm->nblocks, 1);
+	if(!bm->words || !bm->dirty) {
+		return -1;
+	}
 
-	// Step 1: Get the inode's on-disk block number
-  	// Step 2: Get offset of the inode in the inode on-disk block
-  	// Step 3: Read the block from disk and then copy into inode structure
-	void * datablock = malloc(4096);	
-	uint32_t index = sb.i_start_blk + ino;
-	
-	bio_read(index, datablock);
-	
-	struct inode * inodeptr = (struct inode *) datablock;
-	memcpy(inode, inodeptr, sizeof(struct inode));
-	
+	for(i = 0; i < bm->nblocks; i++) {
+		if(load) {
+			bio_read(blk + i, bm->words + i * WORDS_PER_BLOCK);
+		} else {
+			bm->dirty[i] = 1;
+		}
+	}
+
+	// Bits past nbits in the last word are never handed out
+	bm->nfree = 0;
+	for(i = 0; i < bm->nwords; i++) {
+		uint64_t used = bm->words[i];
+		if(i == bm->nwords - 1 && nbits % 64) {
+			used |= ~0ULL << (nbits % 64);
+		}
+		bm->nfree += 64 - __builtin_popcountll(used);
+	}
 
 	return 0;
 }
 
-int writei(uint16_t ino, struct inode *inode) {
+void bitmap_release(struct mem_bitmap *bm) {
+	free(bm->words);
+	free(bm->dirty);
+	memset(bm, 0, sizeof(struct mem_bitmap));
+}
 
+static inline void bitmap_dirty(struct mem_bitmap *bm, uint32_t i) {
+	bm->dirty[i / BITS_PER_BLOCK] = 1;
+}
 
-	// Step 1: Get the block number where this inode resides on disk
-	// Step 2: Get the offset in the block where this inode resides on disk
-	// Step 3: Write inode to disk 
-	
-	uint32_t index = sb.i_start_blk + ino;
-	void * datablock = malloc(4096);
-	memcpy(datablock, inode, sizeof(struct inode));
-	bio_write(index, datablock);	
+/*
+ * Find a clear bit a word at a time, starting from the word the last
+ * allocation came from, and set it. Returns the bit index or -1 if full.
+ */
+int bitmap_alloc(struct mem_bitmap *bm) {
 
-	return 0;
-}
+	uint32_t n, w;
 
+	if(bm->nfree == 0) {
+		return -1;
+	}
 
-void printinode(struct inode * inode){
-	printf("\n--------PRINTING INODE-------------\n");
-	printf("Inode Number: %d\n", inode->ino);
-	printf("Link Count: %d\n", inode->link);
-	printf("Data Block Numbers: ");
-	int i;
-	for(i = 0; i < inode->link; i++) {
-		printf("[%d] -> ", inode->direct_ptr[i]);
-	} 
-	printf("\n\n");
-}
+	for(n = 0, w = bm->hint; n < bm->nwords; n++, w = (w + 1 == bm->nwords) ? 0 : w + 1) {
+		if(bm->words[w] == ~0ULL) {
+			continue;
+		}
 
+		uint32_t i = w * 64 + __builtin_ctzll(~bm->words[w]);
+		if(i >= bm->nbits) {
+			continue;
+		}
 
-void printDirectoryContents(struct inode * dirinode) {
-	printf("\n-------------DIRECTORY CONTENTS--------------\n");
-	int i;
-	for(i = 0; i < dirinode->link; i++) {
-		void * datablock = malloc(4096);
-		bio_read(dirinode->direct_ptr[i], datablock);
-		
-		struct dirent * direntptr = (struct dirent *) datablock;
-		while((void *) direntptr <= datablock + 4096 - sizeof(struct dirent)) {
-			if(direntptr->valid == 1) {
-				printf("Filename: %s ", direntptr->name);
-				printf("Inode: %d\n", direntptr->ino);			
-			}
-			direntptr++;
-		} 
+		bm->words[w] |= 1ULL << (i % 64);
+		bm->hint = w;
+		bm->nfree--;
+		bitmap_dirty(bm, i);
+		return i;
+	}
+
+	return -1;
+}
 
+// Set bits [i, i + n), all of which must be clear
+void bitmap_set_run(struct mem_bitmap *bm, uint32_t i, uint32_t n) {
+	for(; n > 0; i++, n--) {
+		bm->words[i / 64] |= 1ULL << (i % 64);
+		bm->nfree--;
+		bitmap_dirty(bm, i);
 	}
-	printf("\n");
+}
 
+// Clear bit i. Returns 0, or -1 if it was not set.
+int bitmap_free(struct mem_bitmap *bm, uint32_t i) {
+	if(i >= bm->nbits || !(bm->words[i / 64] & (1ULL << (i % 64)))) {
+		return -1;
+	}
+	bm->words[i / 64] &= ~(1ULL << (i % 64));
+	bm->nfree++;
+	bitmap_dirty(bm, i);
+	return 0;
 }
 
+// Write the dirty blocks of an in-memory bitmap back to disk
+int bitmap_sync(struct mem_bitmap *bm) {
 
-struct dirent * getFnameDirent(struct inode dirinode, const char *fname) {
-	
-	void * datablock = malloc(4096);
-	int i;
-	struct dirent * datablockdirent;
-	for(i = 0; i < dirinode.link; i++) {
-	 	bio_read(dirinode.direct_ptr[i], datablock);
+	uint32_t i;
+	int ret = 0;
 
-		datablockdirent = (struct dirent *) datablock;
-		
-		while((void *) datablockdirent <= datablock + 4096 - sizeof(struct dirent)){
-			/*if(datablockdirent->valid == 1)  {
-				printf("Accessing dirent with name: %s, ino: %d\n", datablockdirent->name, datablockdirent->ino);
-			}*/
-			if(datablockdirent->valid == 1 && !strcmp(fname, datablockdirent->name)){
-				return datablockdirent;
+	for(i = 0; i < bm->nblocks; i++) {
+		if(bm->dirty[i]) {
+			if(bio_write_meta(bm->blk + i, bm->words + i * WORDS_PER_BLOCK) < 0) {
+				ret = -1;
+			} else {
+				bm->dirty[i] = 0;
 			}
-			datablockdirent++;
 		}
 	}
-	return NULL;
-}  
 
+	return ret;
+}
 
+// Grow a bitmap to nbits bits; the new bits start out clear and their blocks dirty
+int bitmap_extend(struct mem_bitmap *bm, uint32_t nbits) {
 
+	uint32_t i, nblocks = (nbits + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
 
-/* 
- * directory operations
- */
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
-	//printf("\n-------------- CALLING DIR FIND ON FILE %s FROM INODE %d----------------\n", fname, ino);	
+	if(nblocks > bm->nblocks) {
+		uint64_t * words = (uint64_t *) realloc(bm->words, (size_t) nblocks * BLOCK_SIZE);
+		if(!words) {
+			return -1;
+		}
+		bm->words = words;
+		uint8_t * dirty = (uint8_t *) realloc(bm->dirty, nblocks);
+		if(!dirty) {
+			return -1;
+		}
+		bm->dirty = dirty;
+		memset(words + (size_t) bm->nblocks * WORDS_PER_BLOCK, 0, (size_t) (nblocks - bm->nblocks) * BLOCK_SIZE);
+		memset(dirty + bm->nblocks, 0, nblocks - bm->nblocks);
+		bm->nblocks = nblocks;
+	}
+
+	for(i = bm->nbits / BITS_PER_BLOCK; i < nblocks; i++) {
+		bm->dirty[i] = 1;
+	}
+	bm->nfree += nbits - bm->nbits;
+	bm->nbits = nbits;
+	bm->nwords = (nbits + 63) / 64;
+	return 0;
+}
 
+/*
+ * Free-extent index
+ *
+ * Every run of free data blocks, sorted by first block, so an allocation
+ * can pick a run of the length it wants near its goal by looking at runs
+ * instead of scanning bits. Blocks are numbered from the start of the
+ * data region, as in the bitmap. The index is built from the data bitmap
+ * at mount and kept in step with it under alloc_lock; it may miss free
+ * blocks if memory ran out while freeing, never the other way round.
+ */
+struct free_extent {
+	uint32_t	start;				/* first free block */
+	uint32_t	len;				/* number of free blocks */
+};
 
-	// Step 1: Call readi() to get the inode using ino (inode number of current directory)
-	struct inode * dirinode = (struct inode *) malloc(sizeof(struct inode));
-	readi(ino, dirinode);
+struct free_index {
+	struct free_extent *	ext;
+	uint32_t				count;
+	uint32_t				cap;
+	uint32_t				next;		/* block after the last allocation, the goal of callers without one */
+};
 
-	// Step 2: Get data block of current directory from inode
-	// Step 3: Read directory's data block and check each directory entry.
-	struct dirent * datablockdirent = getFnameDirent(*dirinode, fname);
+struct free_index dfree;			/* free runs of the data bitmap */
 
+// Index of the last run starting at or before blk, or -1 if there is none
+static int fidx_search(struct free_index *fx, uint32_t blk) {
 
-	if(!datablockdirent) {
-		//printf("Data block dirent is nullington\n");
-		return -1;
-	} else {
-		dirent->ino = datablockdirent->ino;
-		dirent->valid = datablockdirent->valid;
-		memcpy(dirent->name, fname, name_len);	
+	int lo = 0, hi = (int) fx->count - 1, found = -1;
+	while(lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		if(fx->ext[mid].start <= blk) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
 	}
+	return found;
+}
 
-	//If the name matches, then copy directory entry to dirent structure
+// Make room for one more run
+static int fidx_grow(struct free_index *fx) {
 
+	if(fx->count < fx->cap) {
+		return 0;
+	}
+	uint32_t cap = fx->cap ? fx->cap * 2 : 64;
+	struct free_extent * grown = (struct free_extent *) realloc(fx->ext, cap * sizeof(struct free_extent));
+	if(!grown) {
+		return -1;
+	}
+	fx->ext = grown;
+	fx->cap = cap;
 	return 0;
 }
 
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
-
-	//printf("\n------- CALLING DIR ADD ON FILE %s, INODE %d --------\n", fname, f_ino);
+// Insert the run [start, start + len) at index i
+static int fidx_insert(struct free_index *fx, int i, uint32_t start, uint32_t len) {
 
-	//Returns null if not already present, a dirent containing file info if present
-	struct dirent * alreadyPresentDirent = getFnameDirent(dir_inode, fname);
-	if(alreadyPresentDirent) {
-		//printf("File already present in dir\n");
-		return -1;	
+	if(fidx_grow(fx) < 0) {
+		return -1;
 	}
+	memmove(&fx->ext[i + 1], &fx->ext[i], (fx->count - i) * sizeof(struct free_extent));
+	fx->ext[i].start = start;
+	fx->ext[i].len = len;
+	fx->count++;
+	return 0;
+}
 
-	//Initialize stuff
-	void *datablock = malloc(4096);
-	int i;
-	struct dirent * datablockdirent;
-	
-	//For each data block in the dir_inode
-	for(i = 0; i < dir_inode.link; i++){
+// Rebuild the index from the clear bits of a bitmap
+int fidx_build(struct free_index *fx, struct mem_bitmap *bm) {
 
-		//Read dirinode's ith block into datablock
-		bio_read(dir_inode.direct_ptr[i], datablock);
-		
-		//Cast as dirent pointer
-		datablockdirent = (struct dirent *) datablock;
-	
+	uint32_t i = 0, start;
 
-		//While dirent pointer is in data block	
-		while((void *) datablockdirent <= datablock + 4096 - sizeof(struct dirent)) {
-			
-			//If pointing to invalid dirent
-			if(datablockdirent->valid == 0) {
-
-				//Store new dirent in datablock		
-				datablockdirent->valid = 1;
-				datablockdirent->ino = f_ino;
-				memset(datablockdirent->name, '\0', 252);
-				memcpy(datablockdirent->name, fname, name_len);
-
-				//Write datablock back to diskfile
-				bio_write(dir_inode.direct_ptr[i], datablock);
-				return 0;
-			} else {
-				//Increment datablockdirent pointer
-				datablockdirent++;
-			}
+	fx->count = 0;
+	fx->next = 0;
+	while(i < bm->nbits) {
+		// Skip over used blocks a word at a time where possible
+		if(i % 64 == 0 && bm->words[i / 64] == ~0ULL) {
+			i += 64;
+			continue;
 		}
-		
-	}
-
-	
-	// Allocate a new data block for this directory if it does not exist
-	// Update directory inode
-	// Write directory entry;
-	
-
-	//No free dirents in existing datablocks!!
-	
-	//Get current count of datablocks
-	int datablockcount = dir_inode.link;
-	//printf("\nNo free data blocks");
-	
-	//If dirinode not full of datablocks
-	if(datablockcount < 16) {
-		//printf(", adding datablock: %d\n", datablockcount);
-		//Get free block
-		int blockno = get_avail_blkno();	
-		blockno += sb.d_start_blk;
-	
-		if(blockno < 0) {
-			return blockno;
+		if(bm->words[i / 64] & (1ULL << (i % 64))) {
+			i++;
+			continue;
 		}
+		for(start = i; i < bm->nbits && !(bm->words[i / 64] & (1ULL << (i % 64))); i++)
+			;
+		if(fidx_insert(fx, fx->count, start, i - start) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
 
-		//update parent dir inode
-		dir_inode.direct_ptr[datablockcount] = blockno;
-		dir_inode.link = (uint32_t) datablockcount + 1;		
-
-		writei(dir_inode.ino, &dir_inode);	
+void fidx_release(struct free_index *fx) {
+	free(fx->ext);
+	memset(fx, 0, sizeof(struct free_index));
+}
 
-		//add data block with new dirent
-		void * newdatablock = malloc(4096);
-		struct dirent * newdirent = (struct dirent *) newdatablock;
-		newdirent->valid = 1;
-		newdirent->ino = f_ino;
-		memset(newdirent->name, '\0', 252);
-		memcpy(newdirent->name, fname, name_len);
-		bio_write(blockno, newdirent);
-		
+/*
+ * Choose where an allocation of want blocks with the given goal goes. If
+ * the goal block is free the allocation starts there, even when the run
+ * is shorter than want: carrying on where the file left off costs no more
+ * extents than a longer run elsewhere. Otherwise it takes the first run at
+ * or after the goal that is long enough, wrapping around, or failing that
+ * the longest run there is. Returns the run's index and sets *start and
+ * *got, or returns -1 if nothing is free.
+ */
+static int fidx_find(struct free_index *fx, uint32_t goal, uint32_t want, uint32_t *start, uint32_t *got) {
 
-		return 0;
+	uint32_t n, j;
+	int best = -1;
 
-	//Dirinode full
-	} else {
-		//printf(", root directory full\n");
-		return -1;	
+	if(fx->count == 0) {
+		return -1;
 	}
 
+	int i = fidx_search(fx, goal);
+	if(i >= 0 && goal < fx->ext[i].start + fx->ext[i].len) {
+		uint32_t left = fx->ext[i].start + fx->ext[i].len - goal;
+		// Splitting a run needs a slot for its tail; without one start at its head
+		*start = (goal == fx->ext[i].start || fidx_grow(fx) == 0) ? goal : fx->ext[i].start;
+		*got = want < left ? want : left;
+		return i;
+	}
 
+	for(n = 0, j = (uint32_t) (i + 1) % fx->count; n < fx->count; n++, j = (j + 1 == fx->count) ? 0 : j + 1) {
+		if(fx->ext[j].len >= want) {
+			best = j;
+			break;
+		}
+		if(best < 0 || fx->ext[j].len > fx->ext[best].len) {
+			best = j;
+		}
+	}
+	*start = fx->ext[best].start;
+	*got = want < fx->ext[best].len ? want : fx->ext[best].len;
+	return best;
 }
 
+// Remove [start, start + len) from run i, which holds all of it
+static void fidx_take(struct free_index *fx, int i, uint32_t start, uint32_t len) {
 
+	struct free_extent *f = &fx->ext[i];
+	uint32_t end = f->start + f->len;
 
+	if(start == f->start && len == f->len) {
+		memmove(f, f + 1, (fx->count - i - 1) * sizeof(struct free_extent));
+		fx->count--;
+	} else if(start == f->start) {
+		f->start += len;
+		f->len -= len;
+	} else if(start + len == end) {
+		f->len -= len;
+	} else {
+		// fidx_find() made sure there is room for the tail
+		f->len = start - f->start;
+		fidx_insert(fx, i + 1, start + len, end - start - len);
+	}
+}
 
+// Add block blk back, merging it with the runs on either side
+static void fidx_give(struct free_index *fx, uint32_t blk) {
+
+	int i = fidx_search(fx, blk);
+	struct free_extent *prev = i >= 0 ? &fx->ext[i] : NULL;
+	struct free_extent *next = i + 1 < (int) fx->count ? &fx->ext[i + 1] : NULL;
+
+	int joins_prev = prev && prev->start + prev->len == blk;
+	int joins_next = next && blk + 1 == next->start;
+
+	if(joins_prev && joins_next) {
+		prev->len += 1 + next->len;
+		memmove(next, next + 1, (fx->count - i - 2) * sizeof(struct free_extent));
+		fx->count--;
+	} else if(joins_prev) {
+		prev->len++;
+	} else if(joins_next) {
+		next->start--;
+		next->len++;
+	} else {
+		fidx_insert(fx, i + 1, blk, 1);
+	}
+}
 
-int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
+/*
+ * How fragmented free space is: the number of free runs, the longest, and
+ * the share of free blocks in runs shorter than FRAG_RUN_BLOCKS, which no
+ * sizeable file can be given in one piece. Caller holds alloc_lock.
+ */
+static double fidx_frag(struct free_index *fx, uint32_t *largest) {
 
-	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
-	// Step 2: Check if fname exist
-	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
-	
-	void * datablock = malloc(4096);
-	int i;
-	struct dirent * datablockdirent;
-	for(i = 0; i < dir_inode.link; i++) {
-	 	bio_read(dir_inode.direct_ptr[i], datablock);
+	uint32_t i;
+	uint64_t total = 0, small = 0;
 
-		datablockdirent = (struct dirent *) datablock;
-		
-		while((void *) datablockdirent <= datablock + 4096 - sizeof(struct dirent)){
-			/*if(datablockdirent->valid == 1)  {
-				printf("Accessing dirent with name: %s, ino: %d\n", datablockdirent->name, datablockdirent->ino);
-			}*/
-			if(datablockdirent->valid == 1 && !strcmp(fname, datablockdirent->name)){
-				datablockdirent->valid = 0;
-				bio_write(dir_inode.direct_ptr[i], datablock);
-				return 0;
-			}
-			datablockdirent++;
+	*largest = 0;
+	for(i = 0; i < fx->count; i++) {
+		total += fx->ext[i].len;
+		if(fx->ext[i].len < FRAG_RUN_BLOCKS) {
+			small += fx->ext[i].len;
+		}
+		if(fx->ext[i].len > *largest) {
+			*largest = fx->ext[i].len;
 		}
 	}
-	return -1;	
+	return total ? 100.0 * small / total : 0.0;
 }
 
+/*
+ * Data blocks promised to file data whose allocation is delayed, and to
+ * the extent leaves mapping it may take. Ordinary allocations leave that
+ * many blocks free, so the delayed ones can always be given space when
+ * they are flushed.
+ */
+static uint32_t da_reserved;
 
+// Blocks parked by all files together, read unlocked by file_write()
+static uint32_t da_parked;
 
+// Delayed allocation totals: blocks allocated at flush time and the extents they went into
+static uint64_t da_blocks, da_runs;
 
+/*
+ * Growing the data region
+ *
+ * The data region is the last thing in the image, so it grows by
+ * extending the image file and covering the new blocks with bits of the
+ * data bitmap, which mkfs left room for. The superblock and the bitmap
+ * blocks are only changed in memory here; the next commit logs them
+ * together, so after a crash the image has either grown or not. All of
+ * it happens under alloc_lock.
+ */
+static int sb_dirty;				/* superblock changed since the last commit */
+static int grow_stuck;				/* growing failed; wait for a grow by hand before trying again */
+static uint64_t grow_count;			/* times the data region grew */
+
+// Most data blocks the image may grow to, no more than the data bitmap region can describe
+static uint32_t data_limit() {
+	uint64_t n = (sb.i_start_blk - sb.d_bitmap_blk) * (uint64_t) BITS_PER_BLOCK;
+	n = n < MAX_DNUM ? n : MAX_DNUM;
+	return sb.grow_dnum < n ? sb.grow_dnum : n;
+}
 
-char * getParentDir(const char * path) {
+// Add add blocks to the end of the data region, or as many as it has room for. Returns -1 if none were added.
+static int data_grow(uint64_t add) {
 
-	char * forwardslash = "/";
-	if(!strcmp(path, forwardslash)){
-		char * forwardslashpath = (char *) malloc(2);
-		forwardslashpath[0] = '/';
-		forwardslashpath[1] = '\0';
-		return forwardslashpath;
+	uint32_t old = sb.max_dnum;
+	if(add > data_limit() - old) {
+		add = data_limit() - old;
+	}
+	if(add == 0 || dev_grow((sb.nblocks + add) * BLOCK_SIZE) < 0 || bitmap_extend(&dbm, old + add) < 0) {
+		return -1;
 	}
 
-	int index = 1;
-	while(path[index] != '\0' && path[index] != '/') {
-		//printf("Path[%d] = %c\n", index, path[index]);
-		index++;
+	// The new blocks are one free run, which joins the last run if that reached the old end
+	struct free_extent *last = dfree.count ? &dfree.ext[dfree.count - 1] : NULL;
+	if(last && last->start + last->len == old) {
+		last->len += add;
+	} else {
+		fidx_insert(&dfree, dfree.count, old, add);
 	}
 
-	//printf("Index: %d\n", index);
-	char * parentDirString = (char *) malloc(index);	
+	sb.max_dnum = old + add;
+	sb.nblocks += add;
+	sb_dirty = 1;
+	grow_count++;
+	return 0;
+}
 
+// Grow the data region if an allocation of want blocks would leave less than grow_free percent of it free
+static void data_autogrow(uint32_t want) {
 
-	memcpy(parentDirString, path + 1, index - 1);
-	parentDirString[index - 1] = '\0';
-	return parentDirString;
+	uint64_t avail = dbm.nfree > da_reserved ? dbm.nfree - da_reserved : 0;
+	if(tfs_opts.grow_free <= 0 || grow_stuck || sb.max_dnum >= data_limit() ||
+	   avail >= want + (uint64_t) dbm.nbits * tfs_opts.grow_free / 100) {
+		return;
+	}
+	uint64_t add = (uint64_t) dbm.nbits * GROW_STEP_PERCENT / 100;
+	if(data_grow(add > want ? add : want) < 0) {
+		grow_stuck = 1;
+	}
 }
 
+// Log the superblock if it changed since the last commit. Caller holds alloc_lock.
+static int sb_sync() {
 
+	if(!sb_dirty) {
+		return 0;
+	}
+	void * sbblock = calloc(1, BLOCK_SIZE);
+	if(!sbblock) {
+		return -1;
+	}
+	memcpy(sbblock, &sb, sizeof(struct superblock));
+	int ret = bio_write_meta(0, sbblock) < 0 ? -1 : 0;
+	free(sbblock);
+	if(ret == 0) {
+		sb_dirty = 0;
+	}
+	return ret;
+}
 
 /* 
- * namei operation
+ * Get available inode number from bitmap
  */
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {	
-	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
-	// Note: You could either implement it in a iterative way or recursive way
-	//printf("GNBP: %s, LENGTH: %d\n", path, strlen(path));	
-
-	char * forwardslash = "/";
-	
-	//Path is "/"
-	if(!strcmp(forwardslash, (char *) path)) {
-		
-		readi(0, inode);
-		
-
-	//Path contains subentries	
-	} else {
+int get_avail_ino() {
 
-		//Get name of top level directory entry to access
-		char * direntName = getParentDir(path);		
+	pthread_mutex_lock(&alloc_lock);
+	int ino = bitmap_alloc(&ibm);
+	pthread_mutex_unlock(&alloc_lock);
+	if(ino < 0) {
+		tfs_log(TFS_LOG_WARN, "Out of inodes\n");
+	}
+	return ino;
+}
 
-		
-		int parentlength = strlen(direntName) + 1;
-		int totallength = strlen(path);
-		int childlength = totallength - parentlength;
+/*
+ * Allocate up to want contiguous data blocks as close to goal as the
+ * free-extent index allows (-1 for no goal), numbered from the start of
+ * the data region. Space reserved for delayed allocation is only handed
+ * out when reserved is set, and is then taken out of the reservation.
+ * Caller holds alloc_lock. Returns the first block and sets *got, or
+ * returns -1 if there is no space.
+ */
+static int64_t data_alloc(int64_t goal, uint32_t want, uint32_t *got, int reserved) {
 
-		/*printf("Parent Length: %d\n", parentlength);
-		printf("Child Length: %d\n", childlength);
-		printf("Dirent Name: %s\n", direntName);*/	
+	if(!reserved) {
+		data_autogrow(want);
+	}
+	uint32_t start, avail = dbm.nfree > da_reserved ? dbm.nfree - da_reserved : 0;
+	if(reserved) {
+		avail = dbm.nfree;
+	}
+	if(avail == 0 || want == 0) {
+		return -1;
+	}
+	if(want > avail) {
+		want = avail;
+	}
 
+	int i = fidx_find(&dfree, goal >= 0 && goal < dbm.nbits ? (uint32_t) goal : dfree.next, want, &start, got);
+	if(i < 0) {
+		return -1;
+	}
+	fidx_take(&dfree, i, start, *got);
+	bitmap_set_run(&dbm, start, *got);
+	dfree.next = start + *got < dbm.nbits ? start + *got : 0;
+	if(reserved) {
+		da_reserved -= *got < da_reserved ? *got : da_reserved;
+	}
+	return start;
+}
 
-		//Get Inode number of top level directory entry
-		//printf("ACCESSING DIRENT %s\n", direntName);
-		struct dirent * storage = (struct dirent *) malloc(sizeof(struct dirent));
-		int found = dir_find(ino, direntName, strlen(direntName), storage);
-		if(found < 0) {
-			return -1;
-		}
+/* 
+ * Get available data block number from bitmap
+ */
+blk_t get_avail_blkno() {
+
+	uint32_t got;
+	pthread_mutex_lock(&alloc_lock);
+	blk_t blockno = data_alloc(-1, 1, &got, 0);
+	pthread_mutex_unlock(&alloc_lock);
+	if(blockno < 0) {
+		tfs_log(TFS_LOG_WARN, "Out of space\n");
+	}
+	return blockno;
+}
 
-		uint16_t direntino = storage->ino; 			
+/*
+ * Allocate up to want contiguous data blocks, starting at block goal if
+ * it is free and as near it as possible otherwise (-1 for no goal).
+ * Returns the first block number and sets *got to the number of blocks,
+ * or returns -1.
+ */
+blk_t get_avail_run(blk_t goal, uint32_t want, uint32_t *got) {
 
-		//Top level directory entry is child inode to load
-		if(!childlength) {
+	pthread_mutex_lock(&alloc_lock);
+	blk_t blockno = data_alloc(goal >= (blk_t) sb.d_start_blk ? goal - (blk_t) sb.d_start_blk : -1, want, got, 0);
+	pthread_mutex_unlock(&alloc_lock);
+	if(blockno < 0) {
+		tfs_log(TFS_LOG_WARN, "Out of space\n");
+		return -1;
+	}
+	return blockno + sb.d_start_blk;
+}
 
-			//Read in child inode
-			readi(direntino, inode);
+// Like get_avail_blkno(), for an extent leaf of delayed file data, out of the space reserved for it
+blk_t get_reserved_blkno() {
 
-		//Top level directory entry is parent inode 	
-		} else {
+	uint32_t got;
+	pthread_mutex_lock(&alloc_lock);
+	blk_t blockno = data_alloc(-1, 1, &got, 1);
+	pthread_mutex_unlock(&alloc_lock);
+	if(blockno < 0) {
+		tfs_log(TFS_LOG_WARN, "Out of space\n");
+	}
+	return blockno;
+}
 
-			char * childstring = (char *) malloc(childlength + 1);
-			memcpy(childstring, path + parentlength, childlength);
-			childstring[childlength] = '\0';
-			return get_node_by_path((const char *) childstring, direntino, inode);
-			//CALL GET NODE BY PATH ON 
-		}		
+// Like get_avail_run(), for delayed file data, out of the space reserved for it
+blk_t get_reserved_run(blk_t goal, uint32_t want, uint32_t *got) {
 
+	pthread_mutex_lock(&alloc_lock);
+	blk_t blockno = data_alloc(goal >= (blk_t) sb.d_start_blk ? goal - (blk_t) sb.d_start_blk : -1, want, got, 1);
+	if(blockno >= 0) {
+		da_blocks += *got;
+		da_runs++;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	if(blockno < 0) {
+		tfs_log(TFS_LOG_WARN, "Out of space\n");
+		return -1;
 	}
+	return blockno + sb.d_start_blk;
+}
 
+// Reserve a free data block for delayed file data, or return -1 if there is none left
+int reserve_blkno() {
+	int ret = -1;
+	pthread_mutex_lock(&alloc_lock);
+	data_autogrow(1);
+	if(dbm.nfree > da_reserved) {
+		da_reserved++;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	return ret;
+}
 
-	return 0;
+void unreserve_blkno(uint32_t n) {
+	pthread_mutex_lock(&alloc_lock);
+	da_reserved -= n < da_reserved ? n : da_reserved;
+	pthread_mutex_unlock(&alloc_lock);
 }
 
+/*
+ * Inodes and data blocks freed by transactions that are not durable yet.
+ * Until the freeing transaction commits, a crash brings back the metadata
+ * that still points at them, so they must not be handed out and written
+ * over. Entries are in the order they were freed; tid is 0 while the
+ * freeing transaction is still running. Guarded by alloc_lock.
+ */
+struct deferred_free {
+	uint64_t	tid;				/* freeing transaction, 0 while running */
+	blk_t		num;				/* inode number or data block number */
+	int			is_ino;
+};
 
-void testGetNodeByPath() {
+static struct deferred_free *dfl;
+static uint32_t dfl_len, dfl_cap;
 
-	//Read current rootinode
-	struct inode * rootinode = (struct inode *) malloc(sizeof(struct inode));
-	readi(0, rootinode);
+// Give one freed number back to its bitmap. Caller holds alloc_lock.
+static void release_free(blk_t num, int is_ino) {
+	if(is_ino) {
+		bitmap_free(&ibm, num);
+	} else if(bitmap_free(&dbm, num - sb.d_start_blk) == 0) {
+		fidx_give(&dfree, num - sb.d_start_blk);
+	}
+}
+
+static void defer_free(blk_t num, int is_ino) {
+	pthread_mutex_lock(&alloc_lock);
+	if(dfl_len == dfl_cap) {
+		uint32_t cap = dfl_cap ? dfl_cap * 2 : 256;
+		struct deferred_free *p = realloc(dfl, cap * sizeof(struct deferred_free));
+		if(!p) {
+			// Nowhere to park it: release now, as before the journal
+			release_free(num, is_ino);
+			pthread_mutex_unlock(&alloc_lock);
+			return;
+		}
+		dfl = p;
+		dfl_cap = cap;
+	}
+	dfl[dfl_len].tid = 0;
+	dfl[dfl_len].num = num;
+	dfl[dfl_len].is_ino = is_ino;
+	dfl_len++;
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+// Mark the frees of the running transaction as its own. Caller holds alloc_lock.
+static void seal_frees(uint64_t tid) {
+	uint32_t i;
+	for(i = dfl_len; i > 0 && dfl[i - 1].tid == 0; i--) {
+		dfl[i - 1].tid = tid;
+	}
+}
+
+// Release the frees of every transaction up to committed
+static void release_frees(uint64_t committed) {
+	uint32_t i;
+	pthread_mutex_lock(&alloc_lock);
+	for(i = 0; i < dfl_len && dfl[i].tid != 0 && dfl[i].tid <= committed; i++) {
+		release_free(dfl[i].num, dfl[i].is_ino);
+	}
+	memmove(dfl, dfl + i, (dfl_len - i) * sizeof(struct deferred_free));
+	dfl_len -= i;
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Return an inode number / data block number to its bitmap once the
+ * running transaction has committed
+ */
+void put_ino(uint16_t ino) {
+	defer_free(ino, 1);
+}
+
+void put_blkno(blk_t blkno) {
+	defer_free(blkno, 0);
+}
+
+/*
+ * Hand a block just taken out of the delayed-allocation reservation back
+ * into it. Nothing on disk ever pointed at it, so it is free at once.
+ */
+void put_reserved_blkno(blk_t blkno) {
+	pthread_mutex_lock(&alloc_lock);
+	release_free(blkno, 0);
+	da_reserved++;
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * In-memory extent map of an inode: every extent of the file, sorted by
+ * logical block, so bmap() can binary search it. It is built from the
+ * on-disk extent root the first time the inode's blocks are needed and
+ * written back into it when the inode is.
+ */
+struct extent_map {
+	struct extent *	ext;
+	uint32_t		count;
+	uint32_t		cap;
+	uint8_t			loaded;
+	uint8_t			dirty;
+};
+
+/*
+ * File blocks written into holes while their allocation is delayed,
+ * sorted by logical block. Each holds a BLOCK_SIZE copy of its data and
+ * a reservation on one free data block until it is flushed.
+ */
+struct da_block {
+	uint32_t		lblk;
+	char *			data;
+};
+
+struct delalloc {
+	struct da_block *	blk;
+	uint32_t			count;			/* parked blocks, also read unlocked by icache_get() and icache_sync() */
+	uint32_t			cap;
+	uint32_t			leaves;			/* extent leaves reserved for when they are mapped */
+};
+
+/*
+ * Inode cache
+ *
+ * Inodes are kept decoded in memory, hashed by inode number and ordered
+ * by recency on an LRU list. writei() only updates the cached copy and
+ * marks it dirty; dirty inodes are packed back into their inode table
+ * block on eviction or by icache_sync(). Block mappings are not part of
+ * struct inode: they live here, in the on-disk extent root and the
+ * extent map built from it.
+ *
+ * icache_get() returns a referenced entry that stays put until
+ * icache_put(); entries that are referenced, pinned or still hold file
+ * data waiting for delayed allocation are never evicted.
+ * The entry's rwlock guards the inode, its extents and, for a directory,
+ * its entries: readers share it, anything that changes them holds it
+ * exclusively. Locks are taken parent before child, and inode locks
+ * before icache_lock. icache_wb_lock serializes writebacks, which
+ * rewrite inode table blocks shared by INODES_PER_BLOCK inodes, and the
+ * reads of those blocks by icache_get().
+ */
+struct icache_entry {
+	uint16_t			ino;			/* hash key, fixed while cached */
+	struct inode		inode;
+	uint8_t				dirty;
+	union {
+		struct extent	root[INODE_EXTENTS];	/* extent root as stored in the inode */
+		char			idata[INLINE_DATA_MAX];	/* or the file data of an inline file */
+	};
+	uint16_t			nroot;
+	uint16_t			ext_depth;
+	struct extent_map	emap;
+	struct delalloc		da;				/* file data not allocated yet */
+	pthread_rwlock_t	lock;
+	uint32_t			refs;			/* icache_get() references not yet put */
+	uint32_t			pincount;		/* open files holding the entry in the cache */
+	uint8_t				orphan;			/* unlinked while open, delete on last close */
+	uint8_t				loading;		/* being read in by icache_get(), which holds lock */
+	uint8_t				failed;			/* could not be read in; freed on the last icache_put() */
+	uint8_t				cache_seen;		/* opened since it was cached; see file_keep_cache() */
+	time_t				cache_mtime;	/* modification time and size at that open */
+	off_t				cache_size;
+	struct icache_entry	*hnext;			/* hash chain */
+	struct icache_entry	*prev, *next;	/* LRU list, most recent first */
+};
+
+struct icache {
+	struct icache_entry	**htable;
+	struct icache_entry	*head, *tail;
+	int					hmask;
+	int					count;
+	int					capacity;
+};
+
+struct icache icache;
+
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t icache_wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t emap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// Translate between the packed on-disk inode and the in-memory one
+static void inode_from_disk(struct inode *inode, const struct dinode *dinode) {
+
+	memset(inode, 0, sizeof(struct inode));
+	inode->ino = dinode->ino;
+	inode->valid = dinode->valid;
+	inode->size = dinode->size;
+	inode->type = dinode->type;
+	inode->link = dinode->link;
+	inode->flags = dinode->flags;
+	inode->dir_depth = dinode->dir_depth;
+
+	inode->vstat.st_ino = dinode->ino;
+	inode->vstat.st_mode = dinode->mode;
+	inode->vstat.st_nlink = dinode->nlink;
+	inode->vstat.st_uid = dinode->uid;
+	inode->vstat.st_gid = dinode->gid;
+	inode->vstat.st_size = dinode->size;
+	inode->vstat.st_blksize = BLOCK_SIZE;
+	inode->vstat.st_blocks = (blkcnt_t) dinode->link * (BLOCK_SIZE / 512);
+	inode->vstat.st_atime = dinode->atime;
+	inode->vstat.st_mtime = dinode->mtime;
+	inode->vstat.st_ctime = dinode->ctime;
+}
+
+static void inode_to_disk(struct dinode *dinode, const struct inode *inode) {
+
+	memset(dinode, 0, sizeof(struct dinode));
+	dinode->ino = inode->ino;
+	dinode->valid = inode->valid;
+	dinode->size = inode->vstat.st_size;
+	dinode->type = inode->type;
+	dinode->link = inode->link;
+	dinode->flags = inode->flags;
+	dinode->dir_depth = inode->dir_depth;
+
+	dinode->mode = inode->vstat.st_mode;
+	dinode->nlink = inode->vstat.st_nlink;
+	dinode->uid = inode->vstat.st_uid;
+	dinode->gid = inode->vstat.st_gid;
+	dinode->atime = inode->vstat.st_atime;
+	dinode->mtime = inode->vstat.st_mtime;
+	dinode->ctime = inode->vstat.st_ctime;
+}
+
+int icache_init(int capacity) {
+
+	int hsize;
+	for(hsize = 1; hsize < capacity; hsize <<= 1)
+		;
+
+	memset(&icache, 0, sizeof(struct icache));
+	icache.htable = (struct icache_entry **) calloc(hsize, sizeof(struct icache_entry *));
+	if(!icache.htable) {
+		return -1;
+	}
+	icache.hmask = hsize - 1;
+	icache.capacity = capacity > 0 ? capacity : 1;
+	return 0;
+}
+
+static struct icache_entry *icache_lookup(uint16_t ino) {
+	struct icache_entry *e;
+	for(e = icache.htable[ino & icache.hmask]; e; e = e->hnext) {
+		if(e->ino == ino) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void icache_lru_remove(struct icache_entry *e) {
+	if(e->prev) e->prev->next = e->next; else icache.head = e->next;
+	if(e->next) e->next->prev = e->prev; else icache.tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void icache_lru_push(struct icache_entry *e) {
+	e->prev = NULL;
+	e->next = icache.head;
+	if(icache.head) icache.head->prev = e; else icache.tail = e;
+	icache.head = e;
+}
+
+static int emap_store(struct icache_entry *e);
+static int da_flush(struct icache_entry *e);
+
+// Pack a cached inode into its slot of the inode table
+static int icache_writeback(struct icache_entry *e) {
+
+	int ret = -1;
+	blk_t blk = sb.i_start_blk + e->ino / INODES_PER_BLOCK;
+	void * datablock = NULL;
+
+	pthread_mutex_lock(&icache_wb_lock);
+	if(!e->dirty) {
+		ret = 0;
+		goto out;
+	}
+	if(!(datablock = malloc(BLOCK_SIZE)) || (e->emap.dirty && emap_store(e) < 0)) {
+		goto out;
+	}
+
+	if(bio_read(blk, datablock) < 0) {
+		goto out;
+	}
+	struct dinode * dinode = (struct dinode *) datablock + e->ino % INODES_PER_BLOCK;
+	inode_to_disk(dinode, &e->inode);
+	memcpy(dinode->data, e->idata, sizeof(dinode->data));
+	dinode->nextents = e->nroot;
+	dinode->ext_depth = e->ext_depth;
+	if(bio_write_meta(blk, datablock) >= 0) {
+		e->dirty = 0;
+		ret = 0;
+	}
+
+out:
+	pthread_mutex_unlock(&icache_wb_lock);
+	free(datablock);
+	return ret;
+}
+
+// Drop an entry no longer in the hash table or on the LRU list
+static void icache_free(struct icache_entry *e) {
+	unreserve_blkno(e->da.leaves);
+	free(e->da.blk);
+	free(e->emap.ext);
+	pthread_rwlock_destroy(&e->lock);
+	free(e);
+}
+
+static void icache_unhash(struct icache_entry *e) {
+	struct icache_entry **pp = &icache.htable[e->ino & icache.hmask];
+	while(*pp != e) {
+		pp = &(*pp)->hnext;
+	}
+	*pp = e->hnext;
+	icache_lru_remove(e);
+	icache.count--;
+}
+
+static void icache_put(struct icache_entry *e) {
+	pthread_mutex_lock(&icache_lock);
+	int gone = --e->refs == 0 && e->failed;
+	pthread_mutex_unlock(&icache_lock);
+	if(gone) {
+		icache_free(e);
+	}
+}
+
+/*
+ * Make room for one more entry: write the least recently used entry that
+ * can go back to the inode table and drop it, unless it was taken again
+ * meanwhile. Entries in use, pinned by open files or holding parked data
+ * are skipped; if all are, the cache grows. Called with icache_lock held,
+ * which is dropped for the writeback.
+ */
+static void icache_evict() {
+
+	struct icache_entry *e;
+	for(e = icache.count >= icache.capacity ? icache.tail : NULL;
+		e && (e->refs || e->pincount || __atomic_load_n(&e->da.count, __ATOMIC_RELAXED)); e = e->prev)
+		;
+	if(!e) {
+		return;
+	}
+
+	// The entry stays findable until its inode is back in the table. The
+	// caller may hold other inode locks, so one taken meanwhile is left be.
+	e->refs++;
+	pthread_mutex_unlock(&icache_lock);
+	if(pthread_rwlock_tryrdlock(&e->lock) == 0) {
+		icache_writeback(e);
+		pthread_rwlock_unlock(&e->lock);
+	}
+	pthread_mutex_lock(&icache_lock);
+
+	if(--e->refs == 0 && !e->dirty && !e->pincount && !__atomic_load_n(&e->da.count, __ATOMIC_RELAXED)) {
+		icache_unhash(e);
+		icache_free(e);
+	}
+}
+
+/*
+ * Find the cache entry for ino and take a reference on it, reading the
+ * inode from its table block if it is not cached yet and evicting the
+ * least recently used entry if full. Release it with icache_put().
+ *
+ * A missing inode is read in without icache_lock: the new entry goes into
+ * the cache first, exclusively locked and marked loading, and whoever
+ * finds it meanwhile waits on its lock.
+ */
+static struct icache_entry *icache_get(uint16_t ino) {
+
+	struct icache_entry *e, *n = NULL;
+	int evicted = 0;
+	pthread_mutex_lock(&icache_lock);
+again:
+	e = icache_lookup(ino);
+	if(e) {
+		icache_lru_remove(e);
+		icache_lru_push(e);
+		e->refs++;
+		int loading = e->loading;
+		pthread_mutex_unlock(&icache_lock);
+		if(n) {
+			pthread_rwlock_unlock(&n->lock);
+			icache_free(n);
+		}
+		if(loading) {
+			pthread_rwlock_rdlock(&e->lock);
+			int failed = e->failed;
+			pthread_rwlock_unlock(&e->lock);
+			if(failed) {
+				icache_put(e);
+				return NULL;
+			}
+		}
+		return e;
+	}
+	if(!evicted && icache.count >= icache.capacity) {
+		icache_evict();
+		evicted = 1;
+		goto again;
+	}
+
+	// Step 1: Make the entry, locked so that nobody uses it before it is read,
+	// and enter it unless another thread got there first
+	if(!n) {
+		pthread_mutex_unlock(&icache_lock);
+		n = (struct icache_entry *) malloc(sizeof(struct icache_entry));
+		if(!n) {
+			return NULL;
+		}
+		memset(n, 0, sizeof(struct icache_entry));
+		pthread_rwlock_init(&n->lock, NULL);
+		pthread_rwlock_wrlock(&n->lock);
+		n->inode.ino = ino;
+		n->ino = ino;
+		n->refs = 1;
+		n->loading = 1;
+		pthread_mutex_lock(&icache_lock);
+		goto again;
+	}
+	e = n;
+	e->hnext = icache.htable[ino & icache.hmask];
+	icache.htable[ino & icache.hmask] = e;
+	icache_lru_push(e);
+	icache.count++;
+	pthread_mutex_unlock(&icache_lock);
+
+	// Step 2: Get the inode's on-disk block number and offset within it, and
+	// decode it; writebacks of the same table block are kept out meanwhile
+	void * datablock = malloc(BLOCK_SIZE);
+	int ret = -1;
+	pthread_mutex_lock(&icache_wb_lock);
+	if(datablock && bio_read(sb.i_start_blk + ino / INODES_PER_BLOCK, datablock) >= 0) {
+		struct dinode * dinode = (struct dinode *) datablock + ino % INODES_PER_BLOCK;
+		inode_from_disk(&e->inode, dinode);
+		memcpy(e->idata, dinode->data, sizeof(e->idata));
+		e->nroot = dinode->nextents;
+		e->ext_depth = dinode->ext_depth;
+		e->inode.ino = ino;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&icache_wb_lock);
+	free(datablock);
+
+	// Step 3: Let the waiters in; if the read failed the entry goes with the last of them
+	if(ret < 0) {
+		e->failed = 1;
+	}
+	pthread_mutex_lock(&icache_lock);
+	e->loading = 0;
+	if(ret < 0) {
+		icache_unhash(e);
+	}
+	pthread_mutex_unlock(&icache_lock);
+	pthread_rwlock_unlock(&e->lock);
+	if(ret < 0) {
+		icache_put(e);
+		return NULL;
+	}
+	return e;
+}
+
+static int icache_cmp(const void *a, const void *b) {
+	return (int) (*(struct icache_entry **) a)->ino - (int) (*(struct icache_entry **) b)->ino;
+}
+
+/*
+ * Write every dirty cached inode back to the inode table, in inode order,
+ * first giving disk space to any file data whose allocation was delayed
+ */
+int icache_sync() {
+
+	int i, n = 0, ret = 0;
+	struct icache_entry *e;
+
+	pthread_mutex_lock(&icache_lock);
+	struct icache_entry ** ents = (struct icache_entry **) malloc((icache.count + 1) * sizeof(struct icache_entry *));
+	if(!ents) {
+		pthread_mutex_unlock(&icache_lock);
+		return -1;
+	}
+	for(e = icache.head; e; e = e->next) {
+		e->refs++;
+		ents[n++] = e;
+	}
+	pthread_mutex_unlock(&icache_lock);
+
+	// Whether an entry is dirty can only be read under its lock
+	qsort(ents, n, sizeof(struct icache_entry *), icache_cmp);
+	for(i = 0; i < n; i++) {
+		if(__atomic_load_n(&ents[i]->da.count, __ATOMIC_RELAXED)) {
+			pthread_rwlock_wrlock(&ents[i]->lock);
+			if(da_flush(ents[i]) < 0) {
+				ret = -1;
+			}
+		} else {
+			pthread_rwlock_rdlock(&ents[i]->lock);
+		}
+		if(icache_writeback(ents[i]) < 0) {
+			ret = -1;
+		}
+		pthread_rwlock_unlock(&ents[i]->lock);
+		icache_put(ents[i]);
+	}
+	free(ents);
+	return ret;
+}
+
+void icache_destroy() {
+
+	struct icache_entry *e, *next;
+	for(e = icache.head; e; e = next) {
+		next = e->next;
+		for(uint32_t i = 0; i < e->da.count; i++) {
+			free(e->da.blk[i].data);
+		}
+		free(e->da.blk);
+		free(e->emap.ext);
+		pthread_rwlock_destroy(&e->lock);
+		free(e);
+	}
+	free(icache.htable);
+	memset(&icache, 0, sizeof(struct icache));
+}
+
+/* 
+ * inode operations
+ */
+int readi(uint16_t ino, struct inode *inode) {
+
+	if(ino >= sb.max_inum) {
+		return -1;
+	}
+
+	// Serve the inode from the inode cache, which reads it in on a miss
+	struct icache_entry *e = icache_get(ino);
+	if(!e) {
+		return -1;
+	}
+	memcpy(inode, &e->inode, sizeof(struct inode));
+	icache_put(e);
+
+	return 0;
+}
+
+int writei(uint16_t ino, struct inode *inode) {
+
+	if(ino >= sb.max_inum) {
+		return -1;
+	}
+
+	// Update the cached copy; it reaches the inode table on eviction or sync
+	struct icache_entry *e = icache_get(ino);
+	if(!e) {
+		return -1;
+	}
+
+	memcpy(&e->inode, inode, sizeof(struct inode));
+	e->inode.ino = ino;
+	e->dirty = 1;
+	icache_put(e);
+
+	return 0;
+}
+
+
+/*
+ * Extent maps
+ */
+
+// Build the in-memory extent map from the extent root and its leaves
+static int emap_load(struct icache_entry *e) {
+
+	struct extent_map *m = &e->emap;
+	uint32_t i, total = 0;
+	int ret = -1;
+
+	// Readers share the inode lock, so several may race to build the map
+	if(__atomic_load_n(&m->loaded, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	pthread_mutex_lock(&emap_lock);
+	if(m->loaded) {
+		ret = 0;
+		goto out;
+	}
+
+	if(e->ext_depth == 0) {
+		total = e->nroot;
+	} else {
+		for(i = 0; i < e->nroot; i++) {
+			total += e->root[i].len;
+		}
+	}
+
+	m->cap = total > INODE_EXTENTS ? total : INODE_EXTENTS;
+	m->ext = (struct extent *) malloc(m->cap * sizeof(struct extent));
+	if(!m->ext) {
+		goto out;
+	}
+
+	if(e->ext_depth == 0) {
+		memcpy(m->ext, e->root, e->nroot * sizeof(struct extent));
+	} else {
+		// A leaf that cannot be read must not pass for holes, or storing the map would make them real
+		struct extent * leaf = (struct extent *) malloc(BLOCK_SIZE);
+		for(i = 0, total = 0; i < e->nroot; i++) {
+			if(!leaf || bio_read(e->root[i].pblk, leaf) < 0) {
+				free(leaf);
+				free(m->ext);
+				m->ext = NULL;
+				m->cap = 0;
+				goto out;
+			}
+			memcpy(m->ext + total, leaf, e->root[i].len * sizeof(struct extent));
+			total += e->root[i].len;
+		}
+		free(leaf);
+	}
+
+	m->count = total;
+	m->dirty = 0;
+	__atomic_store_n(&m->loaded, 1, __ATOMIC_RELEASE);
+	ret = 0;
+out:
+	pthread_mutex_unlock(&emap_lock);
+	return ret;
+}
+
+// Once all parked data is mapped and stored, the leaves reserved for it are not needed
+static void emap_leaves_done(struct icache_entry *e) {
+	if(e->da.leaves && e->da.count == 0) {
+		unreserve_blkno(e->da.leaves);
+		e->da.leaves = 0;
+	}
+}
+
+/*
+ * Write the extent map back into the extent root: inline if it fits, else
+ * spread over leaf blocks, reusing the leaves the inode already owns.
+ */
+static int emap_store(struct icache_entry *e) {
+
+	struct extent_map *m = &e->emap;
+	uint32_t i, nleaves, oldleaves = e->ext_depth ? e->nroot : 0;
+	blk_t leafblk[INODE_EXTENTS];
+
+	for(i = 0; i < oldleaves; i++) {
+		leafblk[i] = e->root[i].pblk;
+	}
+
+	if(m->count <= INODE_EXTENTS) {
+		for(i = 0; i < oldleaves; i++) {
+			put_blkno(leafblk[i]);
+		}
+		memcpy(e->root, m->ext, m->count * sizeof(struct extent));
+		e->nroot = m->count;
+		e->ext_depth = 0;
+		m->dirty = 0;
+		emap_leaves_done(e);
+		return 0;
+	}
+
+	nleaves = (m->count + EXTENTS_PER_LEAF - 1) / EXTENTS_PER_LEAF;
+	if(nleaves > INODE_EXTENTS) {
+		return -1;
+	}
+	uint32_t reserved = 0;
+	for(i = oldleaves; i < nleaves; i++) {
+		blk_t blockno = e->da.leaves ? get_reserved_blkno() : get_avail_blkno();
+		if(blockno < 0) {
+			// Nothing points at the leaves taken so far: give them back, into the reservation if they came out of it
+			while(i-- > oldleaves) {
+				if(i - oldleaves < reserved) {
+					put_reserved_blkno(leafblk[i]);
+				} else {
+					put_blkno(leafblk[i]);
+				}
+			}
+			e->da.leaves += reserved;
+			return -1;
+		}
+		if(e->da.leaves) {
+			e->da.leaves--;
+			reserved++;
+		}
+		leafblk[i] = blockno + sb.d_start_blk;
+	}
+	for(i = nleaves; i < oldleaves; i++) {
+		put_blkno(leafblk[i]);
+	}
+
+	struct extent * leaf = (struct extent *) calloc(1, BLOCK_SIZE);
+	for(i = 0; i < nleaves; i++) {
+		uint32_t first = i * EXTENTS_PER_LEAF;
+		uint32_t n = m->count - first < EXTENTS_PER_LEAF ? m->count - first : EXTENTS_PER_LEAF;
+
+		memset(leaf, 0, BLOCK_SIZE);
+		memcpy(leaf, m->ext + first, n * sizeof(struct extent));
+		bio_write_meta(leafblk[i], leaf);
+
+		e->root[i].lblk = m->ext[first].lblk;
+		e->root[i].pblk = leafblk[i];
+		e->root[i].len = n;
+	}
+	free(leaf);
+
+	e->nroot = nleaves;
+	e->ext_depth = 1;
+	m->dirty = 0;
+	emap_leaves_done(e);
+	return 0;
+}
+
+// Index of the last extent starting at or before lblk, or -1 if there is none
+static int emap_search(struct extent_map *m, uint32_t lblk) {
+
+	int lo = 0, hi = (int) m->count - 1, found = -1;
+	while(lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		if(m->ext[mid].lblk <= lblk) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return found;
+}
+
+// Record that lblk now lives in pblk, merging with the neighbouring extents
+static int emap_insert(struct extent_map *m, uint32_t lblk, blk_t pblk) {
+
+	int i = emap_search(m, lblk);
+	struct extent *prev = i >= 0 ? &m->ext[i] : NULL;
+	struct extent *next = i + 1 < (int) m->count ? &m->ext[i + 1] : NULL;
+
+	int joins_prev = prev && prev->lblk + prev->len == lblk && prev->pblk + prev->len == (uint64_t) pblk;
+	int joins_next = next && lblk + 1 == next->lblk && (uint64_t) pblk + 1 == next->pblk;
+
+	if(joins_prev && joins_next) {
+		prev->len += 1 + next->len;
+		memmove(next, next + 1, (m->count - i - 2) * sizeof(struct extent));
+		m->count--;
+	} else if(joins_prev) {
+		prev->len++;
+	} else if(joins_next) {
+		next->lblk--;
+		next->pblk--;
+		next->len++;
+	} else {
+		if(m->count == MAX_EXTENTS) {
+			return -1;
+		}
+		if(m->count == m->cap) {
+			struct extent * grown = (struct extent *) realloc(m->ext, m->cap * 2 * sizeof(struct extent));
+			if(!grown) {
+				return -1;
+			}
+			m->ext = grown;
+			m->cap *= 2;
+		}
+		memmove(&m->ext[i + 2], &m->ext[i + 1], (m->count - i - 1) * sizeof(struct extent));
+		m->ext[i + 1].lblk = lblk;
+		m->ext[i + 1].pblk = pblk;
+		m->ext[i + 1].len = 1;
+		m->count++;
+	}
+
+	m->dirty = 1;
+	return 0;
+}
+
+
+/*
+ * Map logical block lblk of an inode to its block on disk by searching the
+ * inode's extent map. With create set, a missing block is allocated
+ * where the preceding extent would continue, or as near to it as there is
+ * space, so the file stays contiguous. Returns the block number, 0 for an unmapped block, or -1 on
+ * error. If count is not NULL it receives the number of blocks from lblk
+ * that are mapped contiguously (or, for a hole, unmapped).
+ */
+static blk_t ent_bmap(struct icache_entry *e, uint32_t lblk, int create, uint32_t *count) {
+
+	if(emap_load(e) < 0) {
+		return -1;
+	}
+
+	struct extent_map *m = &e->emap;
+	int i = emap_search(m, lblk);
+	if(i >= 0 && lblk < m->ext[i].lblk + m->ext[i].len) {
+		if(count) {
+			*count = m->ext[i].lblk + m->ext[i].len - lblk;
+		}
+		return m->ext[i].pblk + (lblk - m->ext[i].lblk);
+	}
+
+	if(!create) {
+		if(count) {
+			*count = i + 1 < (int) m->count ? m->ext[i + 1].lblk - lblk : UINT32_MAX - lblk;
+		}
+		return 0;
+	}
+
+	// Aim for the block after the one mapping lblk - 1, wherever that is
+	uint32_t got;
+	blk_t goal = -1;
+	if(i >= 0) {
+		goal = m->ext[i].pblk + m->ext[i].len + (lblk - m->ext[i].lblk - m->ext[i].len);
+	}
+	blk_t blockno = get_avail_run(goal, 1, &got);
+	if(blockno < 0) {
+		return -1;
+	}
+
+	if(emap_insert(m, lblk, blockno) < 0) {
+		put_blkno(blockno);
+		return -1;
+	}
+	e->dirty = 1;
+
+	if(count) {
+		*count = 1;
+	}
+	return blockno;
+}
+
+blk_t bmap_len(struct inode *inode, uint32_t lblk, int create, uint32_t *count) {
+
+	struct icache_entry *e = icache_get(inode->ino);
+	if(!e) {
+		return -1;
+	}
+	blk_t blockno = ent_bmap(e, lblk, create, count);
+	icache_put(e);
+	return blockno;
+}
+
+blk_t bmap(struct inode *inode, uint32_t lblk, int create) {
+	return bmap_len(inode, lblk, create, NULL);
+}
+
+
+/*
+ * Delayed allocation
+ *
+ * A write that fills a hole in a file does not give the block a place on
+ * disk straight away: the data is parked in the inode's cache entry and
+ * the block stays unmapped. Parked blocks are allocated when the entry is
+ * flushed, by icache_sync() on flush, release and unmount or once a file
+ * parks more than tfs_opts.delalloc_blocks, or all files together more
+ * than tfs_opts.delalloc_total. By then the length of each run of new
+ * blocks is known, so it is allocated as one extent, and files written
+ * side by side no longer interleave their blocks on disk. Parked blocks
+ * reserve their space, and that of the extent leaves they may need, so
+ * the flush cannot run out of it. Readers see parked data wherever the
+ * extent map shows a hole. All of this runs under the inode's lock,
+ * shared for lookups and exclusive for changes.
+ */
+
+// Index of the first parked block at or after lblk
+static uint32_t da_search(struct delalloc *d, uint32_t lblk) {
+
+	uint32_t lo = 0, hi = d->count;
+	while(lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if(d->blk[mid].lblk < lblk) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// The parked data of lblk, or NULL if it has none
+static char *da_lookup(struct icache_entry *e, uint32_t lblk) {
+
+	struct delalloc *d = &e->da;
+	if(d->count == 0) {
+		return NULL;
+	}
+	uint32_t i = da_search(d, lblk);
+	return i < d->count && d->blk[i].lblk == lblk ? d->blk[i].data : NULL;
+}
+
+/*
+ * Extent leaves the inode might need once its parked data is mapped, if
+ * every parked block ends up an extent of its own, beyond those it has
+ */
+static uint32_t da_leaves_wanted(struct icache_entry *e, uint32_t parked) {
+
+	uint32_t extents = e->emap.count + parked, want, have;
+	if(extents <= INODE_EXTENTS) {
+		return 0;
+	}
+	want = (extents + EXTENTS_PER_LEAF - 1) / EXTENTS_PER_LEAF;
+	want = want < INODE_EXTENTS ? want : INODE_EXTENTS;
+	have = (e->ext_depth ? e->nroot : 0) + e->da.leaves;
+	return want > have ? want - have : 0;
+}
+
+/*
+ * Return the parked block for lblk, parking a zeroed one if it has none
+ * yet. Each new block reserves a free data block, and another one now
+ * and then for the extent leaf it may come to need. Returns NULL if the
+ * disk is full or memory runs out.
+ */
+static char *da_park(struct icache_entry *e, uint32_t lblk) {
+
+	struct delalloc *d = &e->da;
+	uint32_t i = da_search(d, lblk);
+	if(i < d->count && d->blk[i].lblk == lblk) {
+		return d->blk[i].data;
+	}
+
+	if(d->count == d->cap) {
+		uint32_t cap = d->cap ? d->cap * 2 : 64;
+		struct da_block * grown = (struct da_block *) realloc(d->blk, cap * sizeof(struct da_block));
+		if(!grown) {
+			return NULL;
+		}
+		d->blk = grown;
+		d->cap = cap;
+	}
+	char * data = (char *) calloc(1, BLOCK_SIZE);
+	if(!data || emap_load(e) < 0) {
+		free(data);
+		return NULL;
+	}
+	if(reserve_blkno() < 0) {
+		free(data);
+		return NULL;
+	}
+	if(da_leaves_wanted(e, d->count + 1) > 0) {
+		if(reserve_blkno() < 0) {
+			unreserve_blkno(1);
+			free(data);
+			return NULL;
+		}
+		d->leaves++;
+	}
+
+	memmove(&d->blk[i + 1], &d->blk[i], (d->count - i) * sizeof(struct da_block));
+	d->blk[i].lblk = lblk;
+	d->blk[i].data = data;
+	__atomic_store_n(&d->count, d->count + 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&da_parked, 1, __ATOMIC_RELAXED);
+	return data;
+}
+
+// Copy len bytes at off of hole block lblk into buf: its parked data if it has any, else zeros
+static void da_read(struct icache_entry *e, uint32_t lblk, char *buf, size_t off, size_t len) {
+
+	char * data = da_lookup(e, lblk);
+	if(data) {
+		memcpy(buf, data + off, len);
+	} else {
+		memset(buf, 0, len);
+	}
+}
+
+/*
+ * Give every parked block of a file its place on disk: each run of
+ * consecutive logical blocks is allocated as one extent, right after the
+ * block before it when that is free, and written out with one vectored
+ * write. Blocks that cannot be allocated stay parked. The caller holds
+ * the inode's lock exclusively.
+ */
+static int da_flush(struct icache_entry *e) {
+
+	struct delalloc *d = &e->da;
+	uint32_t i = 0, k;
+	int ret = 0;
+
+	if(d->count == 0) {
+		return 0;
+	}
+	struct bio_vec * vec = (struct bio_vec *) malloc(d->count * sizeof(struct bio_vec));
+	if(!vec || emap_load(e) < 0) {
+		free(vec);
+		return -1;
+	}
+
+	while(i < d->count && ret == 0) {
+		uint32_t lblk = d->blk[i].lblk, want, got;
+		for(want = 1; i + want < d->count && d->blk[i + want].lblk == lblk + want; want++)
+			;
+
+		blk_t prev = lblk > 0 ? ent_bmap(e, lblk - 1, 0, NULL) : 0;
+		blk_t blockno = get_reserved_run(prev > 0 ? prev + 1 : -1, want, &got);
+		if(blockno < 0) {
+			ret = -1;
+			break;
+		}
+
+		for(k = 0; k < got; k++) {
+			if(emap_insert(&e->emap, lblk + k, blockno + k) < 0) {
+				break;
+			}
+			vec[k].blkno = blockno + k;
+			vec[k].buf = d->blk[i + k].data;
+		}
+		// Blocks the extent map had no room for go back into the reservation
+		if(k < got) {
+			for(uint32_t j = k; j < got; j++) {
+				put_reserved_blkno(blockno + j);
+			}
+			ret = -1;
+		}
+
+		if(k > 0 && bio_writev(vec, k) < 0) {
+			ret = -1;
+		}
+		for(uint32_t j = 0; j < k; j++) {
+			free(d->blk[i + j].data);
+		}
+		e->inode.link += k;
+		e->dirty = 1;
+		i += k;
+	}
+	free(vec);
+
+	memmove(d->blk, d->blk + i, (d->count - i) * sizeof(struct da_block));
+	__atomic_store_n(&d->count, d->count - i, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&da_parked, i, __ATOMIC_RELAXED);
+	return ret;
+}
+
+// Throw away every parked block of a file that is being deleted
+static void da_drop(struct icache_entry *e) {
+
+	struct delalloc *d = &e->da;
+	for(uint32_t i = 0; i < d->count; i++) {
+		free(d->blk[i].data);
+	}
+	unreserve_blkno(d->count + d->leaves);
+	__atomic_sub_fetch(&da_parked, d->count, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->count, 0, __ATOMIC_RELAXED);
+	d->leaves = 0;
+}
+
+// Release every data block and extent leaf owned by an inode
+static void ent_free_blocks(struct icache_entry *e) {
+
+	uint32_t i, j;
+	da_drop(e);
+	if(emap_load(e) < 0) {
+		return;
+	}
+
+	for(i = 0; i < e->emap.count; i++) {
+		for(j = 0; j < e->emap.ext[i].len; j++) {
+			put_blkno(e->emap.ext[i].pblk + j);
+		}
+	}
+	if(e->ext_depth) {
+		for(i = 0; i < e->nroot; i++) {
+			put_blkno(e->root[i].pblk);
+		}
+	}
+
+	e->emap.count = 0;
+	e->emap.dirty = 1;
+	e->nroot = 0;
+	e->ext_depth = 0;
+	e->inode.link = 0;
+	e->dirty = 1;
+}
+
+void inode_free_blocks(struct inode *inode) {
+
+	struct icache_entry *e = icache_get(inode->ino);
+	if(e) {
+		ent_free_blocks(e);
+		icache_put(e);
+	}
+	inode->link = 0;
+}
+
+// Free an inode that no directory entry or open file refers to any more
+static void ent_delete(struct icache_entry *e) {
+
+	ent_free_blocks(e);
+	e->inode.valid = 0;
+	e->inode.vstat.st_nlink = 0;
+	e->orphan = 0;
+	e->dirty = 1;
+	put_ino(e->ino);
+}
+
+// Kernel lookup references per inode, taken by each entry reply and dropped by forget
+uint32_t *ino_lookups;
+
+/*
+ * An unlinked inode the kernel or an open file still refers to is kept as
+ * an orphan, holding one pin of its own so it stays cached. Delete it once
+ * that pin is the only reference left. The caller holds a reference on e
+ * and no locks.
+ */
+static void inode_reap(struct icache_entry *e) {
+
+	int dead = 0;
+	pthread_mutex_lock(&icache_lock);
+	if(e->orphan && e->pincount == 1 && ino_lookups[e->ino] == 0) {
+		e->orphan = 0;
+		e->pincount = 0;
+		dead = 1;
+	}
+	pthread_mutex_unlock(&icache_lock);
+
+	if(dead) {
+		pthread_rwlock_wrlock(&e->lock);
+		ent_delete(e);
+		pthread_rwlock_unlock(&e->lock);
+	}
+}
+
+/*
+ * Push all in-memory metadata into the running journal transaction. The
+ * journal calls this while no operation is in flight.
+ */
+static int tfs_prepare_commit() {
+	int ret = 0;
+
+	if(icache_sync() < 0) {
+		ret = -1;
+	}
+	pthread_mutex_lock(&alloc_lock);
+	if(bitmap_sync(&ibm) < 0 || bitmap_sync(&dbm) < 0 || sb_sync() < 0) {
+		ret = -1;
+	}
+	seal_frees(jnl_tid());
+	pthread_mutex_unlock(&alloc_lock);
+	return ret;
+}
+
+/*
+ * Make everything done so far durable: the data blocks the cache is
+ * holding, then all metadata as one journal transaction
+ */
+int tfs_writeback() {
+	struct jnl_stats js;
+	int ret = jnl_commit(tfs_prepare_commit);
+
+	// What the committed transactions freed can be reused now
+	jnl_stats(&js);
+	release_frees(js.committed);
+	return ret;
+}
+
+/*
+ * Journal commits
+ *
+ * Every operation that changes metadata runs inside a journal handle
+ * (tfs_op_begin()/tfs_op_end()), so a commit never catches one half
+ * done. Commits are made by a background thread every
+ * tfs_opts.commit_interval seconds, or sooner when an fsync asks for one;
+ * every operation that finished by then goes out in the same journal
+ * write, as do the fsyncs that arrive while a commit is being written.
+ * With fsync=sync each operation commits before it replies instead, and
+ * with fsync=async fsync does not wait at all. The thread also
+ * checkpoints the journal once it is half full, and empties it when
+ * the file system is idle.
+ */
+struct committer {
+	pthread_t			thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	int					running;
+	int					requested;		/* an fsync is waiting for a commit */
+	uint64_t			handles;		/* operations seen by the last commit */
+};
+
+static struct committer jc = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void tfs_op_begin() {
+	jnl_start();
+}
+
+static void tfs_op_end() {
+	jnl_stop();
+	if(tfs_opts.fsync_mode == FSYNC_SYNC) {
+		tfs_writeback();
+	}
+}
+
+/*
+ * An allocation that ran out of space may succeed once the running
+ * transaction commits and what it freed can be reused. Called after
+ * tfs_op_end(), with no handle held, to commit once; returns 1 if the
+ * operation is worth retrying.
+ */
+static int tfs_retry_alloc(int ret, int *tries) {
+
+	if(ret != -ENOSPC || (*tries)++ > 0) {
+		return 0;
+	}
+	pthread_mutex_lock(&alloc_lock);
+	uint32_t deferred = dfl_len;
+	pthread_mutex_unlock(&alloc_lock);
+	if(deferred == 0) {
+		return 0;
+	}
+	tfs_writeback();
+	return 1;
+}
+
+// Have the commit thread commit now rather than at the next interval
+static void commit_request() {
+	pthread_mutex_lock(&jc.lock);
+	jc.requested = 1;
+	pthread_cond_signal(&jc.cond);
+	pthread_mutex_unlock(&jc.lock);
+}
+
+// Wait until everything done so far is durable, as fsync_mode says; -EIO if it could not be made so
+static int tfs_sync() {
+
+	if(tfs_opts.fsync_mode == FSYNC_ASYNC) {
+		return 0;
+	}
+	if(tfs_opts.fsync_mode == FSYNC_SYNC || !jc.running) {
+		return tfs_writeback() < 0 ? -EIO : 0;
+	}
+	// The commit thread drops what its commit returns; the journal keeps the error for us
+	uint64_t tid = jnl_tid();
+	commit_request();
+	return jnl_wait(tid) < 0 ? -EIO : 0;
+}
+
+static void *commit_worker(void *arg) {
+
+	pthread_mutex_lock(&jc.lock);
+	while(jc.running) {
+		if(!jc.requested) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += tfs_opts.commit_interval;
+			pthread_cond_timedwait(&jc.cond, &jc.lock, &ts);
+		}
+		if(!jc.running) {
+			break;
+		}
+		int requested = jc.requested;
+		jc.requested = 0;
+		pthread_mutex_unlock(&jc.lock);
+
+		// Commit if anything happened since the last commit
+		struct jnl_stats st;
+		jnl_stats(&st);
+		if(requested || st.handles != jc.handles || st.running > 0) {
+			jc.handles = st.handles;
+			if(tfs_writeback() < 0) {
+				tfs_log(TFS_LOG_WARN, "Journal commit failed\n");
+			}
+			jnl_stats(&st);
+			if(st.used > st.size / 2) {
+				jnl_checkpoint(st.size / 4);
+			}
+		} else if(st.used > 0) {
+			jnl_checkpoint(0);
+		}
+
+		pthread_mutex_lock(&jc.lock);
+	}
+	pthread_mutex_unlock(&jc.lock);
+	return NULL;
+}
+
+static int commit_start() {
+
+	if(tfs_opts.commit_interval <= 0) {
+		tfs_opts.commit_interval = JNL_COMMIT_INTERVAL;
+	}
+	jc.requested = 0;
+	jc.handles = 0;
+	jc.running = 1;
+	if(pthread_create(&jc.thread, NULL, commit_worker, NULL) != 0) {
+		jc.running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+static void commit_stop() {
+
+	if(!jc.running) {
+		return;
+	}
+	pthread_mutex_lock(&jc.lock);
+	jc.running = 0;
+	pthread_cond_signal(&jc.cond);
+	pthread_mutex_unlock(&jc.lock);
+	pthread_join(jc.thread, NULL);
+}
+
+
+void printinode(struct inode * inode){
+	tfs_log(TFS_LOG_DEBUG, "\n--------PRINTING INODE-------------\n");
+	tfs_log(TFS_LOG_DEBUG, "Inode Number: %d\n", inode->ino);
+	tfs_log(TFS_LOG_DEBUG, "Link Count: %d\n", inode->link);
+	tfs_log(TFS_LOG_DEBUG, "Data Block Numbers: ");
+	uint32_t i;
+	for(i = 0; i < inode->link; i++) {
+		tfs_log(TFS_LOG_DEBUG, "[%ld] -> ", (long) bmap(inode, i, 0));
+	} 
+	tfs_log(TFS_LOG_DEBUG, "\n\n");
+}
+
+
+/*
+ * Directory entry cache
+ *
+ * Maps (parent inode, name) to the child's inode number. A lookup that
+ * finds nothing is remembered as a negative entry so repeated misses do
+ * not rescan the directory. dir_add() and dir_remove() keep the entries
+ * for the names they touch current, and tfs_rmdir() drops everything
+ * cached under the removed directory.
+ */
+struct dcache_entry {
+	uint16_t			parent;			/* inode of the containing directory */
+	uint16_t			ino;			/* inode of the entry, if positive */
+	uint8_t				negative;		/* name is known not to exist */
+	uint32_t			hash;
+	char				*name;
+	struct dcache_entry	*hnext;			/* hash chain */
+	struct dcache_entry	*prev, *next;	/* LRU list, most recent first */
+};
+
+struct dcache {
+	struct dcache_entry	**htable;
+	struct dcache_entry	*head, *tail;
+	int					hmask;
+	int					count;
+	int					capacity;
+	uint64_t			hits;
+	uint64_t			neg_hits;
+	uint64_t			misses;
+};
+
+struct dcache dcache;
+
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// FNV-1a hash of a file name
+uint32_t name_hash(const char *name, size_t len) {
+	uint32_t h = 2166136261u;
+	size_t i;
+	for(i = 0; i < len; i++) {
+		h = (h ^ (unsigned char) name[i]) * 16777619u;
+	}
+	return h;
+}
+
+static inline uint32_t dcache_hash(uint16_t parent, uint32_t hash) {
+	return (hash ^ (parent * 2654435761u)) & dcache.hmask;
+}
+
+int dcache_init(int capacity) {
+
+	int hsize;
+	for(hsize = 1; hsize < capacity; hsize <<= 1)
+		;
+
+	memset(&dcache, 0, sizeof(struct dcache));
+	dcache.htable = (struct dcache_entry **) calloc(hsize, sizeof(struct dcache_entry *));
+	if(!dcache.htable) {
+		return -1;
+	}
+	dcache.hmask = hsize - 1;
+	dcache.capacity = capacity;
+	return 0;
+}
+
+static void dcache_unlink(struct dcache_entry *e) {
+
+	struct dcache_entry **pp = &dcache.htable[dcache_hash(e->parent, e->hash)];
+	while(*pp != e) {
+		pp = &(*pp)->hnext;
+	}
+	*pp = e->hnext;
+
+	if(e->prev) e->prev->next = e->next; else dcache.head = e->next;
+	if(e->next) e->next->prev = e->prev; else dcache.tail = e->prev;
+
+	free(e->name);
+	free(e);
+	dcache.count--;
+}
+
+static struct dcache_entry *dcache_find(uint16_t parent, const char *name, size_t name_len, uint32_t hash) {
+
+	struct dcache_entry *e;
+	for(e = dcache.htable[dcache_hash(parent, hash)]; e; e = e->hnext) {
+		if(e->parent == parent && e->hash == hash &&
+		   !strncmp(e->name, name, name_len) && e->name[name_len] == '\0') {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Look up name in parent. Returns 1 and sets *ino on a positive hit, 0 on
+ * a negative hit, and -1 if the cache knows nothing about the name.
+ */
+int dcache_lookup(uint16_t parent, const char *name, size_t name_len, uint16_t *ino) {
+
+	if(!dcache.capacity) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&dcache_lock);
+	struct dcache_entry *e = dcache_find(parent, name, name_len, name_hash(name, name_len));
+	if(!e) {
+		dcache.misses++;
+		pthread_mutex_unlock(&dcache_lock);
+		return -1;
+	}
+
+	// Move to the front of the LRU list
+	if(e != dcache.head) {
+		if(e->prev) e->prev->next = e->next;
+		if(e->next) e->next->prev = e->prev; else dcache.tail = e->prev;
+		e->prev = NULL;
+		e->next = dcache.head;
+		dcache.head->prev = e;
+		dcache.head = e;
+	}
+
+	int ret = 0;
+	if(e->negative) {
+		dcache.neg_hits++;
+	} else {
+		dcache.hits++;
+		*ino = e->ino;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&dcache_lock);
+	return ret;
+}
+
+// Record that name in parent refers to ino, or does not exist if negative is set
+void dcache_insert(uint16_t parent, const char *name, size_t name_len, uint16_t ino, int negative) {
+
+	if(!dcache.capacity) {
+		return;
+	}
+
+	uint32_t hash = name_hash(name, name_len);
+	pthread_mutex_lock(&dcache_lock);
+	struct dcache_entry *e = dcache_find(parent, name, name_len, hash);
+	if(e) {
+		e->ino = ino;
+		e->negative = negative;
+		pthread_mutex_unlock(&dcache_lock);
+		return;
+	}
+
+	if(dcache.count >= dcache.capacity) {
+		dcache_unlink(dcache.tail);
+	}
+
+	e = (struct dcache_entry *) malloc(sizeof(struct dcache_entry));
+	if(e) {
+		e->name = strndup(name, name_len);
+	}
+	if(!e || !e->name) {
+		free(e);
+		pthread_mutex_unlock(&dcache_lock);
+		return;
+	}
+	e->parent = parent;
+	e->ino = ino;
+	e->negative = negative;
+	e->hash = hash;
+
+	uint32_t h = dcache_hash(parent, hash);
+	e->hnext = dcache.htable[h];
+	dcache.htable[h] = e;
+	e->prev = NULL;
+	e->next = dcache.head;
+	if(dcache.head) dcache.head->prev = e; else dcache.tail = e;
+	dcache.head = e;
+	dcache.count++;
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+// Drop every entry cached under a directory that is going away
+void dcache_purge_dir(uint16_t parent) {
+
+	struct dcache_entry *e, *next;
+	pthread_mutex_lock(&dcache_lock);
+	for(e = dcache.head; e; e = next) {
+		next = e->next;
+		if(e->parent == parent) {
+			dcache_unlink(e);
+		}
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_destroy() {
+
+	while(dcache.head) {
+		dcache_unlink(dcache.head);
+	}
+	free(dcache.htable);
+	memset(&dcache, 0, sizeof(struct dcache));
+}
+
+
+/* 
+ * directory operations
+ */
+
+// Records of a directory block, which in an indexed directory follow the leaf header
+static char *dir_block_records(struct inode *dir_inode, void *datablock, size_t *len) {
+	if(dir_inode->flags & TFS_INDEX_FL) {
+		*len = BLOCK_SIZE - sizeof(struct dir_leaf);
+		return (char *) ((struct dir_leaf *) datablock + 1);
+	}
+	*len = BLOCK_SIZE;
+	return (char *) datablock;
+}
+
+// Make the len bytes of records one free record
+static void dir_recs_init(char *recs, size_t len) {
+	struct dir_rec * r = (struct dir_rec *) recs;
+	memset(r, 0, sizeof(struct dir_rec));
+	r->rec_len = len;
+}
+
+// The record after r, or NULL once the records run out
+static struct dir_rec *dir_rec_next(char *recs, size_t len, struct dir_rec *r) {
+	size_t next = (char *) r - recs + r->rec_len;
+	if(r->rec_len < sizeof(struct dir_rec) || next + sizeof(struct dir_rec) > len) {
+		return NULL;
+	}
+	return (struct dir_rec *) (recs + next);
+}
+
+// Find name among the records; *prev is set to the record before it, NULL for the first
+static struct dir_rec *dir_rec_find(char *recs, size_t len, const char *name, size_t name_len, uint32_t hash, struct dir_rec **prev) {
+	struct dir_rec * r, * p = NULL;
+	for(r = (struct dir_rec *) recs; r; p = r, r = dir_rec_next(recs, len, r)) {
+		if(r->hash == hash && r->name_len == name_len && !memcmp(r->name, name, name_len)) {
+			*prev = p;
+			return r;
+		}
+	}
+	return NULL;
+}
+
+// Store an entry in the first record with room for it past its own name. Returns -1 if there is none.
+static int dir_rec_insert(char *recs, size_t len, uint16_t ino, const char *name, size_t name_len, uint32_t hash) {
+
+	size_t need = DIR_REC_LEN(name_len);
+	struct dir_rec * r;
+	for(r = (struct dir_rec *) recs; r; r = dir_rec_next(recs, len, r)) {
+		size_t used = r->name_len ? DIR_REC_LEN(r->name_len) : 0;
+		if(r->rec_len < used + need) {
+			continue;
+		}
+		if(used) {
+			struct dir_rec * n = (struct dir_rec *) ((char *) r + used);
+			n->rec_len = r->rec_len - used;
+			r->rec_len = used;
+			r = n;
+		}
+		r->hash = hash;
+		r->ino = ino;
+		r->name_len = name_len;
+		memcpy(r->name, name, name_len);
+		return 0;
+	}
+	return -1;
+}
+
+// Free a record by merging it into the one before it, or marking it free if it is the first
+static void dir_rec_remove(struct dir_rec *r, struct dir_rec *prev) {
+	if(prev) {
+		prev->rec_len += r->rec_len;
+	} else {
+		r->name_len = 0;
+	}
+}
+
+// Number of blocks holding directory entries
+static uint32_t dir_entry_blocks(struct inode *dir_inode) {
+	if(dir_inode->flags & TFS_INDEX_FL) {
+		return dir_inode->link - DIR_INDEX_BLOCKS;
+	}
+	return dir_inode->link;
+}
+
+// Disk block of the i-th block of directory entries
+static blk_t dir_entry_blkno(struct inode *dir_inode, uint32_t i) {
+	if(dir_inode->flags & TFS_INDEX_FL) {
+		i += DIR_INDEX_BLOCKS;
+	}
+	return bmap(dir_inode, i, 0);
+}
+
+static inline uint32_t dir_slot(uint32_t hash, uint32_t depth) {
+	return depth ? hash >> (32 - depth) : 0;
+}
+
+// Logical block of the leaf an index slot points at
+static int dir_slot_get(struct inode *dir_inode, uint32_t slot, uint32_t *lblk) {
+
+	blk_t blockno = bmap(dir_inode, slot / DIR_SLOTS_PER_BLOCK, 0);
+	if(blockno <= 0) {
+		return -1;
+	}
+
+	uint32_t * slots = (uint32_t *) malloc(BLOCK_SIZE);
+	if(!slots || bio_read(blockno, slots) < 0) {
+		free(slots);
+		return -1;
+	}
+	*lblk = slots[slot % DIR_SLOTS_PER_BLOCK];
+	free(slots);
+	return 0;
+}
+
+// Point count slots starting at first to the leaf at logical block lblk
+static int dir_slot_set(struct inode *dir_inode, uint32_t first, uint32_t count, uint32_t lblk) {
+
+	uint32_t * slots = (uint32_t *) malloc(BLOCK_SIZE);
+	uint32_t slot = first, end = first + count;
+
+	if(!slots) {
+		return -1;
+	}
+	while(slot < end) {
+		blk_t blockno = bmap(dir_inode, slot / DIR_SLOTS_PER_BLOCK, 1);
+		if(blockno < 0 || bio_read(blockno, slots) < 0) {
+			free(slots);
+			return -1;
+		}
+
+		do {
+			slots[slot % DIR_SLOTS_PER_BLOCK] = lblk;
+			slot++;
+		} while(slot < end && slot % DIR_SLOTS_PER_BLOCK);
+		if(bio_write_meta(blockno, slots) < 0) {
+			free(slots);
+			return -1;
+		}
+	}
+
+	free(slots);
+	return 0;
+}
+
+/*
+ * Double the slot table of an indexed directory: with one more hash bit,
+ * old slot i becomes slots 2i and 2i + 1. Every table block is mapped
+ * before any is rewritten, so running out of space leaves the table as
+ * it was.
+ */
+static int dir_grow_index(struct inode *dir_inode) {
+
+	uint32_t nslots = 1U << dir_inode->dir_depth;
+	uint32_t i, nblocks = (nslots * 2 + DIR_SLOTS_PER_BLOCK - 1) / DIR_SLOTS_PER_BLOCK;
+
+	if((nslots * 2) > DIR_INDEX_BLOCKS * DIR_SLOTS_PER_BLOCK) {
+		return -1;
+	}
+
+	uint32_t * table = (uint32_t *) malloc(nslots * 2 * sizeof(uint32_t));
+	uint32_t * slots = (uint32_t *) malloc(BLOCK_SIZE);
+	blk_t blocknos[DIR_INDEX_BLOCKS];
+	int ret = -1;
+
+	if(!table || !slots) {
+		goto out;
+	}
+	for(i = 0; i < nblocks; i++) {
+		if((blocknos[i] = bmap(dir_inode, i, 1)) < 0) {
+			goto out;
+		}
+	}
+
+	// Read the current table a block at a time, then spread it out in place
+	for(i = 0; i < nslots; i++) {
+		if(i % DIR_SLOTS_PER_BLOCK == 0 && bio_read(blocknos[i / DIR_SLOTS_PER_BLOCK], slots) < 0) {
+			goto out;
+		}
+		table[i] = slots[i % DIR_SLOTS_PER_BLOCK];
+	}
+	for(i = nslots; i-- > 0; ) {
+		table[2 * i + 1] = table[i];
+		table[2 * i] = table[i];
+	}
+
+	for(i = 0; i < nblocks; i++) {
+		uint32_t first = i * DIR_SLOTS_PER_BLOCK;
+		uint32_t n = nslots * 2 - first < DIR_SLOTS_PER_BLOCK ? nslots * 2 - first : DIR_SLOTS_PER_BLOCK;
+		if(bio_read(blocknos[i], slots) < 0) {
+			goto out;
+		}
+		memcpy(slots, table + first, n * sizeof(uint32_t));
+		if(bio_write_meta(blocknos[i], slots) < 0) {
+			goto out;
+		}
+	}
+
+	dir_inode->dir_depth++;
+	ret = 0;
+out:
+	free(slots);
+	free(table);
+	return ret;
+}
+
+/*
+ * Split a full leaf on its next hash bit, moving the entries that have it
+ * set into a new leaf and repointing the upper half of the leaf's slots.
+ * The new leaf is written first and the slots repointed before the old
+ * leaf drops what moved, so every entry stays reachable; if a step fails
+ * the ones before it are undone. The new leaf's block stays mapped past
+ * the end of the directory, where the next split picks it up again.
+ */
+static int dir_split_leaf(struct inode *dir_inode, uint32_t hash, void *leafblock, blk_t leafblkno, uint32_t leaflblk) {
+
+	struct dir_leaf * leaf = (struct dir_leaf *) leafblock;
+	uint32_t depth = leaf->depth;
+	uint32_t newlblk = dir_inode->link;
+	int ret = -1;
+
+	if(depth == dir_inode->dir_depth && dir_grow_index(dir_inode) < 0) {
+		return -1;
+	}
+
+	// Entries are repacked into both leaves, which also squeezes out the free space between them
+	void * newblock = calloc(1, BLOCK_SIZE);
+	char * kept = (char *) malloc(BLOCK_SIZE);
+	if(!newblock || !kept) {
+		goto out;
+	}
+	struct dir_leaf * newleaf = (struct dir_leaf *) newblock;
+	uint32_t nkept = 0;
+	newleaf->depth = depth + 1;
+
+	size_t len;
+	char * oldrecs = dir_block_records(dir_inode, leafblock, &len);
+	char * newrecs = dir_block_records(dir_inode, newblock, &len);
+	dir_recs_init(newrecs, len);
+	dir_recs_init(kept, len);
+	for(struct dir_rec * r = (struct dir_rec *) oldrecs; r; r = dir_rec_next(oldrecs, len, r)) {
+		if(r->name_len == 0) {
+			continue;
+		}
+		if((r->hash >> (31 - depth)) & 1) {
+			if(dir_rec_insert(newrecs, len, r->ino, r->name, r->name_len, r->hash) < 0) {
+				goto out;
+			}
+			newleaf->count++;
+		} else {
+			if(dir_rec_insert(kept, len, r->ino, r->name, r->name_len, r->hash) < 0) {
+				goto out;
+			}
+			nkept++;
+		}
+	}
+
+	blk_t newblkno = bmap(dir_inode, newlblk, 1);
+	if(newblkno < 0 || bio_write_meta(newblkno, newblock) < 0) {
+		goto out;
+	}
+
+	uint32_t span = 1U << (dir_inode->dir_depth - depth);
+	uint32_t first = dir_slot(hash, depth) * span;
+	if(dir_slot_set(dir_inode, first + span / 2, span / 2, newlblk) < 0) {
+		dir_slot_set(dir_inode, first + span / 2, span / 2, leaflblk);
+		goto out;
+	}
+
+	leaf->depth = depth + 1;
+	leaf->count = nkept;
+	memcpy(oldrecs, kept, len);
+	if(bio_write_meta(leafblkno, leafblock) < 0) {
+		dir_slot_set(dir_inode, first + span / 2, span / 2, leaflblk);
+		goto out;
+	}
+	dir_inode->link++;
+	ret = 0;
+
+out:
+	free(newblock);
+	free(kept);
+	// The table may have grown even if the split did not happen
+	if(writei(dir_inode->ino, dir_inode) < 0) {
+		ret = -1;
+	}
+	return ret;
+}
+
+// Add an entry to an indexed directory, splitting leaves until it fits
+static int dir_index_add(struct inode *dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+
+	uint32_t hash = name_hash(fname, name_len);
+	void * datablock = malloc(BLOCK_SIZE);
+	uint32_t lblk;
+	size_t len;
+	blk_t blockno;
+
+	while(datablock) {
+		if(dir_slot_get(dir_inode, dir_slot(hash, dir_inode->dir_depth), &lblk) < 0 ||
+		   (blockno = bmap(dir_inode, lblk, 0)) <= 0 || bio_read(blockno, datablock) < 0) {
+			break;
+		}
+
+		char * recs = dir_block_records(dir_inode, datablock, &len);
+		if(dir_rec_insert(recs, len, f_ino, fname, name_len, hash) == 0) {
+			((struct dir_leaf *) datablock)->count++;
+			int ret = bio_write_meta(blockno, datablock) < 0 ? -1 : 0;
+			free(datablock);
+			return ret;
+		}
+
+		if(dir_split_leaf(dir_inode, hash, datablock, blockno, lblk) < 0) {
+			break;
+		}
+	}
+
+	free(datablock);
+	return -1;
+}
+
+/*
+ * Convert a full linear directory to the indexed form: rebuild it as a
+ * single leaf at depth 0 and reinsert every entry. The index is built in
+ * new blocks with the old extent map set aside, and the linear blocks are
+ * only freed once every entry is in it; on failure the directory is left
+ * as it was.
+ */
+static int dir_make_indexed(struct inode *dir_inode) {
+
+	uint32_t i, nblocks = dir_inode->link;
+	struct icache_entry * e = icache_get(dir_inode->ino);
+	char * blocks = (char *) malloc((size_t) nblocks * BLOCK_SIZE);
+	void * datablock = malloc(BLOCK_SIZE);
+	struct extent * ext = (struct extent *) malloc(INODE_EXTENTS * sizeof(struct extent));
+	int ret = -1;
+
+	if(!e || !blocks || !datablock || !ext || emap_load(e) < 0) {
+		goto out;
+	}
+	for(i = 0; i < nblocks; i++) {
+		blk_t blockno = dir_entry_blkno(dir_inode, i);
+		if(blockno <= 0 || bio_read(blockno, blocks + (size_t) i * BLOCK_SIZE) < 0) {
+			goto out;
+		}
+	}
+
+	// Set the linear blocks aside; the entry is pinned, so they stay with it
+	struct inode old = *dir_inode;
+	struct extent_map oldmap = e->emap;
+	struct extent oldroot[INODE_EXTENTS];
+	uint16_t oldnroot = e->nroot, olddepth = e->ext_depth;
+	memcpy(oldroot, e->root, sizeof(oldroot));
+
+	e->emap.ext = ext;
+	e->emap.cap = INODE_EXTENTS;
+	e->emap.count = 0;
+	e->emap.dirty = 1;
+	e->nroot = 0;
+	e->ext_depth = 0;
+	ext = NULL;
+	dir_inode->link = 0;
+	dir_inode->flags |= TFS_INDEX_FL;
+	dir_inode->dir_depth = 0;
+
+	blk_t blockno = bmap(dir_inode, DIR_INDEX_BLOCKS, 1);
+	if(blockno > 0 && dir_slot_set(dir_inode, 0, 1, DIR_INDEX_BLOCKS) == 0) {
+		dir_inode->link = DIR_INDEX_BLOCKS + 1;
+		size_t len;
+		memset(datablock, 0, BLOCK_SIZE);
+		char * recs = dir_block_records(dir_inode, datablock, &len);
+		dir_recs_init(recs, len);
+		if(bio_write_meta(blockno, datablock) >= 0 && writei(dir_inode->ino, dir_inode) == 0) {
+			ret = 0;
+		}
+
+		for(i = 0; i < nblocks && ret == 0; i++) {
+			recs = blocks + (size_t) i * BLOCK_SIZE;
+			for(struct dir_rec * r = (struct dir_rec *) recs; r && ret == 0; r = dir_rec_next(recs, BLOCK_SIZE, r)) {
+				if(r->name_len) {
+					ret = dir_index_add(dir_inode, r->ino, r->name, r->name_len);
+				}
+			}
+		}
+	}
+
+	if(ret == 0) {
+		for(i = 0; i < oldmap.count; i++) {
+			for(uint32_t j = 0; j < oldmap.ext[i].len; j++) {
+				put_blkno(oldmap.ext[i].pblk + j);
+			}
+		}
+		for(i = 0; olddepth && i < oldnroot; i++) {
+			put_blkno(oldroot[i].pblk);
+		}
+		free(oldmap.ext);
+	} else {
+		// Give up what the index took and put the linear directory back
+		ent_free_blocks(e);
+		free(e->emap.ext);
+		e->emap = oldmap;
+		memcpy(e->root, oldroot, sizeof(oldroot));
+		e->nroot = oldnroot;
+		e->ext_depth = olddepth;
+		*dir_inode = old;
+		writei(dir_inode->ino, dir_inode);
+	}
+
+out:
+	if(e) {
+		icache_put(e);
+	}
+	free(ext);
+	free(datablock);
+	free(blocks);
+	return ret;
+}
+
+/*
+ * Look fname up in a directory. On success the block holding the entry is
+ * left in datablock, its block number in *blockno, the entry's record in
+ * *found and the record before it in *prev.
+ */
+static int dir_scan(struct inode *dir_inode, const char *fname, size_t name_len, void *datablock, blk_t *blockno, struct dir_rec **found, struct dir_rec **prev) {
+
+	uint32_t i, first = 0, last = dir_entry_blocks(dir_inode);
+	uint32_t hash = name_hash(fname, name_len);
+	size_t len;
+
+	// An indexed directory only needs to look in the leaf the hash selects
+	if(dir_inode->flags & TFS_INDEX_FL) {
+		uint32_t lblk;
+		if(dir_slot_get(dir_inode, dir_slot(hash, dir_inode->dir_depth), &lblk) < 0) {
+			return -1;
+		}
+		first = lblk - DIR_INDEX_BLOCKS;
+		last = first + 1;
+	}
+
+	for(i = first; i < last; i++) {
+		*blockno = dir_entry_blkno(dir_inode, i);
+		if(*blockno <= 0) {
+			continue;
+		}
+	 	bio_read(*blockno, datablock);
+
+		char * recs = dir_block_records(dir_inode, datablock, &len);
+		if((*found = dir_rec_find(recs, len, fname, name_len, hash, prev))) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+void printDirectoryContents(struct inode * dirinode) {
+	tfs_log(TFS_LOG_DEBUG, "\n-------------DIRECTORY CONTENTS--------------\n");
+	uint32_t i;
+	size_t len;
+	void * datablock = malloc(BLOCK_SIZE);
+	for(i = 0; i < dir_entry_blocks(dirinode); i++) {
+		bio_read(dir_entry_blkno(dirinode, i), datablock);
+		
+		char * recs = dir_block_records(dirinode, datablock, &len);
+		for(struct dir_rec * r = (struct dir_rec *) recs; r; r = dir_rec_next(recs, len, r)) {
+			if(r->name_len) {
+				tfs_log(TFS_LOG_DEBUG, "Filename: %.*s ", r->name_len, r->name);
+				tfs_log(TFS_LOG_DEBUG, "Inode: %d\n", r->ino);			
+			}
+		} 
+
+	}
+	free(datablock);
+	tfs_log(TFS_LOG_DEBUG, "\n");
+
+}
+
+
+// Whether a directory has no entries left, so it may be removed
+static int dir_is_empty(struct inode *dir_inode) {
+
+	void * datablock = malloc(BLOCK_SIZE);
+	uint32_t i;
+	size_t len;
+	int empty = 1;
+
+	for(i = 0; empty && i < dir_entry_blocks(dir_inode); i++) {
+		blk_t blockno = dir_entry_blkno(dir_inode, i);
+		if(blockno <= 0) {
+			continue;
+		}
+		bio_read(blockno, datablock);
+
+		char * recs = dir_block_records(dir_inode, datablock, &len);
+		for(struct dir_rec * r = (struct dir_rec *) recs; r; r = dir_rec_next(recs, len, r)) {
+			if(r->name_len) {
+				empty = 0;
+				break;
+			}
+		}
+	}
+	free(datablock);
+	return empty;
+}
+
+/*
+ * readdir offsets are cookies that keep their place while the directory
+ * changes, so a listing can resume where the last reply stopped. Records
+ * never move in a linear directory, so there an entry's cookie is the
+ * byte position of its record. Leaf splits move records about in an
+ * indexed directory, so it is listed leaf by leaf in hash order, and an
+ * entry's cookie is its name hash above its rank among equal hashes in
+ * the leaf. Each entry is passed on with its cookie + 1, the offset the
+ * next call starts from; 0 lists from the start. A listing that is under
+ * way when its directory is converted to the indexed form starts over.
+ */
+typedef int (*dir_emit_t)(void *arg, uint16_t ino, const char *name, size_t name_len, off_t next);
+
+#define DIR_COOKIE_RANK_BITS 16
+
+// Order records by hash, and names of equal hash by name, so ranks do not depend on where records sit
+static int dir_rec_cmp(const void *a, const void *b) {
+	const struct dir_rec * x = *(struct dir_rec * const *) a;
+	const struct dir_rec * y = *(struct dir_rec * const *) b;
+	if(x->hash != y->hash) {
+		return x->hash < y->hash ? -1 : 1;
+	}
+	int c = memcmp(x->name, y->name, x->name_len < y->name_len ? x->name_len : y->name_len);
+	return c ? c : (int) x->name_len - (int) y->name_len;
+}
+
+// Hand the entries of a directory from offset on to emit until it returns nonzero. The caller holds the directory's lock.
+static int dir_list(struct inode *dir_inode, off_t offset, dir_emit_t emit, void *arg) {
+
+	void * datablock = malloc(BLOCK_SIZE);
+	size_t len;
+	int stop = 0;
+
+	if(!datablock) {
+		return -1;
+	}
+
+	if(!(dir_inode->flags & TFS_INDEX_FL)) {
+		for(uint32_t i = offset / BLOCK_SIZE; !stop && i < dir_entry_blocks(dir_inode); i++) {
+			blk_t blockno = dir_entry_blkno(dir_inode, i);
+			if(blockno <= 0) {
+				continue;
+			}
+			bio_read(blockno, datablock);
+
+			char * recs = dir_block_records(dir_inode, datablock, &len);
+			for(struct dir_rec * r = (struct dir_rec *) recs; r && !stop; r = dir_rec_next(recs, len, r)) {
+				off_t cookie = (off_t) i * BLOCK_SIZE + ((char *) r - recs);
+				if(r->name_len && cookie >= offset) {
+					stop = emit(arg, r->ino, r->name, r->name_len, cookie + 1);
+				}
+			}
+		}
+		free(datablock);
+		return 0;
+	}
+
+	// Start in the leaf holding the hash the offset names; past the last possible cookie there is nothing left
+	if((uint64_t) offset >> (32 + DIR_COOKIE_RANK_BITS)) {
+		free(datablock);
+		return 0;
+	}
+	struct dir_rec ** sorted = (struct dir_rec **) malloc(BLOCK_SIZE / DIR_REC_LEN(1) * sizeof(struct dir_rec *));
+	uint32_t nslots = 1U << dir_inode->dir_depth;
+	uint32_t slot = dir_slot((uint32_t) (offset >> DIR_COOKIE_RANK_BITS), dir_inode->dir_depth);
+	int ret = 0;
+
+	while(sorted && !stop && slot < nslots) {
+		uint32_t lblk;
+		blk_t blockno;
+		if(dir_slot_get(dir_inode, slot, &lblk) < 0 || (blockno = bmap(dir_inode, lblk, 0)) <= 0) {
+			ret = -1;
+			break;
+		}
+		bio_read(blockno, datablock);
+
+		// The leaf covers every slot that shares its top depth bits
+		uint32_t span = 1U << (dir_inode->dir_depth - ((struct dir_leaf *) datablock)->depth);
+		slot &= ~(span - 1);
+
+		int n = 0;
+		char * recs = dir_block_records(dir_inode, datablock, &len);
+		for(struct dir_rec * r = (struct dir_rec *) recs; r; r = dir_rec_next(recs, len, r)) {
+			if(r->name_len) {
+				sorted[n++] = r;
+			}
+		}
+		qsort(sorted, n, sizeof(struct dir_rec *), dir_rec_cmp);
+
+		uint32_t rank = 0;
+		for(int k = 0; k < n && !stop; k++) {
+			rank = k > 0 && sorted[k - 1]->hash == sorted[k]->hash ? rank + 1 : 0;
+			off_t cookie = (off_t) sorted[k]->hash << DIR_COOKIE_RANK_BITS | rank;
+			if(cookie >= offset) {
+				stop = emit(arg, sorted[k]->ino, sorted[k]->name, sorted[k]->name_len, cookie + 1);
+			}
+		}
+		slot += span;
+	}
+
+	free(sorted);
+	free(datablock);
+	return sorted ? ret : -1;
+}
+
+int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+	//printf("\n-------------- CALLING DIR FIND ON FILE %s FROM INODE %d----------------\n", fname, ino);	
+
+	// Step 0: Answer from the dentry cache if it has seen this name before
+	uint16_t f_ino;
+	int cached = dcache_lookup(ino, fname, name_len, &f_ino);
+	if(cached == 0) {
+		return -1;
+	} else if(cached > 0) {
+		dirent->ino = f_ino;
+		dirent->valid = 1;
+		memcpy(dirent->name, fname, name_len);
+		dirent->name[name_len] = '\0';
+		return 0;
+	}
+
+	// Step 1: Call readi() to get the inode using ino (inode number of current directory)
+	struct inode dirinode;
+	readi(ino, &dirinode);
+	if(!dirinode.valid || !S_ISDIR(dirinode.vstat.st_mode)) {
+		return -1;
+	}
+
+	// Step 2: Get data block of current directory from inode
+	// Step 3: Read directory's data block and check each directory entry.
+	void * datablock = malloc(BLOCK_SIZE);
+	struct dir_rec * rec, * prev;
+	blk_t blockno;
+	int ret = dir_scan(&dirinode, fname, name_len, datablock, &blockno, &rec, &prev);
+
+	if(ret < 0) {
+		dcache_insert(ino, fname, name_len, 0, 1);
+	} else {
+		//If the name matches, then copy directory entry to dirent structure
+		dirent->ino = rec->ino;
+		dirent->valid = 1;
+		memcpy(dirent->name, fname, name_len);	
+		dirent->name[name_len] = '\0';
+		dcache_insert(ino, fname, name_len, dirent->ino, 0);
+	}
+
+	free(datablock);
+	return ret;
+}
+
+int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+
+	//printf("\n------- CALLING DIR ADD ON FILE %s, INODE %d --------\n", fname, f_ino);
+
+	if(name_len == 0 || name_len > DIR_NAME_MAX) {
+		return -1;
+	}
+
+	//Fails if the name is already present
+	void *datablock = malloc(BLOCK_SIZE);
+	struct dir_rec * rec, * prev;
+	blk_t blockno;
+	if(dir_scan(&dir_inode, fname, name_len, datablock, &blockno, &rec, &prev) == 0) {
+		//printf("File already present in dir\n");
+		free(datablock);
+		return -1;	
+	}
+
+	int ret = -1;
+	if(dir_inode.flags & TFS_INDEX_FL) {
+		ret = dir_index_add(&dir_inode, f_ino, fname, name_len);
+		goto out;
+	}
+
+	//For each data block in the dir_inode, look for a record with room to spare
+	uint32_t i;
+	uint32_t hash = name_hash(fname, name_len);
+	size_t len;
+	for(i = 0; i < dir_inode.link; i++){
+
+		blockno = dir_entry_blkno(&dir_inode, i);
+		if(blockno <= 0 || bio_read(blockno, datablock) < 0) {
+			goto out;
+		}
+		
+		char * recs = dir_block_records(&dir_inode, datablock, &len);
+		if(dir_rec_insert(recs, len, f_ino, fname, name_len, hash) == 0) {
+
+			//Write datablock back to diskfile
+			ret = bio_write_meta(blockno, datablock) < 0 ? -1 : 0;
+			goto out;
+		}
+	}
+
+	//No free dirents in existing datablocks!!
+	if(dir_inode.link < DIR_LINEAR_BLOCKS) {
+
+		// Allocate a new data block for this directory and update the directory inode
+		blockno = bmap(&dir_inode, dir_inode.link, 1);
+		if(blockno < 0) {
+			goto out;
+		}
+
+		//add data block with new dirent; only then does the directory grow to cover it
+		memset(datablock, 0, BLOCK_SIZE);
+		dir_recs_init((char *) datablock, BLOCK_SIZE);
+		dir_rec_insert((char *) datablock, BLOCK_SIZE, f_ino, fname, name_len, hash);
+		if(bio_write_meta(blockno, datablock) < 0) {
+			goto out;
+		}
+		dir_inode.link++;
+		ret = writei(dir_inode.ino, &dir_inode);
+
+	//Linear directory full, switch to the hashed form
+	} else if(dir_make_indexed(&dir_inode) == 0) {
+		ret = dir_index_add(&dir_inode, f_ino, fname, name_len);
+	}
+
+out:
+	free(datablock);
+	if(ret == 0) {
+		dcache_insert(dir_inode.ino, fname, name_len, f_ino, 0);
+	}
+	return ret;
+}
+
+
+int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
+
+	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
+	// Step 2: Check if fname exist
+	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
+	
+	void * datablock = malloc(BLOCK_SIZE);
+	struct dir_rec * rec, * prev;
+	blk_t blockno;
+	int ret = dir_scan(&dir_inode, fname, name_len, datablock, &blockno, &rec, &prev);
+
+	if(ret == 0) {
+		dir_rec_remove(rec, prev);
+		if(dir_inode.flags & TFS_INDEX_FL) {
+			((struct dir_leaf *) datablock)->count--;
+		}
+		bio_write_meta(blockno, datablock);
+		dcache_insert(dir_inode.ino, fname, name_len, 0, 1);
+	}
+
+	free(datablock);
+	return ret;	
+}
+
+
+/* 
+ * namei operation
+ */
+int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {	
+	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
+	// Each component is looked up in place, so no intermediate strings are allocated
+	struct dirent dirent;
+	char name[sizeof(dirent.name)];
+	const char *end;
+	size_t len;
+
+	while(*path == '/') {
+		path++;
+	}
+
+	while(*path != '\0') {
+		end = strchr(path, '/');
+		len = end ? (size_t) (end - path) : strlen(path);
+		if(len >= sizeof(name)) {
+			return -1;
+		}
+
+		memcpy(name, path, len);
+		name[len] = '\0';
+		if(dir_find(ino, name, len, &dirent) < 0) {
+			return -1;
+		}
+		ino = dirent.ino;
+
+		path += len;
+		while(*path == '/') {
+			path++;
+		}
+	}
+
+	return readi(ino, inode);
+}
+
+
+void testGetNodeByPath() {
+
+	//Read current rootinode
+	struct inode * rootinode = (struct inode *) malloc(sizeof(struct inode));
+	readi(0, rootinode);
 
 
 	int nDirectoriesToNest = 7;
@@ -458,745 +3129,2545 @@ void testGetNodeByPath() {
 	struct inode * finode;
 	
 
-	
-	int i;
-	for(i = 0; i < nDirectoriesToNest; i++){
+	
+	int i;
+	for(i = 0; i < nDirectoriesToNest; i++){
+
+		//initialize papadir inode
+		f_ino = get_avail_ino();
+		sprintf(fname+3, "%d", i);
+		fname[5] = '\0';
+		tfs_log(TFS_LOG_DEBUG, "Adding direntry: %s", fname);
+		finode = (struct inode *) malloc(sizeof(struct inode));
+		finode->ino = f_ino;
+		finode->valid = 1;
+		finode->link = 0;
+	
+
+		//Write papadir inode to block
+		writei(f_ino, finode);
+	 
+
+		//Add Papadirino to directory jawn
+		dir_add(*rootinode, f_ino, fname, strlen(fname));
+
+	
+		//Read papadir as rootinode
+		readi(f_ino, rootinode);
+
+	}
+
+	//Get node by path specified
+	rootinode = (struct inode *) malloc(sizeof(struct inode));
+	char * pathName = "/dir0/dir1/dir2/dir3";
+	get_node_by_path(pathName, 0, rootinode);
+
+	//Initialize new inode
+	f_ino = get_avail_ino();
+	strcpy(fname, "yousonice");
+	finode = (struct inode *) malloc(sizeof(struct inode));
+	finode->ino = f_ino;
+	finode->valid = 1;
+	finode->link = 0;
+	
+
+	//Write yousonice inode to block
+	writei(f_ino, finode);
+
+	//Add yousonice to directory dir3
+	dir_add(*rootinode, f_ino, fname, strlen(fname));
+
+	pathName = "/dir0/dir1/dir2/dir3/yousonice";
+	get_node_by_path(pathName, 0, rootinode);
+	
+	if(rootinode->valid) {
+		//printf("Storage inode number: %d\n", rootinode->ino);
+	} else {
+		//printf("Back to the debugging grind son\n");
+	}
+	
+}
+
+
+
+void testAddMethod() {
+	//Initialize before add inode
+	struct inode * rootinode = (struct inode *) malloc(sizeof(struct inode));	
+	readi(0, rootinode);
+	printinode(rootinode);
+
+	//ADDING FILES
+	int nfilestoadd = 100;
+	char fname[256];
+	uint16_t f_ino;
+
+	strcpy(fname, "myfile");
+
+	int i;
+	for(i = 0; i < nfilestoadd; i++) {
+		sprintf(fname + 6, "%d", i);
+		fname[10] = '\0';
+		f_ino = get_avail_ino();
+		dir_add(*rootinode, f_ino, fname, strlen(fname));	
+		readi(0, rootinode);
+		//printinode(rootinode);
+	}
+
+	printDirectoryContents(rootinode);	
+
+
+	//DELETING FILES
+	int nfilestodelete = 47;
+	char dfname[256];
+	
+	strcpy(dfname, "myfile");
+
+	for(i = 0; i < nfilestodelete; i++) {
+		sprintf(dfname + 6, "%d", i);
+		dfname[10] = '\0';
+		dir_remove(*rootinode, dfname, strlen(dfname));	
+		readi(0, rootinode);
+		//printinode(rootinode);
+	}
+
+
+	printDirectoryContents(rootinode);
+	
+
+	//ADDING DIFFERENT FILES
+	int nfilestoreadd = 209;
+	char rfname[256];	
+	strcpy(rfname, "newguy");
+	for(i = 0; i < nfilestoreadd; i++) {
+		sprintf(rfname + 6, "%d", i);
+		rfname[10] = '\0';
+		f_ino = get_avail_ino();
+		dir_add(*rootinode, f_ino, rfname, strlen(rfname));	
+		readi(0, rootinode);
+		//printinode(rootinode);
+	}
+
+	printDirectoryContents(rootinode);
+
+	
+	//FINDING FILE
+	char * finddir = "newguy202";
+	struct dirent * storage = (struct dirent *) malloc(sizeof(struct dirent));
+	dir_find(0, finddir,strlen(finddir), storage);
+	tfs_log(TFS_LOG_DEBUG, "Resulting dirent block: %s, %d\n", storage->name, storage->ino);
+		
+
+}
+
+
+
+/*
+ * Lay out an image of the geometry in mkfs_opts: the superblock, the inode
+ * bitmap, the data bitmap, the inode table, the journal, then data blocks
+ * to the end. The data bitmap is sized for the largest the image may grow
+ * to; the part of it past the current data region stays a hole in the
+ * image until the region grows into it. Returns -1 if the geometry is
+ * unusable.
+ */
+static int mkfs_layout(struct superblock *s, const struct mkfs_options *o) {
+
+	uint32_t bsize = o->block_size;
+	if(bsize < BLOCK_SIZE_MIN || bsize > BLOCK_SIZE_MAX || (bsize & (bsize - 1)) ||
+	   o->inodes == 0 || o->inodes > MAX_INUM) {
+		return -1;
+	}
+	uint64_t total = o->size / bsize;
+	uint64_t ibm_blocks = (o->inodes + (uint64_t) bsize * 8 - 1) / ((uint64_t) bsize * 8);
+	uint64_t itable = (o->inodes + bsize / INODE_SIZE - 1) / (bsize / INODE_SIZE);
+
+	uint64_t jblocks = o->journal_blocks;
+	if(jblocks == 0) {
+		jblocks = total / 8 < JOURNAL_BLOCKS ? total / 8 : JOURNAL_BLOCKS;
+		jblocks = jblocks < JOURNAL_MIN_BLOCKS ? JOURNAL_MIN_BLOCKS : jblocks;
+	}
+	uint64_t fixed = 1 + ibm_blocks + itable + jblocks;
+	if(jblocks < JOURNAL_MIN_BLOCKS || jblocks > UINT32_MAX || total < fixed + 2) {
+		return -1;
+	}
+
+	// Every bitmap block covers bits data blocks after it
+	uint64_t bits = (uint64_t) bsize * 8;
+	uint64_t max_size = o->max_size ? o->max_size : o->size * DEFAULT_GROW_FACTOR;
+	uint64_t max_total = max_size / bsize > total ? max_size / bsize : total;
+	uint64_t max_data = max_total - fixed - (max_total - fixed + bits) / (bits + 1);
+	if(max_data > MAX_DNUM) {
+		max_data = MAX_DNUM;
+	}
+	uint64_t dbm_blocks = (max_data + bits - 1) / bits;
+	if(total < fixed + dbm_blocks + MIN_DNUM) {
+		return -1;
+	}
+	uint64_t ndata = total - fixed - dbm_blocks;
+	if(ndata > max_data) {
+		ndata = max_data;
+	}
+
+	memset(s, 0, sizeof(struct superblock));
+	s->magic_num = MAGIC_NUM;
+	s->block_size = bsize;
+	s->max_inum = o->inodes;
+	s->max_dnum = ndata;
+	s->i_bitmap_blk = 1;
+	s->d_bitmap_blk = s->i_bitmap_blk + ibm_blocks;
+	s->i_start_blk = s->d_bitmap_blk + dbm_blocks;
+	s->j_start_blk = s->i_start_blk + itable;
+	s->j_nblocks = jblocks;
+	s->d_start_blk = s->j_start_blk + s->j_nblocks;
+	s->nblocks = s->d_start_blk + ndata;
+	s->grow_dnum = max_data;
+	return 0;
+}
+
+static void tfs_cache_init();
+
+/* 
+ * Make file system
+ */
+int tfs_mkfs() {
+
+	if(mkfs_layout(&sb, &mkfs_opts) < 0) {
+		tfs_log(TFS_LOG_ERROR, "Cannot make a %lu byte image with %u byte blocks and %u inodes\n",
+			(unsigned long) mkfs_opts.size, mkfs_opts.block_size, mkfs_opts.inodes);
+		return -1;
+	}
+
+	// Call dev_init() to initialize (Create) Diskfile
+
+	dev_init(diskfile_path, sb.nblocks * sb.block_size);
+	dev_set_block_size(sb.block_size);
+	dev_set_size_limit((sb.d_start_blk + data_limit()) * BLOCK_SIZE);
+	tfs_cache_init();
+
+	// write superblock information
+
+	void * sbblock = calloc(1, BLOCK_SIZE);
+	memcpy(sbblock, &sb, sizeof(struct superblock));
+	bio_write(0, sbblock);
+	free(sbblock);
+
+	// Everything from here on is metadata and goes through the journal
+	if(jnl_format(sb.j_start_blk, sb.j_nblocks) < 0 || jnl_open(sb.j_start_blk, sb.j_nblocks) < 0) {
+		return -1;
+	}
+	
+
+	// initialize inode bitmap	
+	// initialize data block bitmap
+	if(bitmap_load(&ibm, sb.i_bitmap_blk, sb.max_inum, 0) < 0 ||
+	   bitmap_load(&dbm, sb.d_bitmap_blk, sb.max_dnum, 0) < 0 ||
+	   fidx_build(&dfree, &dbm) < 0) {
+		return -1;
+	}
+	bitmap_alloc(&ibm);
+			
+	// update bitmap information for root directory			
+	struct inode * rootinode = (struct inode *) calloc(1, sizeof(struct inode));
+	rootinode->ino = 0;
+	rootinode->valid = 1;
+	rootinode->link = 0;
+	
+	rootinode->vstat.st_ino = 0;
+	rootinode->vstat.st_mode   = S_IFDIR | 0755;
+	rootinode->vstat.st_nlink = 2;
+	rootinode->vstat.st_blksize = BLOCK_SIZE;
+	rootinode->vstat.st_size = 0;
+	rootinode->vstat.st_blocks = 0;
+		
+	writei(rootinode->ino, rootinode);
+	free(rootinode);
+	
+	return tfs_writeback();
+}
+
+
+
+
+
+
+/*
+ * Open file table
+ *
+ * tfs_open() and tfs_create() park the opened inode in a struct tfs_file
+ * whose slot in the table is handed to FUSE as fi->fh. The file pins its
+ * inode cache entry, so read, write, flush and release work on the cached
+ * inode and extent map directly. The pin count doubles as the inode's open
+ * count: a file unlinked while open keeps its inode and blocks until the
+ * last file referring to it is released.
+ */
+struct tfs_file {
+	struct icache_entry	*ent;			/* pinned inode cache entry */
+	int					flags;			/* open(2) flags */
+	off_t				next_off;		/* offset just past the last read */
+	uint32_t			seq_reads;		/* reads in a row that continued the previous one */
+	uint32_t			ra_next;		/* first block not read ahead yet */
+	uint32_t			ra_size;		/* blocks in the last readahead window, 0 if none */
+	uint32_t			ra_mark;		/* reading this block starts the next window */
+};
+
+struct file_table {
+	struct tfs_file		**files;		/* indexed by fh, slot 0 is never handed out */
+	uint32_t			size;
+	uint32_t			nopen;
+	uint32_t			hint;			/* where to start looking for a free slot */
+};
+
+struct file_table oft;
+
+static pthread_mutex_t oft_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// Open inode ino and return its file handle, or 0 on failure
+static uint64_t file_open(uint16_t ino, int flags) {
+
+	uint32_t fh;
+
+	struct tfs_file * f = (struct tfs_file *) calloc(1, sizeof(struct tfs_file));
+	if(!f) {
+		return 0;
+	}
+	f->ent = icache_get(ino);
+	if(!f->ent) {
+		free(f);
+		return 0;
+	}
+	f->flags = flags;
+
+	pthread_mutex_lock(&oft_lock);
+	if(oft.nopen + 1 >= oft.size) {
+		uint32_t newsize = oft.size ? oft.size * 2 : 64;
+		struct tfs_file ** grown = (struct tfs_file **) realloc(oft.files, newsize * sizeof(struct tfs_file *));
+		if(!grown) {
+			pthread_mutex_unlock(&oft_lock);
+			icache_put(f->ent);
+			free(f);
+			return 0;
+		}
+		memset(grown + oft.size, 0, (newsize - oft.size) * sizeof(struct tfs_file *));
+		oft.files = grown;
+		oft.size = newsize;
+	}
+
+	for(fh = oft.hint; fh == 0 || oft.files[fh]; fh = (fh + 1) % oft.size)
+		;
+
+	oft.files[fh] = f;
+	oft.nopen++;
+	oft.hint = fh + 1 < oft.size ? fh + 1 : 1;
+	pthread_mutex_unlock(&oft_lock);
+
+	// Trade the reference for a pin, which lasts until file_close()
+	pthread_mutex_lock(&icache_lock);
+	f->ent->pincount++;
+	f->ent->refs--;
+	pthread_mutex_unlock(&icache_lock);
+	return fh;
+}
+
+/*
+ * Whether the kernel may keep the pages it cached of e's file when it is
+ * opened again. Every change to the file passes through this mount and so
+ * through those pages, which keep_cache relies on. auto_cache is the
+ * cautious choice, as in the FUSE library: the pages are kept only if the
+ * modification time and size are what they were at the last open.
+ */
+static int file_keep_cache(struct icache_entry *e) {
+
+	if(tfs_opts.keep_cache) {
+		return 1;
+	}
+	if(!tfs_opts.auto_cache) {
+		return 0;
+	}
+	pthread_rwlock_wrlock(&e->lock);
+	int keep = e->cache_seen && e->cache_mtime == e->inode.vstat.st_mtime &&
+		e->cache_size == e->inode.vstat.st_size;
+	e->cache_seen = 1;
+	e->cache_mtime = e->inode.vstat.st_mtime;
+	e->cache_size = e->inode.vstat.st_size;
+	pthread_rwlock_unlock(&e->lock);
+	return keep;
+}
+
+static struct tfs_file *file_get(struct fuse_file_info *fi) {
+
+	struct tfs_file *f = NULL;
+	if(!fi || fi->fh == 0) {
+		return NULL;
+	}
+	pthread_mutex_lock(&oft_lock);
+	if(fi->fh < oft.size) {
+		f = oft.files[fi->fh];
+	}
+	pthread_mutex_unlock(&oft_lock);
+	return f;
+}
+
+// Drop a file handle, deleting its inode if this was the last reference to an unlinked file
+static void file_close(uint64_t fh) {
+
+	pthread_mutex_lock(&oft_lock);
+	if(fh == 0 || fh >= oft.size || !oft.files[fh]) {
+		pthread_mutex_unlock(&oft_lock);
+		return;
+	}
+	struct tfs_file * f = oft.files[fh];
+	oft.files[fh] = NULL;
+	oft.nopen--;
+	pthread_mutex_unlock(&oft_lock);
+
+	// Hold a reference across the reap so the entry cannot be evicted under it
+	struct icache_entry *e = f->ent;
+	pthread_mutex_lock(&icache_lock);
+	e->pincount--;
+	e->refs++;
+	pthread_mutex_unlock(&icache_lock);
+	inode_reap(e);
+	icache_put(e);
+
+	free(f);
+}
+
+void file_table_destroy() {
+
+	uint32_t fh;
+	for(fh = 1; fh < oft.size; fh++) {
+		file_close(fh);
+	}
+	free(oft.files);
+	memset(&oft, 0, sizeof(struct file_table));
+}
+
+
+/*
+ * File data
+ */
+
+// Read from an inode through its cache entry; see tfs_read()
+static int file_read(struct icache_entry *e, char *buffer, size_t size, off_t offset) {
+
+	struct inode *inode = &e->inode;
+
+	// Never read past the end of the file
+	if(size == 0 || offset >= inode->vstat.st_size) {
+		return 0;
+	}
+	if(offset + size > inode->vstat.st_size) {
+		size = inode->vstat.st_size - offset;
+	}
+
+	// An inline file's data came in with its inode
+	if(inode->flags & TFS_INLINE_FL) {
+		memcpy(buffer, e->idata + offset, size);
+		return size;
+	}
+
+	// Blocks wholly inside the range are read straight into buffer, and all
+	// of them are handed to the block layer as one vector so every extent
+	// is in flight together; only the partial blocks at either end go
+	// through a bounce block
+	uint32_t lblk = offset / BLOCK_SIZE;
+	size_t blkoff = offset % BLOCK_SIZE;
+	size_t done = 0;
+	void * datablock = NULL;
+	struct bio_vec *vec = NULL;
+	int nvec = 0;
+
+	while(done < size) {
+		size_t n = BLOCK_SIZE - blkoff;
+		if(n > size - done) {
+			n = size - done;
+		}
+
+		uint32_t run;
+		blk_t blockno = ent_bmap(e, lblk, 0, &run);
+		if(blockno < 0) {
+			break;
+		} else if(n == BLOCK_SIZE) {
+			uint32_t nblk = (size - done) / BLOCK_SIZE;
+			if(nblk > run) {
+				nblk = run;
+			}
+			if(blockno == 0 && e->da.count == 0) {
+				memset(buffer + done, 0, (size_t) nblk * BLOCK_SIZE);
+			} else if(blockno == 0) {
+				for(uint32_t i = 0; i < nblk; i++) {
+					da_read(e, lblk + i, buffer + done + (size_t) i * BLOCK_SIZE, 0, BLOCK_SIZE);
+				}
+			} else {
+				if(!vec && !(vec = malloc((size - done) / BLOCK_SIZE * sizeof(struct bio_vec)))) {
+					break;
+				}
+				for(uint32_t i = 0; i < nblk; i++) {
+					vec[nvec].blkno = blockno + i;
+					vec[nvec].buf = buffer + done + (size_t) i * BLOCK_SIZE;
+					nvec++;
+				}
+			}
+			done += (size_t) nblk * BLOCK_SIZE;
+			lblk += nblk;
+			continue;
+		} else if(blockno == 0) {
+			da_read(e, lblk, buffer + done, blkoff, n);
+		} else {
+			if(!datablock && !(datablock = malloc(BLOCK_SIZE))) {
+				break;
+			}
+			if(bio_read(blockno, datablock) < 0) {
+				break;
+			}
+			memcpy(buffer + done, (char *) datablock + blkoff, n);
+		}
+
+		done += n;
+		blkoff = 0;
+		lblk++;
+	}
+	free(datablock);
+
+	if(nvec > 0 && bio_readv(vec, nvec) < 0) {
+		done = 0;
+	}
+	free(vec);
+
+	return done ? (int) done : -EIO;
+}
+
+/*
+ * Zero-copy counterpart of file_read(): rather than copying, describe the
+ * range as pieces FUSE can gather the reply from. With a mapped image the
+ * pieces point into the mapping; otherwise they are ranges of the image
+ * fd, which libfuse splices into /dev/fuse without the data ever passing
+ * through user space. Holes are served from a zero block, or from the
+ * parked data of blocks whose allocation is delayed. Returns NULL
+ * when the range is too fragmented for that to pay off, so the caller
+ * falls back to file_read(); the caller must keep e locked until the
+ * reply has been sent.
+ */
+static struct fuse_bufvec *file_read_buf(struct icache_entry *e, size_t size, off_t offset) {
+
+	static const char zeroblock[BLOCK_SIZE_MAX];
+	struct inode *inode = &e->inode;
+	int mapped = bio_map(0) != NULL;
+
+	if(offset >= inode->vstat.st_size) {
+		size = 0;
+	} else if(offset + size > inode->vstat.st_size) {
+		size = inode->vstat.st_size - offset;
+	}
+
+	// One piece per block at most; neighbours on disk are merged below
+	uint32_t lblk = offset / BLOCK_SIZE;
+	size_t blkoff = offset % BLOCK_SIZE;
+	size_t nblk = size ? (blkoff + size + BLOCK_SIZE - 1) / BLOCK_SIZE : 1;
+	struct fuse_bufvec *bv = malloc(sizeof(struct fuse_bufvec) + nblk * sizeof(struct fuse_buf));
+	if(!bv) {
+		return NULL;
+	}
+	*bv = FUSE_BUFVEC_INIT(0);
+	bv->count = 0;
+
+	// An inline file is a single piece, straight out of the inode
+	if(inode->flags & TFS_INLINE_FL) {
+		bv->buf[0].mem = e->idata + (size ? offset : 0);
+		bv->buf[0].size = size;
+		bv->count = 1;
+		return bv;
+	}
+
+	size_t done = 0;
+	int fd = -1, exp_start = 0, exp_end = 0;
+	while(done < size) {
+		size_t n = BLOCK_SIZE - blkoff;
+		if(n > size - done) {
+			n = size - done;
+		}
+
+		uint32_t run = 1;
+		blk_t blockno = ent_bmap(e, lblk, 0, &run);
+		if(blockno < 0) {
+			goto fallback;
+		}
+
+		struct fuse_bufvec one = FUSE_BUFVEC_INIT(n);
+		struct fuse_buf piece = one.buf[0];
+		struct fuse_buf *last = bv->count ? &bv->buf[bv->count - 1] : NULL;
+		if(blockno == 0) {
+			// A hole, or data still waiting for delayed allocation
+			char * data = da_lookup(e, lblk);
+			piece.mem = data ? data + blkoff : (char *) zeroblock;
+		} else if(mapped) {
+			if(!(piece.mem = bio_map(blockno))) {
+				goto fallback;
+			}
+			piece.mem = (char *) piece.mem + blkoff;
+			if(last && last->mem != zeroblock && (char *) last->mem + last->size == piece.mem) {
+				last->size += n;
+				goto next;
+			}
+		} else {
+			// Blocks still dirty in the buffer cache must reach the image
+			// first; do that for the rest of the extent in one go
+			if(blockno < exp_start || blockno >= exp_end) {
+				uint32_t nrun = (blkoff + size - done + BLOCK_SIZE - 1) / BLOCK_SIZE;
+				if(nrun > run) {
+					nrun = run;
+				}
+				if((fd = bio_export(blockno, nrun)) < 0) {
+					goto fallback;
+				}
+				exp_start = blockno;
+				exp_end = blockno + nrun;
+			}
+			piece.flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+			piece.fd = fd;
+			piece.pos = (off_t) blockno * BLOCK_SIZE + blkoff;
+			if(last && (last->flags & FUSE_BUF_IS_FD) && last->pos + (off_t) last->size == piece.pos) {
+				last->size += n;
+				goto next;
+			}
+			// Splicing pays for itself on long extents, not on many short ones
+			if(bv->count >= FILE_SPLICE_MAX_PIECES) {
+				goto fallback;
+			}
+		}
+		bv->buf[bv->count++] = piece;
+
+	next:
+		done += n;
+		blkoff = 0;
+		lblk++;
+	}
+	if(bv->count == 0) {
+		bv->count = 1;
+	}
+
+	return bv;
+
+fallback:
+	free(bv);
+	return NULL;
+}
+
+/*
+ * Map lblk for writing, allocating it if needed; fresh is set for a new
+ * block. With delayed allocation on, a hole is left unmapped and 0 is
+ * returned: the caller parks the data instead.
+ */
+static blk_t file_bmap_alloc(struct icache_entry *e, uint32_t lblk, int *fresh) {
+
+	*fresh = 0;
+	blk_t blockno = ent_bmap(e, lblk, 0, NULL);
+	if(blockno == 0 && tfs_opts.delalloc_blocks <= 0) {
+		blockno = ent_bmap(e, lblk, 1, NULL);
+		if(blockno > 0) {
+			e->inode.link++;
+			*fresh = 1;
+		}
+	}
+	return blockno;
+}
+
+// Move the source forward by len bytes, as fuse_buf_copy() does
+static void file_src_advance(struct fuse_bufvec *src, size_t len) {
+	while(len > 0 && src->idx < src->count) {
+		size_t n = src->buf[src->idx].size - src->off;
+		if(n > len) {
+			n = len;
+		}
+		src->off += n;
+		len -= n;
+		if(src->off == src->buf[src->idx].size) {
+			src->idx++;
+			src->off = 0;
+		}
+	}
+}
+
+// Copy len bytes from the source into memory; a short copy means the source ran dry
+static int file_src_copy(struct fuse_bufvec *src, void *mem, size_t len) {
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+	dst.buf[0].mem = mem;
+	return fuse_buf_copy(&dst, src, 0) == (ssize_t) len ? 0 : -1;
+}
+
+/*
+ * Write blocks [blockno, blockno + k) from the source. When the source is
+ * plain memory the blocks go through the buffer cache as usual; when it
+ * is a file descriptor (the pipe FUSE spliced the request into) they are
+ * spliced straight into the image file, after dropping any cached copies
+ * that would otherwise shadow them.
+ */
+static int file_src_write_blocks(struct fuse_bufvec *src, blk_t blockno, uint32_t k) {
+	size_t len = (size_t) k * BLOCK_SIZE;
+	struct fuse_buf *b = &src->buf[src->idx];
+
+	if(!(b->flags & FUSE_BUF_IS_FD) && b->size - src->off >= len) {
+		if(bio_write_blocks(blockno, k, (char *) b->mem + src->off) < 0) {
+			return -1;
+		}
+		file_src_advance(src, len);
+		return 0;
+	}
+
+	int fd = bio_export(blockno, 0);
+	if(fd < 0) {
+		return -1;
+	}
+	bio_invalidate(blockno, k);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+	dst.buf[0].fd = fd;
+	dst.buf[0].pos = (off_t) blockno * BLOCK_SIZE;
+	return fuse_buf_copy(&dst, src, FUSE_BUF_SPLICE_NONBLOCK) == (ssize_t) len ? 0 : -1;
+}
+
+/*
+ * Move an inline file's data out of its inode into logical block 0, ahead
+ * of a write that takes it past INLINE_DATA_MAX. The block is parked or
+ * allocated like any other block a write fills.
+ */
+static int file_uninline(struct icache_entry *e) {
+
+	size_t len = e->inode.vstat.st_size;
+	if(len > 0) {
+		int fresh;
+		blk_t blockno = file_bmap_alloc(e, 0, &fresh);
+		if(blockno < 0) {
+			return -1;
+		} else if(blockno == 0) {
+			char * data = da_park(e, 0);
+			if(!data) {
+				return -1;
+			}
+			memcpy(data, e->idata, len);
+		} else {
+			char * datablock = (char *) calloc(1, BLOCK_SIZE);
+			if(!datablock) {
+				return -1;
+			}
+			memcpy(datablock, e->idata, len);
+			bio_write(blockno, datablock);
+			free(datablock);
+		}
+	}
+
+	// The space is the extent root again from here on
+	memset(e->idata, 0, sizeof(e->idata));
+	e->inode.flags &= ~TFS_INLINE_FL;
+	e->dirty = 1;
+	return 0;
+}
+
+/*
+ * Write to an inode through its cache entry from a FUSE buffer vector; see
+ * tfs_write(). Returns the bytes written or, if there are none, -ENOSPC
+ * when space ran out and -EIO when the source or the device failed.
+ */
+static int file_write(struct icache_entry *e, struct fuse_bufvec *src, off_t offset) {
+
+	struct inode *inode = &e->inode;
+	size_t size = fuse_buf_size(src);
+
+	if(size == 0){
+		return 0;
+	}
+
+	uint32_t lblk = offset / BLOCK_SIZE;
+	size_t blkoff = offset % BLOCK_SIZE;
+	size_t done = 0;
+	void * datablock = NULL;
+	int err = -ENOSPC;		/* what stopped the write, if nothing was written */
+
+	// A small file is written in its inode for as long as it fits there
+	if(inode->flags & TFS_INLINE_FL) {
+		if(offset + size <= INLINE_DATA_MAX) {
+			if(offset > inode->vstat.st_size) {
+				memset(e->idata + inode->vstat.st_size, 0, offset - inode->vstat.st_size);
+			}
+			if(file_src_copy(src, e->idata + offset, size) == 0) {
+				done = size;
+			} else {
+				err = -EIO;
+			}
+			goto out;
+		}
+		if(file_uninline(e) < 0) {
+			return -ENOSPC;
+		}
+	}
+	if(emap_load(e) < 0) {
+		return -EIO;
+	}
+
+	// Fully covered blocks are written straight from the source, as many at
+	// a time as lie contiguously on disk; partial blocks are read, patched
+	// and written back, unless they were just allocated. Holes are parked
+	// for delayed allocation
+	while(done < size) {
+		size_t n = BLOCK_SIZE - blkoff;
+		if(n > size - done) {
+			n = size - done;
+		}
+
+		int fresh;
+		blk_t blockno = file_bmap_alloc(e, lblk, &fresh);
+		if(blockno < 0) {
+			break;
+		}
+
+		if(blockno == 0) {
+			char * data = da_park(e, lblk);
+			if(!data) {
+				break;
+			}
+			if(file_src_copy(src, data + blkoff, n) < 0) {
+				err = -EIO;
+				break;
+			}
+		} else if(n == BLOCK_SIZE) {
+			// A block that lands elsewhere ends the run; it is mapped now and starts the next
+			uint32_t k, nblk = (size - done) / BLOCK_SIZE;
+			for(k = 1; k < nblk; k++) {
+				blk_t next = file_bmap_alloc(e, lblk + k, &fresh);
+				if(next != blockno + k) {
+					break;
+				}
+			}
+			if(file_src_write_blocks(src, blockno, k) < 0) {
+				err = -EIO;
+				break;
+			}
+			done += (size_t) k * BLOCK_SIZE;
+			lblk += k;
+			continue;
+		} else {
+			if(!datablock && !(datablock = malloc(BLOCK_SIZE))) {
+				err = -ENOMEM;
+				break;
+			}
+			// Patching zeros into what could not be read would wipe the rest of the block
+			if(fresh) {
+				memset(datablock, 0, BLOCK_SIZE);
+			} else if(bio_read(blockno, datablock) < 0) {
+				err = -EIO;
+				break;
+			}
+			if(file_src_copy(src, (char *) datablock + blkoff, n) < 0) {
+				err = -EIO;
+				break;
+			}
+			if(bio_write(blockno, datablock) < 0) {
+				err = -EIO;
+				break;
+			}
+		}
+
+		done += n;
+		blkoff = 0;
+		lblk++;
+	}
+out:
+	free(datablock);
+
+	// The file only grows when the write ends past its current size
+	if(offset + done > inode->vstat.st_size) {
+		inode->size = offset + done;
+		inode->vstat.st_size = offset + done;
+	}
+	if(done) {
+		inode->vstat.st_mtime = inode->vstat.st_ctime = time(NULL);
+	}
+	inode->vstat.st_blocks = (blkcnt_t) (inode->link + e->da.count) * (BLOCK_SIZE / 512);
+	e->dirty = 1;
+
+	// Past its share of parked data the file is given disk space now; past
+	// the share of all files together, the other files are at the next commit
+	if(e->da.count > (uint32_t) tfs_opts.delalloc_blocks) {
+		da_flush(e);
+	}
+	if(__atomic_load_n(&da_parked, __ATOMIC_RELAXED) > (uint32_t) tfs_opts.delalloc_total) {
+		da_flush(e);
+		commit_request();
+	}
+
+	return done ? (int) done : err;
+}
+
+/*
+ * Cut a file down to size bytes or extend it with a hole. Blocks wholly
+ * past the new end are freed and parked ones dropped, and the rest of the
+ * new last block is zeroed so that a later extension reads back zeros.
+ * The caller holds the inode's lock exclusively.
+ */
+static int file_truncate(struct icache_entry *e, off_t size) {
+
+	struct inode *inode = &e->inode;
+	off_t old = inode->vstat.st_size;
+
+	// An inline file stays inline for as long as it fits
+	if(inode->flags & TFS_INLINE_FL) {
+		if(size <= INLINE_DATA_MAX) {
+			if(size < old) {
+				memset(e->idata + size, 0, old - size);
+			} else {
+				memset(e->idata + old, 0, size - old);
+			}
+			goto out;
+		}
+		if(file_uninline(e) < 0) {
+			return -ENOSPC;
+		}
+	}
+
+	if(size < old) {
+		uint32_t keep = (size + BLOCK_SIZE - 1) / BLOCK_SIZE, i, j;
+
+		// Step 1: Drop the parked blocks past the end
+		struct delalloc *d = &e->da;
+		i = da_search(d, keep);
+		for(j = i; j < d->count; j++) {
+			free(d->blk[j].data);
+		}
+		unreserve_blkno(d->count - i);
+		__atomic_sub_fetch(&da_parked, d->count - i, __ATOMIC_RELAXED);
+		__atomic_store_n(&d->count, i, __ATOMIC_RELAXED);
+		if(!e->emap.dirty) {
+			emap_leaves_done(e);
+		}
+
+		// Step 2: Free the mapped blocks past the end, trimming the extent that straddles it
+		if(emap_load(e) < 0) {
+			return -EIO;
+		}
+		struct extent_map *m = &e->emap;
+		while(m->count > 0) {
+			struct extent *x = &m->ext[m->count - 1];
+			if(x->lblk + x->len <= keep) {
+				break;
+			}
+			uint32_t from = x->lblk >= keep ? 0 : keep - x->lblk;
+			for(j = from; j < x->len; j++) {
+				put_blkno(x->pblk + j);
+			}
+			inode->link -= x->len - from;
+			m->dirty = 1;
+			if(from > 0) {
+				x->len = from;
+				break;
+			}
+			m->count--;
+		}
 
-		//initialize papadir inode
-		f_ino = get_avail_ino();
-		sprintf(fname+3, "%d", i);
-		fname[5] = '\0';
-		printf("Adding direntry: %s", fname);
-		finode = (struct inode *) malloc(sizeof(struct inode));
-		finode->ino = f_ino;
-		finode->valid = 1;
-		finode->link = 0;
-	
+		// Step 3: Zero what is left of the last block past the end
+		size_t off = size % BLOCK_SIZE;
+		if(off) {
+			uint32_t lblk = size / BLOCK_SIZE;
+			char * data = da_lookup(e, lblk);
+			blk_t blockno = data ? 0 : ent_bmap(e, lblk, 0, NULL);
+			if(data) {
+				memset(data + off, 0, BLOCK_SIZE - off);
+			} else if(blockno > 0) {
+				char * datablock = (char *) malloc(BLOCK_SIZE);
+				if(!datablock || bio_read(blockno, datablock) < 0) {
+					free(datablock);
+					return -EIO;
+				}
+				memset(datablock + off, 0, BLOCK_SIZE - off);
+				bio_write(blockno, datablock);
+				free(datablock);
+			}
+		}
+	}
+out:
+	inode->size = size;
+	inode->vstat.st_size = size;
+	inode->vstat.st_mtime = inode->vstat.st_ctime = time(NULL);
+	inode->vstat.st_blocks = (blkcnt_t) (inode->link + e->da.count) * (BLOCK_SIZE / 512);
+	e->dirty = 1;
+	return 0;
+}
 
-		//Write papadir inode to block
-		writei(f_ino, finode);
-	 
+/*
+ * Readahead
+ *
+ * Once a file is read sequentially through an open handle, the blocks
+ * after the reader are prefetched into the buffer cache by a background
+ * thread, so the reader finds them there instead of waiting on the disk.
+ * As in the kernel's on-demand readahead, the first window is a few times
+ * the request and each following one is twice the last, up to
+ * tfs_opts.ra_window blocks. The next window is queued once the reader
+ * reaches the start of the current one, so I/O stays ahead of it.
+ *
+ * A request holds a reference on the inode and the worker reads under
+ * the inode's read lock, so the blocks cannot be rewritten or freed while
+ * they are in flight. When tfs_opts.ra_inflight requests are already
+ * queued, new ones are dropped rather than waited for.
+ */
+struct ra_req {
+	struct icache_entry	*ent;			/* referenced inode cache entry */
+	uint32_t			lblk;			/* first logical block to prefetch */
+	uint32_t			nblocks;		/* blocks to prefetch */
+};
 
-		//Add Papadirino to directory jawn
-		dir_add(*rootinode, f_ino, fname, strlen(fname));
+struct readahead {
+	pthread_t			thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct ra_req		*queue;			/* ring of tfs_opts.ra_inflight requests */
+	int					head;
+	int					count;
+	int					running;
+	uint64_t			requests;		/* windows queued */
+	uint64_t			dropped;		/* windows dropped with the queue full */
+};
 
-	
-		//Read papadir as rootinode
-		readi(f_ino, rootinode);
+static struct readahead ra = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
 
+// Prefetch the mapped blocks of a window, one extent at a time
+static void ra_fill(struct icache_entry *e, uint32_t lblk, uint32_t nblocks) {
+
+	pthread_rwlock_rdlock(&e->lock);
+	if(e->inode.valid) {
+		uint32_t end = (e->inode.vstat.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		if(lblk + nblocks < end) {
+			end = lblk + nblocks;
+		}
+		while(lblk < end) {
+			uint32_t run = 1;
+			blk_t blockno = ent_bmap(e, lblk, 0, &run);
+			if(blockno < 0) {
+				break;
+			}
+			if(run > end - lblk) {
+				run = end - lblk;
+			}
+			if(blockno > 0) {
+				bio_prefetch(blockno, run);
+			}
+			lblk += run;
+		}
 	}
+	pthread_rwlock_unlock(&e->lock);
+}
 
-	//Get node by path specified
-	rootinode = (struct inode *) malloc(sizeof(struct inode));
-	char * pathName = "/dir0/dir1/dir2/dir3";
-	get_node_by_path(pathName, 0, rootinode);
+static void *ra_worker(void *arg) {
 
-	//Initialize new inode
-	f_ino = get_avail_ino();
-	strcpy(fname, "yousonice");
-	finode = (struct inode *) malloc(sizeof(struct inode));
-	finode->ino = f_ino;
-	finode->valid = 1;
-	finode->link = 0;
-	
+	pthread_mutex_lock(&ra.lock);
+	while(ra.running || ra.count > 0) {
+		if(ra.count == 0) {
+			pthread_cond_wait(&ra.cond, &ra.lock);
+			continue;
+		}
+		struct ra_req req = ra.queue[ra.head];
+		ra.head = (ra.head + 1) % tfs_opts.ra_inflight;
+		ra.count--;
+		int skip = !ra.running;
+		pthread_mutex_unlock(&ra.lock);
+
+		// Requests still queued at unmount are just released
+		if(!skip) {
+			ra_fill(req.ent, req.lblk, req.nblocks);
+		}
+		icache_put(req.ent);
 
-	//Write yousonice inode to block
-	writei(f_ino, finode);
+		pthread_mutex_lock(&ra.lock);
+	}
+	pthread_mutex_unlock(&ra.lock);
+	return NULL;
+}
 
-	//Add yousonice to directory dir3
-	dir_add(*rootinode, f_ino, fname, strlen(fname));
+static void ra_submit(struct icache_entry *e, uint32_t lblk, uint32_t nblocks) {
 
-	pathName = "/dir0/dir1/dir2/dir3/yousonice";
-	get_node_by_path(pathName, 0, rootinode);
-	
-	if(rootinode->valid) {
-		//printf("Storage inode number: %d\n", rootinode->ino);
-	} else {
-		//printf("Back to the debugging grind son\n");
+	pthread_mutex_lock(&ra.lock);
+	if(!ra.running || ra.count == tfs_opts.ra_inflight) {
+		ra.dropped++;
+		pthread_mutex_unlock(&ra.lock);
+		return;
 	}
-	
+	pthread_mutex_lock(&icache_lock);
+	e->refs++;
+	pthread_mutex_unlock(&icache_lock);
+
+	struct ra_req *req = &ra.queue[(ra.head + ra.count) % tfs_opts.ra_inflight];
+	req->ent = e;
+	req->lblk = lblk;
+	req->nblocks = nblocks;
+	ra.count++;
+	ra.requests++;
+	pthread_cond_signal(&ra.cond);
+	pthread_mutex_unlock(&ra.lock);
 }
 
+// Decide whether the read of [offset, offset + len) that just finished should move the readahead window on
+static void file_readahead(struct tfs_file *f, off_t offset, size_t len) {
 
+	if(!ra.running) {
+		return;
+	}
+	if(f->seq_reads == 0) {
+		f->ra_size = 0;
+		return;
+	}
 
-void testAddMethod() {
-	//Initialize before add inode
-	struct inode * rootinode = (struct inode *) malloc(sizeof(struct inode));	
-	readi(0, rootinode);
-	printinode(rootinode);
+	uint32_t first = offset / BLOCK_SIZE;
+	uint32_t last = (offset + len - 1) / BLOCK_SIZE;
+	if(f->ra_size > 0 && last < f->ra_mark) {
+		return;
+	}
 
-	//ADDING FILES
-	int nfilestoadd = 100;
-	char fname[256];
-	uint16_t f_ino;
+	uint32_t size;
+	if(f->ra_size == 0) {
+		size = (last - first + 1) * 4;
+		if(size < RA_MIN_WINDOW) {
+			size = RA_MIN_WINDOW;
+		}
+	} else {
+		size = f->ra_size * 2;
+	}
+	if(size > (uint32_t) tfs_opts.ra_window) {
+		size = tfs_opts.ra_window;
+	}
 
-	strcpy(fname, "myfile");
+	uint32_t start = f->ra_size > 0 && f->ra_next > last ? f->ra_next : last + 1;
+	f->ra_size = size;
+	f->ra_mark = start;
+	f->ra_next = start + size;
+	ra_submit(f->ent, start, size);
+}
 
-	int i;
-	for(i = 0; i < nfilestoadd; i++) {
-		sprintf(fname + 6, "%d", i);
-		fname[10] = '\0';
-		f_ino = get_avail_ino();
-		dir_add(*rootinode, f_ino, fname, strlen(fname));	
-		readi(0, rootinode);
-		//printinode(rootinode);
+static int ra_start() {
+
+	if(tfs_opts.ra_window <= 0 || tfs_opts.ra_inflight <= 0) {
+		return 0;
+	}
+	ra.queue = (struct ra_req *) calloc(tfs_opts.ra_inflight, sizeof(struct ra_req));
+	if(!ra.queue) {
+		return -1;
 	}
+	ra.head = ra.count = 0;
+	ra.requests = ra.dropped = 0;
+	ra.running = 1;
+	if(pthread_create(&ra.thread, NULL, ra_worker, NULL) != 0) {
+		ra.running = 0;
+		free(ra.queue);
+		ra.queue = NULL;
+		return -1;
+	}
+	return 0;
+}
 
-	printDirectoryContents(rootinode);	
+static void ra_stop() {
 
+	if(!ra.queue) {
+		return;
+	}
+	pthread_mutex_lock(&ra.lock);
+	ra.running = 0;
+	pthread_cond_signal(&ra.cond);
+	pthread_mutex_unlock(&ra.lock);
+	pthread_join(ra.thread, NULL);
+	free(ra.queue);
+	ra.queue = NULL;
+}
 
-	//DELETING FILES
-	int nfilestodelete = 47;
-	char dfname[256];
-	
-	strcpy(dfname, "myfile");
+/*
+ * FUSE file operations
+ *
+ * tfs talks to the kernel through the low-level API, so every request
+ * names its inode directly and no path is ever built or parsed. FUSE
+ * reserves inode 1 for the root, which is inode 0 here.
+ */
+#define TFS_INO(fino)	((uint16_t) ((fino) - FUSE_ROOT_ID))
+#define FUSE_INO(ino)	((fuse_ino_t) (ino) + FUSE_ROOT_ID)
 
-	for(i = 0; i < nfilestodelete; i++) {
-		sprintf(dfname + 6, "%d", i);
-		dfname[10] = '\0';
-		dir_remove(*rootinode, dfname, strlen(dfname));	
-		readi(0, rootinode);
-		//printinode(rootinode);
-	}
+// Take a reference on the cache entry for a live inode the kernel asked about, or return NULL
+static struct icache_entry *tfs_iget(fuse_ino_t ino) {
 
+	if(ino < FUSE_ROOT_ID || ino - FUSE_ROOT_ID >= sb.max_inum) {
+		return NULL;
+	}
+	struct icache_entry *e = icache_get(TFS_INO(ino));
+	if(!e) {
+		return NULL;
+	}
+	pthread_rwlock_rdlock(&e->lock);
+	int valid = e->inode.valid;
+	pthread_rwlock_unlock(&e->lock);
+	if(!valid) {
+		icache_put(e);
+		return NULL;
+	}
+	return e;
+}
 
-	printDirectoryContents(rootinode);
-	
+// The cache entry a read or write should use, the open file's or else the inode's, referenced
+static struct icache_entry *file_entry(fuse_ino_t ino, struct fuse_file_info *fi) {
 
-	//ADDING DIFFERENT FILES
-	int nfilestoreadd = 209;
-	char rfname[256];	
-	strcpy(rfname, "newguy");
-	for(i = 0; i < nfilestoreadd; i++) {
-		sprintf(rfname + 6, "%d", i);
-		rfname[10] = '\0';
-		f_ino = get_avail_ino();
-		dir_add(*rootinode, f_ino, rfname, strlen(rfname));	
-		readi(0, rootinode);
-		//printinode(rootinode);
+	struct tfs_file *f = file_get(fi);
+	if(!f) {
+		return tfs_iget(ino);
 	}
+	pthread_mutex_lock(&icache_lock);
+	f->ent->refs++;
+	pthread_mutex_unlock(&icache_lock);
+	return f->ent;
+}
 
-	printDirectoryContents(rootinode);
+static void tfs_fill_attr(struct icache_entry *e, struct stat *stbuf) {
+	memcpy(stbuf, &e->inode.vstat, sizeof(struct stat));
+	stbuf->st_ino = FUSE_INO(e->ino);
+}
 
-	
-	//FINDING FILE
-	char * finddir = "newguy202";
-	struct dirent * storage = (struct dirent *) malloc(sizeof(struct dirent));
-	dir_find(0, finddir,strlen(finddir), storage);
-	printf("Resulting dirent block: %s, %d\n", storage->name, storage->ino);
-		
+static void tfs_fill_entry(struct icache_entry *e, struct fuse_entry_param *ep) {
+	memset(ep, 0, sizeof(struct fuse_entry_param));
+	ep->ino = FUSE_INO(e->ino);
+	tfs_fill_attr(e, &ep->attr);
+	ep->attr_timeout = tfs_opts.attr_timeout;
+	ep->entry_timeout = tfs_opts.entry_timeout;
+}
 
+static void tfs_lookup_ref(uint16_t ino) {
+	pthread_mutex_lock(&icache_lock);
+	ino_lookups[ino]++;
+	pthread_mutex_unlock(&icache_lock);
 }
 
+// Reply with a directory entry; the kernel only holds a reference if the reply got through
+static void tfs_reply_entry(fuse_req_t req, struct icache_entry *e) {
 
+	struct fuse_entry_param ep;
+	pthread_rwlock_rdlock(&e->lock);
+	tfs_fill_entry(e, &ep);
+	pthread_rwlock_unlock(&e->lock);
+	if(fuse_reply_entry(req, &ep) == 0) {
+		tfs_lookup_ref(e->ino);
+	}
+}
 
-/* 
- * Make file system
+/*
+ * Statistics
+ *
+ * Every FUSE operation is timed into a slot of its own after the block
+ * layer's (see stat_record()), and counted as failed if it replied with
+ * an error. The totals, with the cache, journal and space figures
+ * tfs_destroy() prints, can be read at any time from /.tfs/stats: a
+ * read-only file made up on the spot, whose every open takes a snapshot
+ * that reads see until release. It is opened direct_io, so its size of
+ * 0 does not cut reads short. /.tfs is left out of listings of the root,
+ * and its name cannot be taken there.
  */
-int tfs_mkfs() {
+enum {
+	OP_LOOKUP = STAT_BLOCK_SLOTS, OP_FORGET, OP_GETATTR, OP_SETATTR,
+	OP_OPENDIR, OP_READDIR, OP_READDIRPLUS, OP_RELEASEDIR, OP_MKDIR, OP_RMDIR,
+	OP_CREATE, OP_OPEN, OP_READ, OP_WRITE, OP_UNLINK, OP_FLUSH, OP_RELEASE,
+	OP_FSYNC, OP_FSYNCDIR, OP_STATFS, OP_SETXATTR, OP_GETXATTR, OP_LISTXATTR,
+	OP_COUNT
+};
 
-	// Call dev_init() to initialize (Create) Diskfile
+_Static_assert(OP_COUNT <= STAT_MAX_SLOTS, "too many statistics slots");
+
+static const char * const stat_names[OP_COUNT] = {
+	[STAT_BIO_READ] = "bio_read", [STAT_BIO_WRITE] = "bio_write", [STAT_BIO_WRITE_META] = "bio_write_meta",
+	[OP_LOOKUP] = "lookup", [OP_FORGET] = "forget", [OP_GETATTR] = "getattr", [OP_SETATTR] = "setattr",
+	[OP_OPENDIR] = "opendir", [OP_READDIR] = "readdir", [OP_READDIRPLUS] = "readdirplus",
+	[OP_RELEASEDIR] = "releasedir", [OP_MKDIR] = "mkdir", [OP_RMDIR] = "rmdir", [OP_CREATE] = "create",
+	[OP_OPEN] = "open", [OP_READ] = "read", [OP_WRITE] = "write", [OP_UNLINK] = "unlink",
+	[OP_FLUSH] = "flush", [OP_RELEASE] = "release", [OP_FSYNC] = "fsync", [OP_FSYNCDIR] = "fsyncdir",
+	[OP_STATFS] = "statfs", [OP_SETXATTR] = "setxattr", [OP_GETXATTR] = "getxattr",
+	[OP_LISTXATTR] = "listxattr",
+};
 
-	dev_init(diskfile_path);
+#define STATS_DIR_NAME	".tfs"
+#define STATS_FILE_NAME	"stats"
 
-	// write superblock information
-	
-	sb.magic_num = MAGIC_NUM;
-	sb.max_inum = MAX_INUM;
-	sb.max_dnum = MAX_DNUM;
-	sb.i_bitmap_blk = 1;
-	sb.d_bitmap_blk = 2;
-	sb.i_start_blk = 3;
-	sb.d_start_blk = 3 + MAX_INUM;
-
-	bio_write(0, &sb);
-	
+// Inode numbers of /.tfs and /.tfs/stats, past any an image can have
+#define STATS_DIR_INO	((fuse_ino_t) MAX_INUM + FUSE_ROOT_ID)
+#define STATS_FILE_INO	(STATS_DIR_INO + 1)
 
-	// initialize inode bitmap	
-	// initialize data block bitmap
-	bitmap_t ibitmap = (bitmap_t) malloc(4096);
-	bitmap_t dbitmap = (bitmap_t) malloc(4096);
-	set_bitmap(ibitmap, 0);
+static __thread int op_err;		/* error the running operation replied with */
+static time_t stats_time;		/* times of the stats inodes: when the image was mounted */
 
-	bio_write(sb.i_bitmap_blk, ibitmap);
-	bio_write(sb.d_bitmap_blk, dbitmap);
-			
-	// update bitmap information for root directory			
-	struct inode * rootinode = (struct inode *) malloc(sizeof(struct inode));
-	rootinode->ino = 0;
-	rootinode->valid = 1;
-	rootinode->link = 0;
-	
-	rootinode->vstat.st_ino = 0;
-	rootinode->vstat.st_mode   = S_IFDIR | 0755;
-	rootinode->vstat.st_blksize = 4096;
-	rootinode->vstat.st_size = 0;
-	rootinode->vstat.st_blocks = 0;
-		
-	writei(rootinode->ino, rootinode);
-	
-	return 0;
+// Every error reply goes through here, so the operation's wrapper can count it
+static int tfs_reply_err(fuse_req_t req, int err) {
+	op_err = err;
+	return fuse_reply_err(req, err);
 }
 
+// One line per slot: counts, mean and percentile latencies in microseconds, and the used histogram buckets
+static void stats_print_ops(FILE *out) {
+
+	struct lat_stats st;
+	for(int slot = 0; slot < OP_COUNT; slot++) {
+		stat_sum(slot, &st);
+		fprintf(out, "%s calls=%lu errors=%lu bytes=%lu avg_us=%.1f p50_us=%.1f p99_us=%.1f p999_us=%.1f hist=",
+			stat_names[slot], st.calls, st.errors, st.bytes, st.calls ? st.ns / 1000.0 / st.calls : 0.0,
+			stat_percentile(&st, 0.5) / 1000.0, stat_percentile(&st, 0.99) / 1000.0,
+			stat_percentile(&st, 0.999) / 1000.0);
+		const char *sep = "";
+		for(int i = 0; i < STAT_BUCKETS; i++) {
+			if(st.hist[i]) {
+				fprintf(out, "%s%d:%lu", sep, i, st.hist[i]);
+				sep = ",";
+			}
+		}
+		fputc('\n', out);
+	}
+}
+
+// Cache, readahead, journal and space figures, each copied under the lock that guards it
+static void tfs_report(FILE *out) {
+
+	struct bcache_stats stats;
+	bcache_stats(&stats);
+	uint64_t lookups = stats.hits + stats.misses;
+	fprintf(out, "Buffer cache: %u blocks, %lu hits, %lu misses (%.1f%% hit rate), %lu evictions, %lu writebacks\n",
+		stats.nbufs, stats.hits, stats.misses, lookups ? 100.0 * stats.hits / lookups : 0.0,
+		stats.evictions, stats.writebacks);
+
+	pthread_mutex_lock(&dcache_lock);
+	int dcount = dcache.count;
+	uint64_t dhits = dcache.hits, dneg = dcache.neg_hits, dmisses = dcache.misses;
+	pthread_mutex_unlock(&dcache_lock);
+	fprintf(out, "Dentry cache: %d entries, %lu hits, %lu negative hits, %lu misses\n", dcount, dhits, dneg, dmisses);
+
+	pthread_mutex_lock(&ra.lock);
+	uint64_t requests = ra.requests, dropped = ra.dropped;
+	pthread_mutex_unlock(&ra.lock);
+	fprintf(out, "Readahead: %lu windows (%lu dropped), %lu blocks, %lu hits, %lu wasted\n",
+		requests, dropped, stats.ra_blocks, stats.ra_hits, stats.ra_waste);
+
+	struct jnl_stats js;
+	jnl_stats(&js);
+	fprintf(out, "Journal: %lu commits, %lu operations, %lu blocks logged, %lu revoked, %lu checkpointed, %lu transactions replayed\n",
+		js.commits, js.handles, js.logged, js.revoked, js.checkpointed, js.replayed);
+
+	pthread_mutex_lock(&alloc_lock);
+	fprintf(out, "Delayed allocation: %lu blocks in %lu extents\n", da_blocks, da_runs);
+	uint32_t largest;
+	double frag = fidx_frag(&dfree, &largest);
+	fprintf(out, "Free space: %u blocks in %u runs, largest %u, %.1f%% in runs under %d blocks\n",
+		dbm.nfree, dfree.count, largest, frag, FRAG_RUN_BLOCKS);
+	fprintf(out, "Image: %lu blocks, %u of them data, grown %lu times, may grow to %lu data blocks\n",
+		(unsigned long) sb.nblocks, sb.max_dnum, grow_count, (unsigned long) data_limit());
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+// The stats inode name stands for in parent, or 0 if it is not one
+static fuse_ino_t stats_ino(fuse_ino_t parent, const char *name) {
+	if(parent == FUSE_ROOT_ID && !strcmp(name, STATS_DIR_NAME)) {
+		return STATS_DIR_INO;
+	}
+	if(parent == STATS_DIR_INO && !strcmp(name, STATS_FILE_NAME)) {
+		return STATS_FILE_INO;
+	}
+	return 0;
+}
 
+static void stats_fill_attr(fuse_ino_t ino, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = ino;
+	stbuf->st_mode = ino == STATS_DIR_INO ? S_IFDIR | 0555 : S_IFREG | 0444;
+	stbuf->st_nlink = ino == STATS_DIR_INO ? 2 : 1;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = stats_time;
+}
 
+// Answer a lookup in the root for /.tfs, or in /.tfs; the kernel's references to these need no counting
+static void stats_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
 
+	fuse_ino_t ino = stats_ino(parent, name);
+	if(!ino) {
+		tfs_reply_err(req, ENOENT);
+		return;
+	}
+	struct fuse_entry_param ep;
+	memset(&ep, 0, sizeof(struct fuse_entry_param));
+	ep.ino = ino;
+	stats_fill_attr(ino, &ep.attr);
+	ep.attr_timeout = tfs_opts.attr_timeout;
+	ep.entry_timeout = tfs_opts.entry_timeout;
+	fuse_reply_entry(req, &ep);
+}
 
+// Take the snapshot an open of /.tfs/stats reads from; fi->fh holds it until release
+static void stats_open(fuse_req_t req, struct fuse_file_info *fi) {
 
-/* 
- * FUSE file operations
- */
-static void *tfs_init(struct fuse_conn_info *conn) {
+	if((fi->flags & O_ACCMODE) != O_RDONLY) {
+		tfs_reply_err(req, EACCES);
+		return;
+	}
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *out = open_memstream(&buf, &len);
+	if(!out) {
+		tfs_reply_err(req, ENOMEM);
+		return;
+	}
+	stats_print_ops(out);
+	tfs_report(out);
+	if(fclose(out) != 0) {
+		free(buf);
+		tfs_reply_err(req, ENOMEM);
+		return;
+	}
+	fi->fh = (uintptr_t) buf;
+	fi->direct_io = 1;
+	if(fuse_reply_open(req, fi) != 0) {
+		free(buf);
+	}
+}
 
-	// Step 1a: If disk file is not found, call mkfs
+static void stats_read(fuse_req_t req, size_t size, off_t offset, struct fuse_file_info *fi) {
 
-	if(dev_open(diskfile_path) < 0) {
-		tfs_mkfs();	
-		//testGetNodeByPath();
+	const char *buf = (const char *) (uintptr_t) fi->fh;
+	size_t len = strlen(buf);
+	if((size_t) offset >= len) {
+		fuse_reply_buf(req, NULL, 0);
 	} else {
-		bio_read(0, &sb);
-		//printf("Superblock Magic Num: %x", sb.magic_num);
+		fuse_reply_buf(req, buf + offset, len - offset < size ? len - offset : size);
 	}
+}
 
-  	// Step 1b: If disk file is found, just initialize in-memory data structures
-  	// and read superblock from disk
+// /.tfs lists its one file; readdirplus counts no lookup for it, as stats_lookup() does not
+static void stats_readdir(fuse_req_t req, size_t size, off_t offset, int plus) {
 
-	return NULL;
+	char *buf = (char *) malloc(size ? size : 1);
+	size_t len = 0;
+	if(!buf) {
+		tfs_reply_err(req, ENOMEM);
+		return;
+	}
+	if(offset == 0) {
+		struct fuse_entry_param ep;
+		memset(&ep, 0, sizeof(struct fuse_entry_param));
+		ep.ino = STATS_FILE_INO;
+		stats_fill_attr(STATS_FILE_INO, &ep.attr);
+		ep.attr_timeout = tfs_opts.attr_timeout;
+		ep.entry_timeout = tfs_opts.entry_timeout;
+		len = plus ? fuse_add_direntry_plus(req, buf, size, STATS_FILE_NAME, &ep, 1) :
+			fuse_add_direntry(req, buf, size, STATS_FILE_NAME, &ep.attr, 1);
+		if(len > size) {
+			len = 0;
+		}
+	}
+	fuse_reply_buf(req, buf, len);
+	free(buf);
 }
 
-static void tfs_destroy(void *userdata) {
-
-	// Step 1: De-allocate in-memory data structures
-	dev_close();
-	// Step 2: Close diskfile
+// Set up the block, inode and dentry caches once the block size is known
+static void tfs_cache_init() {
 
+	if(bcache_init(tfs_opts.cache_blocks) < 0) {
+		tfs_log(TFS_LOG_WARN, "Buffer cache of %d blocks could not be allocated, running uncached\n", tfs_opts.cache_blocks);
+	}
+	if(icache_init(tfs_opts.icache_size) < 0) {
+		perror("icache_init failed");
+		exit(EXIT_FAILURE);
+	}
+	if(dcache_init(tfs_opts.dcache_size) < 0) {
+		tfs_log(TFS_LOG_WARN, "Dentry cache of %d entries could not be allocated, running uncached\n", tfs_opts.dcache_size);
+	}
 }
 
-static int tfs_getattr(const char *path, struct stat *stbuf) {
+static void tfs_init(void *userdata, struct fuse_conn_info *conn) {
+
+	if(conn) {
+		// Have request and reply data spliced through pipes rather than copied
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+		// Ask for the kernel-side caching the mount options call for
+		if(tfs_opts.async_read) {
+			conn->want |= conn->capable & FUSE_CAP_ASYNC_READ;
+		} else {
+			conn->want &= ~FUSE_CAP_ASYNC_READ;
+		}
+		if(tfs_opts.writeback_cache) {
+			if(conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+				conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+			} else {
+				tfs_log(TFS_LOG_WARN, "Kernel has no writeback cache for FUSE, writing through\n");
+			}
+		}
+
+		// Requests may carry max_pages pages; FUSE tells the kernel how many
+		// from max_write. max_read has to match the mount option
+		unsigned max_write = tfs_opts.max_write;
+		if(tfs_opts.max_pages > 0 && max_write > tfs_opts.max_pages * (unsigned) getpagesize()) {
+			max_write = tfs_opts.max_pages * (unsigned) getpagesize();
+		}
+		if(max_write > 0) {
+			conn->max_write = max_write;
+		}
+		conn->max_read = tfs_opts.max_read;
+	}
 
+	if(tfs_opts.mmap) {
+		dev_set_backend(DEV_BACKEND_MMAP, 0, (tfs_opts.mmap_populate ? DEV_MMAP_POPULATE : 0) | tfs_opts.mmap_advise);
+	} else if(tfs_opts.io_uring) {
+		int flags = (tfs_opts.uring_sqpoll ? DEV_URING_SQPOLL : 0) | (tfs_opts.uring_cqpoll ? DEV_URING_CQPOLL : 0);
+		if(dev_set_backend(DEV_BACKEND_URING, tfs_opts.uring_depth, flags) < 0) {
+			tfs_log(TFS_LOG_WARN, "io_uring backend unavailable, falling back to pread/pwrite\n");
+			dev_set_backend(DEV_BACKEND_PREAD, 0, 0);
+		}
+	} else {
+		dev_set_backend(DEV_BACKEND_PREAD, 0, 0);
+	}
 
-	printf("\nCALLING GET ATTR ON PATH: %s\n", path);
-	// Step 1: call get_node_by_path() to get inode from path
-	struct inode * inode = (struct inode *) malloc(sizeof(struct inode));
-	int found = get_node_by_path(path, 0, inode);
+	stats_time = time(NULL);
+	da_reserved = da_parked = 0;
+	da_blocks = da_runs = 0;
+	sb_dirty = grow_stuck = 0;
+	grow_count = 0;
 
-	//printf("Filling Attribute: %d\n", inode->ino);
+	// Step 1a: If disk file is not found, call mkfs
 
-	if(found < 0) {
-		//printf("Path %s attributes not found\n", path);
-		return -ENOENT;
+	if(mkfs_opts.format || dev_open(diskfile_path) < 0) {
+		if(tfs_mkfs() < 0) {
+			exit(EXIT_FAILURE);
+		}
+		//testGetNodeByPath();
 	} else {
-		//printf("Path %s attributes found\n", path);
-		memcpy(stbuf, &inode->vstat, sizeof(struct stat));
-		return 0;
+		// The superblock says how big the blocks are, so it is read before any block is
+		if(dev_peek(0, &sb, sizeof(struct superblock)) < 0 || sb.magic_num != MAGIC_NUM) {
+			tfs_log(TFS_LOG_ERROR, "%s is not a TFS image of this version (magic %x), remove it to reformat\n", diskfile_path, sb.magic_num);
+			exit(EXIT_FAILURE);
+		}
+		if(dev_set_block_size(sb.block_size) < 0) {
+			tfs_log(TFS_LOG_ERROR, "%s: unsupported block size %u\n", diskfile_path, sb.block_size);
+			exit(EXIT_FAILURE);
+		}
+		tfs_cache_init();
+
+		// Finish the metadata updates of any commit the last mount made
+		if(jnl_open(sb.j_start_blk, sb.j_nblocks) < 0) {
+			tfs_log(TFS_LOG_ERROR, "%s: journal could not be recovered\n", diskfile_path);
+			exit(EXIT_FAILURE);
+		}
+
+		// The journal holds the superblock of the last grow until it is checkpointed
+		void * sbblock = malloc(BLOCK_SIZE);
+		bio_read(0, sbblock);
+		memcpy(&sb, sbblock, sizeof(struct superblock));
+		free(sbblock);
+		dev_set_size_limit((sb.d_start_blk + data_limit()) * BLOCK_SIZE);
+
+	  	// Step 1b: If disk file is found, just initialize in-memory data structures
+	  	// and read superblock from disk
+		bitmap_load(&ibm, sb.i_bitmap_blk, sb.max_inum, 1);
+		bitmap_load(&dbm, sb.d_bitmap_blk, sb.max_dnum, 1);
+		if(fidx_build(&dfree, &dbm) < 0) {
+			perror("free extent index allocation failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	ino_lookups = (uint32_t *) calloc(sb.max_inum, sizeof(uint32_t));
+	if(!ino_lookups) {
+		perror("lookup count allocation failed");
+		exit(EXIT_FAILURE);
+	}
+
+	if(ra_start() < 0) {
+		tfs_log(TFS_LOG_WARN, "Readahead thread could not be started, reading on demand only\n");
+	}
+	if(commit_start() < 0) {
+		tfs_log(TFS_LOG_WARN, "Journal commit thread could not be started, committing on fsync only\n");
+	}
+}
+
+static void tfs_destroy(void *userdata) {
+
+	// Step 1: De-allocate in-memory data structures
+	ra_stop();
+	commit_stop();
+
+	// Step 2: The kernel forgets everything on unmount, so unlinked inodes
+	// still open or looked up can go now
+	struct icache_entry *e, *next;
+	file_table_destroy();
+	memset(ino_lookups, 0, sb.max_inum * sizeof(uint32_t));
+	for(e = icache.head; e; e = next) {
+		next = e->next;
+		e->refs++;
+		inode_reap(e);
+		e->refs--;
+	}
+	free(ino_lookups);
+	ino_lookups = NULL;
+
+	// Step 3: Close diskfile, committing what is left and checkpointing the journal.
+	// The second commit records the frees the first one made reusable.
+	tfs_writeback();
+	tfs_writeback();
+	jnl_close();
+	if(tfs_log_on(TFS_LOG_INFO)) {
+		tfs_report(stdout);
 	}
+	dcache_destroy();
+	icache_destroy();
+	bitmap_release(&ibm);
+	bitmap_release(&dbm);
+	fidx_release(&dfree);
+	free(dfl);
+	dfl = NULL;
+	dfl_len = dfl_cap = 0;
+	dev_close();
 
 }
 
-static int tfs_opendir(const char *path, struct fuse_file_info *fi) {
-
+static void tfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
 
-	//printf("\nCALLING OPEN DIR: %s\n", path);
-
-	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode * inode = (struct inode *) malloc(sizeof(struct inode));
-	int found = get_node_by_path(path, 0, inode);
+	if(parent == STATS_DIR_INO || stats_ino(parent, name)) {
+		stats_lookup(req, parent, name);
+		return;
+	}
 
-	//printf("Node NumberJawn: %d\n", inode->ino);
-	
+	// Step 1: Call dir_find() to look name up in the parent directory
+	struct icache_entry *pe = tfs_iget(parent);
+	if(!pe) {
+		tfs_reply_err(req, ENOENT);
+		return;
+	}
+	struct dirent dirent;
+	pthread_rwlock_rdlock(&pe->lock);
+	int found = dir_find(pe->ino, name, strlen(name), &dirent);
+	pthread_rwlock_unlock(&pe->lock);
+	icache_put(pe);
 	if(found < 0) {
-		return -ENOENT;
-	} else {
-		return 0;
+		// The kernel may remember that the name is missing too, as an entry for inode 0
+		if(tfs_opts.negative_timeout > 0) {
+			struct fuse_entry_param ep;
+			memset(&ep, 0, sizeof(struct fuse_entry_param));
+			ep.entry_timeout = tfs_opts.negative_timeout;
+			fuse_reply_entry(req, &ep);
+		} else {
+			tfs_reply_err(req, ENOENT);
+		}
+		return;
 	}
-	
 
-	// Step 2: If not find, return -1
+	// Step 2: Reply with the child's attributes
+	struct icache_entry *e = tfs_iget(FUSE_INO(dirent.ino));
+	if(!e) {
+		tfs_reply_err(req, EIO);
+		return;
+	}
+	tfs_reply_entry(req, e);
+	icache_put(e);
 }
 
-static int tfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+static void tfs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
 
+	// An unlinked inode is pinned in the cache, so it is always found here
+	if(ino >= FUSE_ROOT_ID && ino - FUSE_ROOT_ID < sb.max_inum) {
+		uint16_t tino = TFS_INO(ino);
 
-	//printf("\nCALLING READ DIR ON PATH: %s\n", path);
+		pthread_mutex_lock(&icache_lock);
+		ino_lookups[tino] = ino_lookups[tino] > nlookup ? ino_lookups[tino] - nlookup : 0;
+		struct icache_entry *e = icache_lookup(tino);
+		if(e) {
+			e->refs++;
+		}
+		pthread_mutex_unlock(&icache_lock);
 
-	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode * dirinode = (struct inode *) malloc(sizeof(struct inode));
-	int found = get_node_by_path(path, 0, dirinode);
-	
-	if(found < 0) {
-		return -ENOENT;
+		if(e) {
+			tfs_op_begin();
+			inode_reap(e);
+			icache_put(e);
+			tfs_op_end();
+		}
 	}
+	fuse_reply_none(req);
+}
 
-	// Step 2: Read directory entries from its data blocks, and copy them to filler
-	void * datablock = malloc(4096);
-	int i;
-	struct dirent * datablockdirent;
-	for(i = 0; i < dirinode->link; i++) {
-	 	bio_read(dirinode->direct_ptr[i], datablock);
+static void tfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
 
-		datablockdirent = (struct dirent *) datablock;
-		
-		while((void *) datablockdirent <= datablock + 4096 - sizeof(struct dirent)){
-			if(datablockdirent->valid == 1){
-				filler(buffer, datablockdirent->name, NULL, 0);
-			}
-			datablockdirent++;
-		}
+	if(ino == STATS_DIR_INO || ino == STATS_FILE_INO) {
+		struct stat stbuf;
+		stats_fill_attr(ino, &stbuf);
+		fuse_reply_attr(req, &stbuf, tfs_opts.attr_timeout);
+		return;
 	}
 
+	// Step 1: Get the inode straight from the inode cache
+	struct icache_entry *e = file_entry(ino, fi);
+	if(!e) {
+		tfs_reply_err(req, ENOENT);
+		return;
+	}
 
-	return 0;
+	// Step 2: Copy its attributes out
+	struct stat stbuf;
+	pthread_rwlock_rdlock(&e->lock);
+	tfs_fill_attr(e, &stbuf);
+	pthread_rwlock_unlock(&e->lock);
+	icache_put(e);
+	fuse_reply_attr(req, &stbuf, tfs_opts.attr_timeout);
 }
 
+static void tfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
 
-static int tfs_mkdir(const char *path, mode_t mode) {
-	//printf("\nCALLING MAKE DIR ON PATH: %s\n", path);
-	
-
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-	int pathlength = strlen(path);
-
-	char * pathcopy1 = (char *) malloc(pathlength + 1);
-	char * pathcopy2 = (char *) malloc(pathlength + 1);
-
-	memcpy(pathcopy1, (char *) path, pathlength);
-	memcpy(pathcopy2, (char *) path, pathlength);
+	if(ino == STATS_DIR_INO || ino == STATS_FILE_INO) {
+		tfs_reply_err(req, EPERM);
+		return;
+	}
 
-	pathcopy1[pathlength] = '\0';
-	pathcopy2[pathlength] = '\0';
+	// Step 1: Get the inode, through the open file if there is one
+	struct icache_entry *e = file_entry(ino, fi);
+	if(!e) {
+		tfs_reply_err(req, ENOENT);
+		return;
+	}
 
-	
-	char * parentname = dirname(pathcopy1);
-	char * childname = basename(pathcopy2);
+	// Step 2: Change the size first, as it is the one change that can fail
+	struct stat stbuf;
+	int ret, tries = 0;
+	do {
+		tfs_op_begin();
+		pthread_rwlock_wrlock(&e->lock);
+		struct stat *st = &e->inode.vstat;
+		ret = 0;
+		if(to_set & FUSE_SET_ATTR_SIZE) {
+			if(S_ISDIR(st->st_mode)) {
+				ret = -EISDIR;
+			} else if(attr->st_size < 0 || (uint64_t) attr->st_size / BLOCK_SIZE > UINT32_MAX) {
+				ret = -EFBIG;
+			} else if(attr->st_size != st->st_size) {
+				ret = file_truncate(e, attr->st_size);
+			}
+		}
 
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode * dirinode = (struct inode *) malloc(sizeof(struct inode));
-	int found = get_node_by_path(parentname, 0, dirinode);
+		// Step 3: Then the rest; each change counts as one to the inode
+		if(ret == 0) {
+			time_t now = time(NULL);
+			if(to_set & FUSE_SET_ATTR_MODE) {
+				st->st_mode = (st->st_mode & S_IFMT) | (attr->st_mode & 07777);
+			}
+			if(to_set & FUSE_SET_ATTR_UID) {
+				st->st_uid = attr->st_uid;
+			}
+			if(to_set & FUSE_SET_ATTR_GID) {
+				st->st_gid = attr->st_gid;
+			}
+			if(to_set & FUSE_SET_ATTR_ATIME) {
+				st->st_atime = to_set & FUSE_SET_ATTR_ATIME_NOW ? now : attr->st_atime;
+			}
+			if(to_set & FUSE_SET_ATTR_MTIME) {
+				st->st_mtime = to_set & FUSE_SET_ATTR_MTIME_NOW ? now : attr->st_mtime;
+			}
+			if(to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID |
+				FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+				st->st_ctime = now;
+				e->dirty = 1;
+			}
+			tfs_fill_attr(e, &stbuf);
+		}
+		pthread_rwlock_unlock(&e->lock);
+		tfs_op_end();
+	} while(tfs_retry_alloc(ret, &tries));
+	icache_put(e);
 
-	if(found < 0) {
-		return -ENOENT;
+	if(ret < 0) {
+		tfs_reply_err(req, -ret);
 	} else {
-		// Step 3: Call get_avail_ino() to get an available inode number
-
-		uint16_t ino = get_avail_ino();
-
-		// Step 4: Call dir_add() to add directory entry of target directory to parent directory
-
-		dir_add(*dirinode, ino, childname, strlen(childname));
+		fuse_reply_attr(req, &stbuf, tfs_opts.attr_timeout);
+	}
+}
 
-		// Step 5: Update inode for target directory
-	
+static void tfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
 
-		//printf("ADDING CHILD ENTRY %s, INODE NUMBER %d, TO DIRINODE %d\n", childname, ino, dirinode->ino);
+	if(ino == STATS_DIR_INO) {
+		fuse_reply_open(req, fi);
+		return;
+	}
 
-		// Step 6: Call writei() to write inode to disk
-		struct inode * childinode = (struct inode *) malloc(sizeof(struct inode));
-		childinode->ino = ino;
-		childinode->valid = 1;
-		childinode->link = 0;
-		childinode->size = 0;
-	
-		childinode->vstat.st_ino = ino;
-		childinode->vstat.st_mode   = S_IFDIR | 0755;
-		childinode->vstat.st_blksize = 4096;
-		childinode->vstat.st_size = 0;
-		childinode->vstat.st_blocks = 0;
-		//childnode->vstat.st_nlink  = 2;
-		//time(&stbuf->st_mtime);
-	
-		writei(ino, childinode);
-		return 0;
+	// Step 1: Get the inode and make sure it is a directory
+	struct icache_entry *e = tfs_iget(ino);
+	if(!e) {
+		tfs_reply_err(req, ENOENT);
+		return;
 	}
+	int isdir = S_ISDIR(e->inode.vstat.st_mode);
+	icache_put(e);
 
+	if(!isdir) {
+		tfs_reply_err(req, ENOTDIR);
+	} else {
+		fuse_reply_open(req, fi);
+	}
 }
 
+// A readdir or readdirplus reply being packed
+struct dir_reply {
+	fuse_req_t		req;
+	char *			buf;
+	size_t			size;
+	size_t			len;
+	int				plus;			/* readdirplus: entries carry their attributes */
+	uint16_t *		inos;			/* inodes of the readdirplus entries packed so far */
+	size_t			ninos;
+	size_t			cap;
+};
 
+// Pack one entry into the reply, or return 1 once it is full
+static int dir_reply_add(void *arg, uint16_t ino, const char *name, size_t name_len, off_t next) {
+
+	struct dir_reply * d = (struct dir_reply *) arg;
+	char fname[DIR_NAME_MAX + 1];
+	size_t entlen;
+
+	memcpy(fname, name, name_len);
+	fname[name_len] = '\0';
+	if(d->plus) {
+		if(d->ninos == d->cap) {
+			size_t cap = d->cap ? d->cap * 2 : 64;
+			uint16_t * inos = (uint16_t *) realloc(d->inos, cap * sizeof(uint16_t));
+			if(!inos) {
+				return 1;
+			}
+			d->inos = inos;
+			d->cap = cap;
+		}
+		struct fuse_entry_param ep;
+		struct icache_entry *e = icache_get(ino);
+		if(!e) {
+			return 1;
+		}
+		pthread_rwlock_rdlock(&e->lock);
+		tfs_fill_entry(e, &ep);
+		pthread_rwlock_unlock(&e->lock);
+		icache_put(e);
+		entlen = fuse_add_direntry_plus(d->req, d->buf + d->len, d->size - d->len, fname, &ep, next);
+		if(entlen <= d->size - d->len) {
+			d->inos[d->ninos++] = ino;
+		}
+	} else {
+		struct stat stbuf;
+		memset(&stbuf, 0, sizeof(struct stat));
+		stbuf.st_ino = FUSE_INO(ino);
+		entlen = fuse_add_direntry(d->req, d->buf + d->len, d->size - d->len, fname, &stbuf, next);
+	}
+	if(entlen > d->size - d->len) {
+		return 1;
+	}
+	d->len += entlen;
+	return 0;
+}
 
+static void tfs_readdir_reply(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, int plus) {
 
+	if(ino == STATS_DIR_INO) {
+		stats_readdir(req, size, offset, plus);
+		return;
+	}
 
-static int tfs_rmdir(const char *path) {
-
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-	int pathlength = strlen(path);
-
-	char * pathcopy1 = (char *) malloc(pathlength + 1);
-	char * pathcopy2 = (char *) malloc(pathlength + 1);
+	// Step 1: Get the directory inode
+	struct icache_entry *e = tfs_iget(ino);
+	if(!e) {
+		tfs_reply_err(req, ENOENT);
+		return;
+	}
 
-	memcpy(pathcopy1, (char *) path, pathlength);
-	memcpy(pathcopy2, (char *) path, pathlength);
+	struct dir_reply d;
+	memset(&d, 0, sizeof(struct dir_reply));
+	d.req = req;
+	d.size = size;
+	d.plus = plus;
+	if(!(d.buf = (char *) malloc(size ? size : 1))) {
+		icache_put(e);
+		tfs_reply_err(req, ENOMEM);
+		return;
+	}
 
-	pathcopy1[pathlength] = '\0';
-	pathcopy2[pathlength] = '\0';
+	// Step 2: Pack the entries from offset on into the buffer until it is full
+	pthread_rwlock_rdlock(&e->lock);
+	int ret = dir_list(&e->inode, offset, dir_reply_add, &d);
+	pthread_rwlock_unlock(&e->lock);
+	icache_put(e);
+
+	// Step 3: Every entry of a readdirplus reply that got through counts as a lookup
+	if(ret < 0 && d.len == 0) {
+		tfs_reply_err(req, EIO);
+	} else if(fuse_reply_buf(req, d.buf, d.len) == 0) {
+		for(size_t i = 0; i < d.ninos; i++) {
+			tfs_lookup_ref(d.inos[i]);
+		}
+	}
+	free(d.inos);
+	free(d.buf);
+}
 
-	
-	char * parentname = dirname(pathcopy1);
-	char * childname = basename(pathcopy2);
+static void tfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+	tfs_readdir_reply(req, ino, size, offset, 0);
+}
 
+static void tfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+	tfs_readdir_reply(req, ino, size, offset, 1);
+}
 
-	// Step 2: Call get_node_by_path() to get inode of target directory
-	struct inode * targetinode = (struct inode *) malloc(sizeof(struct inode));
-	int found = get_node_by_path(path, 0, targetinode);
+static void tfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	// For this project, you don't need to fill this function
+	// But DO NOT DELETE IT!
+	tfs_reply_err(req, 0);
+}
 
+/*
+ * Make a new inode of the given mode and link it into parent under name.
+ * Returns its referenced cache entry in *ent, or a negative errno.
+ */
+static int tfs_mknode(fuse_ino_t parent, const char *name, mode_t mode, struct icache_entry **ent) {
 
-	if(found < 0) {
+	// Step 1: Get the parent directory's inode and lock it for the update
+	struct icache_entry *pe = tfs_iget(parent);
+	if(!pe) {
 		return -ENOENT;
-	} else {
-		
-		
-		// Step 3: Clear data block bitmap of target directory
-		bitmap_t dbitmap = (bitmap_t) malloc(4096);
-		bio_read(sb.d_bitmap_blk, dbitmap);
-		int i;
-		for(i = 0; i < targetinode->link; i++) {
-	 		unset_bitmap(dbitmap, targetinode->direct_ptr[i] - sb.d_bitmap_blk);
-		}
-		bio_write(sb.d_bitmap_blk, dbitmap);
+	}
+	pthread_rwlock_wrlock(&pe->lock);
 
+	int ret = 0;
+	struct icache_entry *e = NULL;
+	size_t namelen = strlen(name);
+	struct dirent existing;
+	int ino = -1;
 
-		
-		// Step 4: Clear inode bitmap and its data block		
-		targetinode->valid = 0;
-		writei(targetinode->ino, targetinode);
-		
-		bitmap_t ibitmap = (bitmap_t) malloc(4096);
-		bio_read(sb.i_bitmap_blk, ibitmap);
-		unset_bitmap(ibitmap, targetinode->ino);
-		bio_write(sb.i_bitmap_blk, ibitmap);
+	if(!S_ISDIR(pe->inode.vstat.st_mode)) {
+		ret = -ENOTDIR;
+		goto out;
+	}
+	if(namelen >= sizeof(existing.name)) {
+		ret = -ENAMETOOLONG;
+		goto out;
+	}
+	if(stats_ino(parent, name) || dir_find(pe->ino, name, namelen, &existing) == 0) {
+		ret = -EEXIST;
+		goto out;
+	}
 
-		// Step 5: Call get_node_by_path() to get inode of parent directory
-		struct inode * dirinode = (struct inode *) malloc(sizeof(struct inode));
-		found = get_node_by_path(parentname, 0, dirinode);
+	// Step 2: Call get_avail_ino() to get an available inode number
+	if((ino = get_avail_ino()) < 0) {
+		ret = -ENOSPC;
+		goto out;
+	}
 
-		if(found < 0) {
-			return -ENOENT;
-		} else {
-		
-			// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
-			return dir_remove(*dirinode, childname, strlen(childname));
-		}
+	// Step 3: Call dir_add() to add its directory entry to the parent directory
+	if(dir_add(pe->inode, ino, name, namelen) < 0) {
+		put_ino(ino);
+		ret = -ENOSPC;
+		goto out;
+	}
 
+	// Step 4: Fill in the inode; the inode cache writes it to disk
+	if(!(e = icache_get(ino))) {
+		dir_remove(pe->inode, name, namelen);
+		put_ino(ino);
+		ret = -EIO;
+		goto out;
+	}
+	pthread_rwlock_wrlock(&e->lock);
+	memset(&e->inode, 0, sizeof(struct inode));
+	e->inode.ino = ino;
+	e->inode.valid = 1;
+	e->inode.link = 0;
+	e->inode.size = 0;
+
+	e->inode.vstat.st_ino = ino;
+	e->inode.vstat.st_mode = mode;
+	e->inode.vstat.st_nlink = S_ISDIR(mode) ? 2 : 1;
+	e->inode.vstat.st_blksize = BLOCK_SIZE;
+	e->inode.vstat.st_size = 0;
+	e->inode.vstat.st_blocks = 0;
+	if(S_ISREG(mode) && tfs_opts.inline_data) {
+		e->inode.flags = TFS_INLINE_FL;
 	}
+	memset(e->idata, 0, sizeof(e->idata));
+	//time(&stbuf->st_mtime);
+	e->dirty = 1;
+	pthread_rwlock_unlock(&e->lock);
+
+	*ent = e;
+out:
+	pthread_rwlock_unlock(&pe->lock);
+	icache_put(pe);
+	return ret;
 }
 
-static int tfs_releasedir(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+static void tfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+
+	struct icache_entry *e;
+	int ret, tries = 0;
+	do {
+		tfs_op_begin();
+		ret = tfs_mknode(parent, name, S_IFDIR | 0755, &e);
+		tfs_op_end();
+	} while(tfs_retry_alloc(ret, &tries));
+	if(ret < 0) {
+		tfs_reply_err(req, -ret);
+		return;
+	}
+	tfs_reply_entry(req, e);
+	icache_put(e);
 }
 
-static int tfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-	int pathlength = strlen(path);
-
-	char * pathcopy1 = (char *) malloc(pathlength + 1);
-	char * pathcopy2 = (char *) malloc(pathlength + 1);
+static void tfs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+
+	// Step 1: Make the file
+	struct icache_entry *e;
+	int ret, tries = 0;
+	do {
+		tfs_op_begin();
+		ret = tfs_mknode(parent, name, S_IFREG | 0755, &e);
+		tfs_op_end();
+	} while(tfs_retry_alloc(ret, &tries));
+	if(ret < 0) {
+		tfs_reply_err(req, -ret);
+		return;
+	}
 
-	memcpy(pathcopy1, (char *) path, pathlength);
-	memcpy(pathcopy2, (char *) path, pathlength);
+	// Step 2: The file is open once created
+	struct fuse_entry_param ep;
+	fi->fh = file_open(e->ino, fi->flags);
+	fi->keep_cache = file_keep_cache(e);
+	pthread_rwlock_rdlock(&e->lock);
+	tfs_fill_entry(e, &ep);
+	pthread_rwlock_unlock(&e->lock);
+
+	if(!fi->fh) {
+		tfs_reply_err(req, ENOMEM);
+	} else if(fuse_reply_create(req, &ep, fi) == 0) {
+		tfs_lookup_ref(e->ino);
+	} else {
+		file_close(fi->fh);
+	}
+	icache_put(e);
+}
 
-	pathcopy1[pathlength] = '\0';
-	pathcopy2[pathlength] = '\0';
+/*
+ * Remove name from parent. Its inode goes at once unless the kernel or an
+ * open file still refers to it, in which case the last forget or release
+ * deletes it.
+ */
+static int tfs_remove(fuse_ino_t parent, const char *name, int isdir) {
 
-	
-	char * parentname = dirname(pathcopy1);
-	char * childname = basename(pathcopy2);
+	// Step 1: Get the parent directory's inode and lock it for the update
+	struct icache_entry *pe = tfs_iget(parent);
+	if(!pe) {
+		return -ENOENT;
+	}
+	pthread_rwlock_wrlock(&pe->lock);
 
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode * dirinode = (struct inode *) malloc(sizeof(struct inode));
-	int found = get_node_by_path(parentname, 0, dirinode);
+	int ret = 0;
+	struct icache_entry *e = NULL;
+	size_t namelen = strlen(name);
 
-	if(found < 0) {
-		return -ENOENT;
-	} else {
-		// Step 3: Call get_avail_ino() to get an available inode number
+	// Step 2: Call dir_find() to get the target's inode
+	struct dirent dirent;
+	if(dir_find(pe->ino, name, namelen, &dirent) < 0) {
+		ret = -ENOENT;
+		goto out;
+	}
+	if(!(e = tfs_iget(FUSE_INO(dirent.ino)))) {
+		ret = -EIO;
+		goto out;
+	}
+	pthread_rwlock_wrlock(&e->lock);
 
-		uint16_t ino = get_avail_ino();
+	if(isdir) {
+		if(!S_ISDIR(e->inode.vstat.st_mode)) {
+			ret = -ENOTDIR;
+		} else if(!dir_is_empty(&e->inode)) {
+			ret = -ENOTEMPTY;
+		}
+	} else if(S_ISDIR(e->inode.vstat.st_mode)) {
+		ret = -EISDIR;
+	}
 
-		// Step 4: Call dir_add() to add directory entry of target directory to parent directory
+	// Step 3: Call dir_remove() to remove the target's entry from its parent directory
+	if(ret == 0 && dir_remove(pe->inode, name, namelen) < 0) {
+		ret = -ENOENT;
+	}
+	if(ret < 0) {
+		goto out;
+	}
+	if(isdir) {
+		dcache_purge_dir(e->ino);
+	}
 
-		dir_add(*dirinode, ino, childname, strlen(childname));
+	// Step 4: Clear the inode and its data blocks, now or once unreferenced
+	pthread_mutex_lock(&icache_lock);
+	int busy = e->pincount || ino_lookups[e->ino];
+	if(busy && !e->orphan) {
+		e->orphan = 1;
+		e->pincount++;
+	}
+	pthread_mutex_unlock(&icache_lock);
 
-		// Step 5: Update inode for target directory
-	
+	if(busy) {
+		e->inode.vstat.st_nlink = 0;
+		e->dirty = 1;
+	} else {
+		ent_delete(e);
+	}
 
-		//printf("ADDING CHILD ENTRY %s, INODE NUMBER %d, TO DIRINODE %d\n", childname, ino, dirinode->ino);
-
-		// Step 6: Call writei() to write inode to disk
-		struct inode * childinode = (struct inode *) malloc(sizeof(struct inode));
-		childinode->ino = ino;
-		childinode->valid = 1;
-		childinode->link = 0;	
-		childinode->size = 0;	
-		childinode->vstat.st_ino = ino;
-		childinode->vstat.st_mode   = S_IFREG | 0755;
-		childinode->vstat.st_blksize = 4096;
-		childinode->vstat.st_size = 0;
-		childinode->vstat.st_blocks = 0;
-		//childnode->vstat.st_nlink  = 2;
-		//time(&stbuf->st_mtime);
-	
-		writei(ino, childinode);
-		return 0;
+out:
+	if(e) {
+		pthread_rwlock_unlock(&e->lock);
+		icache_put(e);
 	}
+	pthread_rwlock_unlock(&pe->lock);
+	icache_put(pe);
+	return ret;
+}
 
+static void tfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	tfs_op_begin();
+	int ret = tfs_remove(parent, name, 1);
+	tfs_op_end();
+	tfs_reply_err(req, -ret);
+}
 
-	return 0;
+static void tfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	tfs_op_begin();
+	int ret = tfs_remove(parent, name, 0);
+	tfs_op_end();
+	tfs_reply_err(req, -ret);
 }
 
-static int tfs_open(const char *path, struct fuse_file_info *fi) {
+static void tfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
 	//printf("\n---------------CALLING TFS OPEN-----------\n");
-	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode * inode = (struct inode *) malloc(sizeof(struct inode));
-	int found = get_node_by_path(path, 0, inode);
+	if(ino == STATS_FILE_INO) {
+		stats_open(req, fi);
+		return;
+	}
+	// Step 1: Get the inode
+	struct icache_entry *e = tfs_iget(ino);
+	if(!e) {
+		tfs_reply_err(req, ENOENT);
+		return;
+	}
+	int isdir = S_ISDIR(e->inode.vstat.st_mode);
+	if(!isdir) {
+		fi->keep_cache = file_keep_cache(e);
+	}
+	icache_put(e);
+	if(isdir) {
+		tfs_reply_err(req, EISDIR);
+		return;
+	}
 
-	if(found < 0) {
-		return -ENOENT;
-	} else {
-		return 0;
+	// Step 2: Hand FUSE an open file holding the inode for later calls
+	fi->fh = file_open(TFS_INO(ino), fi->flags);
+	if(!fi->fh) {
+		tfs_reply_err(req, ENOMEM);
+	} else if(fuse_reply_open(req, fi) != 0) {
+		file_close(fi->fh);
 	}
-	
 }
 
-static int tfs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-
-	// Step 1: You could call get_node_by_path() to get inode from path
-	//printf("\n---------------CALLING TFS READ PATH: %s, SIZE: %d, OFFSET: %d\n", path, size, offset);
-	struct inode * dirinode = (struct inode *) malloc(sizeof(struct inode));
-	int found = get_node_by_path(path, 0, dirinode);
-	
-	if(found < 0) {
-		return -ENOENT;
-	} else {
-	
-		if(size == 0){
-			return 0;
-		}
-		
-		int bytenumber;
-		int blocknumber;
-		int written = 0;
-
-		void * datablock = malloc(4096);
-		printf("Link count: %d\n", dirinode->link);	
-		for(blocknumber = 0; blocknumber < dirinode->link; blocknumber++){
-			bio_read(dirinode->direct_ptr[blocknumber], datablock); 
-			for(bytenumber = 0; bytenumber < 4096; bytenumber++){
-				if(bytenumber + blocknumber*4096 >= offset && bytenumber + blocknumber*4096 < size + offset) {
-					memcpy(buffer + written, datablock + bytenumber, 1); 		
-					written++;
-					if(written == size){		
-						printf("Read: %s\n from block %d\n", (char *) datablock, dirinode->direct_ptr[blocknumber]);	
-						return written;
-					}
-				}
-			}
-		}
-		
-		return -1;
+// Keep track of whether a file is being streamed; concurrent reads
+// through one handle can only blur this, never break anything
+static void file_read_done(struct fuse_file_info *fi, off_t offset, int ret) {
+	struct tfs_file *f = file_get(fi);
+	if(f && ret > 0) {
+		f->seq_reads = offset == f->next_off ? f->seq_reads + 1 : 0;
+		f->next_off = offset + ret;
+		file_readahead(f, offset, ret);
 	}
+}
 
-	// Step 2: Based on size and offset, read its data blocks from disk	
+static void tfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
 
-	// Step 3: copy the correct amount of data from offset to buffer
+	if(ino == STATS_FILE_INO) {
+		stats_read(req, size, offset, fi);
+		return;
+	}
 
-	// Note: this function should return the amount of bytes you copied to buffer
-}
+	// Step 1: Use the inode the file was opened with
+	struct icache_entry *e = file_entry(ino, fi);
+	if(!e) {
+		tfs_reply_err(req, ENOENT);
+		return;
+	}
 
-static int tfs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	
-	printf("\n---------------CALLING TFS WRITE PATH: %s, SIZE: %d, OFFSET: %d\n", path, size, offset);
+	// Step 2: Reply straight out of the mapping or the image file; the
+	// lock is held until FUSE has copied or spliced the data out
+	pthread_rwlock_rdlock(&e->lock);
+	struct fuse_bufvec *bv = file_read_buf(e, size, offset);
+	if(bv) {
+		int ret = fuse_buf_size(bv);
+		int err = fuse_reply_data(req, bv, FUSE_BUF_SPLICE_MOVE);
+		pthread_rwlock_unlock(&e->lock);
+		icache_put(e);
+		free(bv);
+		file_read_done(fi, offset, err ? 0 : ret);
+		return;
+	}
 
-	// Step 1: You could call get_node_by_path() to get inode from path
-	struct inode * dirinode = (struct inode *) malloc(sizeof(struct inode));
-	int found = get_node_by_path(path, 0, dirinode);
+	char * buffer = (char *) malloc(size ? size : 1);
+	if(!buffer) {
+		pthread_rwlock_unlock(&e->lock);
+		icache_put(e);
+		tfs_reply_err(req, ENOMEM);
+		return;
+	}
 
+	// Step 3: Based on size and offset, read its data blocks from disk	
+	// Step 4: copy the correct amount of data from offset to buffer
+	int ret = file_read(e, buffer, size, offset);
+	pthread_rwlock_unlock(&e->lock);
+	icache_put(e);
+	file_read_done(fi, offset, ret);
 
-	
-	if(found < 0) {
-		return -ENOENT;
+	if(ret < 0) {
+		tfs_reply_err(req, -ret);
 	} else {
-		if(size == 0){
-			return 0;
-		}
+		fuse_reply_buf(req, buffer, ret);
+	}
+	free(buffer);
+}
 
-		int bytenumber;
-		int blocknumber;
-		void * datablock = malloc(4096);
-		int read = 0;
+static void tfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi) {
 
-		for(blocknumber = 0; blocknumber < 16; blocknumber++){
-			if(blocknumber == dirinode->link){
-				readi(dirinode->ino, dirinode);
-				dirinode->link += 1;
-				int blockno = get_avail_blkno();
-				blockno += sb.d_start_blk;			
-				dirinode->direct_ptr[blocknumber] = blockno;
-				writei(dirinode->ino, dirinode);
-			}
-		
-			for(bytenumber = 0; bytenumber < 4096; bytenumber++){	
-				if(bytenumber + blocknumber*4096 >= offset && bytenumber + blocknumber*4096 < offset + size) {
-					memcpy(datablock + bytenumber, buffer + read, 1);
-					read++;
-					if(read == size) {
-						readi(dirinode->ino, dirinode);
-						dirinode->size += size;
-						dirinode->vstat.st_size += size;
-						writei(dirinode->ino, dirinode);
-						bio_write(dirinode->direct_ptr[blocknumber], datablock);
-						printf("Write: %s\n in blocknumber%d\n", (char *) datablock, dirinode->direct_ptr[blocknumber]);
-						return read;
-					}			
-
-				}					
-			}
-			bio_write(dirinode->direct_ptr[blocknumber], datablock);
-		}
-		
-		return -1;
+	// Step 1: Use the inode the file was opened with
+	struct icache_entry *e = file_entry(ino, fi);
+	if(!e) {
+		tfs_reply_err(req, ENOENT);
+		return;
 	}
 
-
 	// Step 2: Based on size and offset, read its data blocks from disk
-
 	// Step 3: Write the correct amount of data from offset to disk
-
-	// Step 4: Update the inode info and write it to disk
-
-	// Note: this function should return the amount of bytes you write to disk
+	// Step 4: Update the inode info; the inode cache writes it to disk
+	// Only a write that took nothing from the source can be tried again:
+	// what a pipe gave up is gone
+	int ret, tries = 0;
+	size_t idx = bufv->idx, off = bufv->off;
+	do {
+		tfs_op_begin();
+		pthread_rwlock_wrlock(&e->lock);
+		ret = file_write(e, bufv, offset);
+		pthread_rwlock_unlock(&e->lock);
+		tfs_op_end();
+	} while(bufv->idx == idx && bufv->off == off && tfs_retry_alloc(ret, &tries));
+	icache_put(e);
+
+	if(ret < 0) {
+		tfs_reply_err(req, -ret);
+	} else {
+		fuse_reply_write(req, ret);
+	}
 }
 
-static int tfs_unlink(const char *path) {
-
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-	int pathlength = strlen(path);
-
-	char * pathcopy1 = (char *) malloc(pathlength + 1);
-	char * pathcopy2 = (char *) malloc(pathlength + 1);
-
-	memcpy(pathcopy1, (char *) path, pathlength);
-	memcpy(pathcopy2, (char *) path, pathlength);
+static void tfs_write(fuse_req_t req, fuse_ino_t ino, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+	bufv.buf[0].mem = (void *) buffer;
+	tfs_write_buf(req, ino, &bufv, offset, fi);
+}
 
-	pathcopy1[pathlength] = '\0';
-	pathcopy2[pathlength] = '\0';
+static void tfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	if(ino == STATS_FILE_INO) {
+		free((char *) (uintptr_t) fi->fh);
+		tfs_reply_err(req, 0);
+		return;
+	}
+	// Drop the open file, which deletes the inode if it was the last use of an unlinked one;
+	// the journal commits whatever it changed along with everything else
+	tfs_op_begin();
+	file_close(fi->fh);
+	fi->fh = 0;
+	tfs_op_end();
+	tfs_reply_err(req, 0);
+}
 
-	
-	char * parentname = dirname(pathcopy1);
-	char * childname = basename(pathcopy2);
+static void tfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	// close() promises nothing about durability; fsync does
+	tfs_reply_err(req, 0);
+}
 
+static void tfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	// The journal commits every file at once, so one commit serves any fsync
+	tfs_reply_err(req, tfs_sync() < 0 ? EIO : 0);
+}
 
-	// Step 2: Call get_node_by_path() to get inode of target file
-	struct inode * targetinode = (struct inode *) malloc(sizeof(struct inode));
-	int found = get_node_by_path(path, 0, targetinode);
+static void tfs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	tfs_reply_err(req, tfs_sync() < 0 ? EIO : 0);
+}
 
+static void tfs_statfs(fuse_req_t req, fuse_ino_t ino) {
+
+	struct statvfs st;
+	memset(&st, 0, sizeof(struct statvfs));
+	st.f_bsize = BLOCK_SIZE;
+	st.f_frsize = BLOCK_SIZE;
+	pthread_mutex_lock(&alloc_lock);
+	st.f_blocks = sb.max_dnum;
+	// Space promised to parked file data is as good as used
+	st.f_bfree = dbm.nfree > da_reserved ? dbm.nfree - da_reserved : 0;
+	pthread_mutex_unlock(&alloc_lock);
+	st.f_bavail = st.f_bfree;
+	st.f_files = sb.max_inum;
+	st.f_ffree = ibm.nfree;
+	st.f_favail = ibm.nfree;
+	st.f_namemax = sizeof(((struct dirent *) 0)->name) - 1;
+	fuse_reply_statfs(req, &st);
+}
 
-	if(found < 0) {
-		return -ENOENT;
+// Grow the image to bytes, rounded down to whole blocks, and commit; it cannot shrink
+static int tfs_grow(uint64_t bytes) {
+
+	int err = 0;
+	pthread_mutex_lock(&alloc_lock);
+	uint64_t nblocks = bytes / BLOCK_SIZE;
+	if(nblocks < sb.nblocks) {
+		err = EINVAL;
+	} else if(nblocks - sb.d_start_blk > data_limit()) {
+		err = EFBIG;
+	} else if(nblocks > sb.nblocks && data_grow(nblocks - sb.nblocks) < 0) {
+		err = EIO;
 	} else {
-		
-		
-		// Step 3: Clear data block bitmap of target file
-		bitmap_t dbitmap = (bitmap_t) malloc(4096);
-		bio_read(sb.d_bitmap_blk, dbitmap);
-		int i;
-		for(i = 0; i < targetinode->link; i++) {
-	 		unset_bitmap(dbitmap, targetinode->direct_ptr[i] - sb.d_bitmap_blk);
-		}
-		bio_write(sb.d_bitmap_blk, dbitmap);
+		grow_stuck = 0;
+	}
+	pthread_mutex_unlock(&alloc_lock);
 
+	if(err == 0 && tfs_writeback() < 0) {
+		err = EIO;
+	}
+	return err;
+}
 
-		
-		// Step 4: Clear inode bitmap and its data block		
-		targetinode->valid = 0;
-		writei(targetinode->ino, targetinode);
-		
-		bitmap_t ibitmap = (bitmap_t) malloc(4096);
-		bio_read(sb.i_bitmap_blk, ibitmap);
-		unset_bitmap(ibitmap, targetinode->ino);
-		bio_write(sb.i_bitmap_blk, ibitmap);
+/*
+ * The image size in bytes is the TFS_SIZE_XATTR attribute of the root
+ * directory: reading it gives the current size and setting it grows the
+ * image while mounted. There are no other extended attributes.
+ */
+static void tfs_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags) {
 
-		// Step 5: Call get_node_by_path() to get inode of parent directory
-		struct inode * dirinode = (struct inode *) malloc(sizeof(struct inode));
-		found = get_node_by_path(parentname, 0, dirinode);
+	char arg[32];
+	if(ino != FUSE_ROOT_ID || strcmp(name, TFS_SIZE_XATTR) != 0) {
+		tfs_reply_err(req, ENOTSUP);
+		return;
+	}
+	if(size == 0 || size >= sizeof(arg)) {
+		tfs_reply_err(req, EINVAL);
+		return;
+	}
+	memcpy(arg, value, size);
+	arg[size] = '\0';
+	tfs_reply_err(req, tfs_grow(parse_size(arg)));
+}
 
-		if(found < 0) {
-			return -ENOENT;
-		} else {
-		
-			// Step 6: Call dir_remove() to remove directory entry of target file in its parent directory
-			return dir_remove(*dirinode, childname, strlen(childname));
-		}
+static void tfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
 
+	char value[32];
+	if(ino != FUSE_ROOT_ID || strcmp(name, TFS_SIZE_XATTR) != 0) {
+		tfs_reply_err(req, ENODATA);
+		return;
+	}
+	pthread_mutex_lock(&alloc_lock);
+	int len = snprintf(value, sizeof(value), "%lu", (unsigned long) (sb.nblocks * BLOCK_SIZE));
+	pthread_mutex_unlock(&alloc_lock);
+
+	if(size == 0) {
+		fuse_reply_xattr(req, len);
+	} else if(size < (size_t) len) {
+		tfs_reply_err(req, ERANGE);
+	} else {
+		fuse_reply_buf(req, value, len);
 	}
-
-	return 0;
 }
 
-static int tfs_truncate(const char *path, off_t size) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
-}
+static void tfs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
 
-static int tfs_release(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-	return 0;
+	size_t len = ino == FUSE_ROOT_ID ? sizeof(TFS_SIZE_XATTR) : 0;
+	if(size == 0) {
+		fuse_reply_xattr(req, len);
+	} else if(size < len) {
+		tfs_reply_err(req, ERANGE);
+	} else {
+		fuse_reply_buf(req, TFS_SIZE_XATTR, len);
+	}
 }
 
-static int tfs_flush(const char * path, struct fuse_file_info * fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
-}
 
-static int tfs_utimens(const char *path, const struct timespec tv[2]) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+/*
+ * The ops table points at timed_* wrappers, each of which runs an
+ * operation and records it in its statistics slot, with the bytes a read
+ * or write asked for.
+ */
+#define TIMED_OP(op, slot, params, args, bytes) \
+static void timed_##op params { \
+	uint64_t nbytes = bytes, start = stat_now(); \
+	op_err = 0; \
+	tfs_##op args; \
+	stat_record(slot, start, op_err != 0, nbytes); \
 }
 
-
-static struct fuse_operations tfs_ope = {
+TIMED_OP(lookup, OP_LOOKUP, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name), 0)
+TIMED_OP(forget, OP_FORGET, (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup), (req, ino, nlookup), 0)
+TIMED_OP(getattr, OP_GETATTR, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), 0)
+TIMED_OP(setattr, OP_SETATTR, (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi),
+	(req, ino, attr, to_set, fi), 0)
+TIMED_OP(readdir, OP_READDIR, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi),
+	(req, ino, size, offset, fi), 0)
+TIMED_OP(readdirplus, OP_READDIRPLUS, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi),
+	(req, ino, size, offset, fi), 0)
+TIMED_OP(opendir, OP_OPENDIR, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), 0)
+TIMED_OP(releasedir, OP_RELEASEDIR, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), 0)
+TIMED_OP(mkdir, OP_MKDIR, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode), (req, parent, name, mode), 0)
+TIMED_OP(rmdir, OP_RMDIR, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name), 0)
+TIMED_OP(create, OP_CREATE, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi),
+	(req, parent, name, mode, fi), 0)
+TIMED_OP(open, OP_OPEN, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), 0)
+TIMED_OP(read, OP_READ, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi),
+	(req, ino, size, offset, fi), size)
+TIMED_OP(write, OP_WRITE, (fuse_req_t req, fuse_ino_t ino, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi),
+	(req, ino, buffer, size, offset, fi), size)
+TIMED_OP(write_buf, OP_WRITE, (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi),
+	(req, ino, bufv, offset, fi), fuse_buf_size(bufv))
+TIMED_OP(unlink, OP_UNLINK, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name), 0)
+TIMED_OP(flush, OP_FLUSH, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), 0)
+TIMED_OP(release, OP_RELEASE, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi), 0)
+TIMED_OP(fsync, OP_FSYNC, (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi), (req, ino, datasync, fi), 0)
+TIMED_OP(fsyncdir, OP_FSYNCDIR, (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi),
+	(req, ino, datasync, fi), 0)
+TIMED_OP(statfs, OP_STATFS, (fuse_req_t req, fuse_ino_t ino), (req, ino), 0)
+TIMED_OP(setxattr, OP_SETXATTR, (fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags),
+	(req, ino, name, value, size, flags), 0)
+TIMED_OP(getxattr, OP_GETXATTR, (fuse_req_t req, fuse_ino_t ino, const char *name, size_t size), (req, ino, name, size), 0)
+TIMED_OP(listxattr, OP_LISTXATTR, (fuse_req_t req, fuse_ino_t ino, size_t size), (req, ino, size), 0)
+
+static struct fuse_lowlevel_ops tfs_ope = {
 	.init		= tfs_init,
 	.destroy	= tfs_destroy,
 
-	.getattr	= tfs_getattr,
-	.readdir	= tfs_readdir,
-	.opendir	= tfs_opendir,
-	.releasedir	= tfs_releasedir,
-	.mkdir		= tfs_mkdir,
-	.rmdir		= tfs_rmdir,
-
-	.create		= tfs_create,
-	.open		= tfs_open,
-	.read 		= tfs_read,
-	.write		= tfs_write,
-	.unlink		= tfs_unlink,
-
-	.truncate   = tfs_truncate,
-	.flush      = tfs_flush,
-	.utimens    = tfs_utimens,
-	.release	= tfs_release
+	.lookup		= timed_lookup,
+	.forget		= timed_forget,
+	.getattr	= timed_getattr,
+	.setattr	= timed_setattr,
+	.readdir	= timed_readdir,
+	.readdirplus	= timed_readdirplus,
+	.opendir	= timed_opendir,
+	.releasedir	= timed_releasedir,
+	.mkdir		= timed_mkdir,
+	.rmdir		= timed_rmdir,
+
+	.create		= timed_create,
+	.open		= timed_open,
+	.read 		= timed_read,
+	.write		= timed_write,
+	.write_buf	= timed_write_buf,
+	.unlink		= timed_unlink,
+
+	.flush      = timed_flush,
+	.release	= timed_release,
+	.fsync		= timed_fsync,
+	.fsyncdir	= timed_fsyncdir,
+	.statfs		= timed_statfs,
+	.setxattr	= timed_setxattr,
+	.getxattr	= timed_getxattr,
+	.listxattr	= timed_listxattr
 };
 
 
+/*
+ * tfs -mkfs [-s size] [-m max_size] [-b block_size] [-i inodes] [-j journal_blocks] [image]
+ * formats image, DISKFILE in the working directory by default.
+ */
+static int tfs_mkfs_main(int argc, char *argv[]) {
+
+	int c;
+	while((c = getopt(argc, argv, "s:m:b:i:j:")) != -1) {
+		switch(c) {
+		case 's': mkfs_opts.size = parse_size(optarg); break;
+		case 'm': mkfs_opts.max_size = parse_size(optarg); break;
+		case 'b': mkfs_opts.block_size = parse_size(optarg); break;
+		case 'i': mkfs_opts.inodes = strtoul(optarg, NULL, 10); break;
+		case 'j': mkfs_opts.journal_blocks = strtoul(optarg, NULL, 10); break;
+		default:
+			fprintf(stderr, "usage: tfs -mkfs [-s size] [-m max_size] [-b block_size] [-i inodes] [-j journal_blocks] [image]\n");
+			return 1;
+		}
+	}
+	if(optind < argc) {
+		strncpy(diskfile_path, argv[optind], PATH_MAX - 1);
+	} else {
+		getcwd(diskfile_path, PATH_MAX);
+		strcat(diskfile_path, "/DISKFILE");
+	}
+
+	mkfs_opts.format = 1;
+	tfs_init(NULL, NULL);
+	printf("%s: %lu blocks of %u bytes, %u inodes, %u journal blocks, %u data blocks, growing to %u\n",
+		diskfile_path, (unsigned long) sb.nblocks, sb.block_size, sb.max_inum, sb.j_nblocks, sb.max_dnum, data_limit());
+	tfs_destroy(NULL);
+	return 0;
+}
+
 int main(int argc, char *argv[]) {
-	if(!strcmp(argv[1],"-simple")){
+	if(argc > 1 && !strcmp(argv[1],"-mkfs")){
+		return tfs_mkfs_main(argc - 1, argv + 1);
+	} else if(argc > 1 && !strcmp(argv[1],"-grow")){
+		// tfs -grow mountpoint size: grow a mounted image through its root directory
+		if(argc != 4 || setxattr(argv[2], TFS_SIZE_XATTR, argv[3], strlen(argv[3]), 0) < 0) {
+			perror(argc == 4 ? argv[2] : "usage: tfs -grow mountpoint size");
+			return 1;
+		}
+		return 0;
+	} else if(argc > 1 && !strcmp(argv[1],"-simple")){
 
 		getcwd(diskfile_path, PATH_MAX);
 		strcat(diskfile_path, "/DISKFILE");
-		tfs_init(NULL);
+		tfs_init(NULL, NULL);
+		tfs_destroy(NULL);
 		return 0;	
 	} else {
 
-		int fuse_stat;
+		struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+		struct fuse_cmdline_opts opts;
+		struct fuse_session *se;
+		int err = -1;
+
 		getcwd(diskfile_path, PATH_MAX);
 		strcat(diskfile_path, "/DISKFILE");
-		fuse_stat = fuse_main(argc, argv, &tfs_ope, NULL);
 
-		return fuse_stat;
+		if(fuse_opt_parse(&args, &tfs_opts, tfs_opt_spec, NULL) < 0 || fuse_parse_cmdline(&args, &opts) != 0) {
+			return 1;
+		}
+		if(opts.show_version) {
+			fuse_lowlevel_version();
+			return 0;
+		}
+		if(opts.show_help || !opts.mountpoint) {
+			printf("usage: %s [options] mountpoint\n", argv[0]);
+			fuse_cmdline_help();
+			fuse_lowlevel_help();
+			return opts.show_help ? 0 : 1;
+		}
+
+		// Mount, then serve requests until unmounted or interrupted
+		se = fuse_session_new(&args, &tfs_ope, sizeof(tfs_ope), NULL);
+		if(se) {
+			if(fuse_set_signal_handlers(se) == 0) {
+				if(fuse_session_mount(se, opts.mountpoint) == 0) {
+					fuse_daemonize(opts.foreground);
+					err = opts.singlethread ? fuse_session_loop(se) : fuse_session_loop_mt(se, opts.clone_fd);
+					fuse_session_unmount(se);
+				}
+				fuse_remove_signal_handlers(se);
+			}
+			fuse_session_destroy(se);
+		}
+		free(opts.mountpoint);
+		fuse_opt_free_args(&args);
+
+		return err ? 1 : 0;
 	}
 }
-
@@ -16,38 +16,218 @@
 #ifndef _TFS_H
 #define _TFS_H
 
-#define MAGIC_NUM 0x5C3A
-#define MAX_INUM 1024
-#define MAX_DNUM 16384
+#define MAGIC_NUM 0x5C40
 
+//Inode numbers are 16 bits wide, so an image holds at most MAX_INUM inodes
+#define MAX_INUM 65536
 
+//Data blocks are indexed by 32-bit bitmap positions; an image needs MIN_DNUM of them
+#define MAX_DNUM (1U << 31)
+#define MIN_DNUM 64
+
+//Geometry of an image formatted without options
+#define DEFAULT_DISK_SIZE (32 << 20)
+#define DEFAULT_BLOCK_SIZE 4096
+#define DEFAULT_INUM 1024
+
+//Images may grow to this many times their size unless mkfs is told otherwise
+#define DEFAULT_GROW_FACTOR 256
+
+//The data region grows by GROW_STEP_PERCENT once less than GROW_FREE_PERCENT of it is free
+#define GROW_FREE_PERCENT 10
+#define GROW_STEP_PERCENT 25
+
+//Extended attribute of the root directory that reads and sets the image size
+#define TFS_SIZE_XATTR "user.tfs.size"
+
+#define INODE_SIZE 256
+#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
+
+//Default number of inodes held by the inode cache
+#define ICACHE_DEFAULT_INODES 512
+
+//Default number of names held by the dentry cache
+#define DCACHE_DEFAULT_ENTRIES 4096
+
+//Readahead window bounds in blocks, and how many windows may be queued
+#define RA_MIN_WINDOW 4
+#define RA_DEFAULT_WINDOW 64
+#define RA_DEFAULT_INFLIGHT 8
+
+//Blocks of file data a file, and all files together, may hold unallocated before they are given disk space
+#define DA_DEFAULT_BLOCKS 1024
+#define DA_DEFAULT_TOTAL 16384
+
+//Free runs shorter than this many blocks count towards free space fragmentation
+#define FRAG_RUN_BLOCKS 64
+
+//Blocks reserved for the metadata journal, at most an eighth of the image, and seconds between background commits
+#define JOURNAL_BLOCKS 512
+#define JOURNAL_MIN_BLOCKS 16
+#define JNL_COMMIT_INTERVAL 5
+
+//What fsync waits for: nothing, the next group commit, or a commit of its own
+#define FSYNC_ASYNC 0
+#define FSYNC_GROUP 1
+#define FSYNC_SYNC 2
+
+//Largest FUSE read and write requests asked of the kernel, and the most pages it lets one carry
+#define REQ_MAX_BYTES (1 << 20)
+#define REQ_MAX_PAGES 256
+
+//Levels of tfs_log() messages; the log_level mount option drops those above it
+#define TFS_LOG_ERROR 0
+#define TFS_LOG_WARN 1
+#define TFS_LOG_INFO 2
+#define TFS_LOG_DEBUG 3
+
+//Most image extents a read reply is spliced from before it is copied instead
+#define FILE_SPLICE_MAX_PIECES 16
+
+
+/*
+ * The superblock sits at the start of block 0 and records the geometry the
+ * image was formatted with. It is read before the block size is known, so
+ * it must fit in BLOCK_SIZE_MIN bytes.
+ */
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
-	uint16_t	max_inum;			/* maximum inode number */
-	uint16_t	max_dnum;			/* maximum data block number */
-	uint32_t	i_bitmap_blk;		/* start address of inode bitmap */
-	uint32_t	d_bitmap_blk;		/* start address of data block bitmap */
-	uint32_t	i_start_blk;		/* start address of inode region */
-	uint32_t	d_start_blk;		/* start address of data block region */
+	uint32_t	block_size;			/* bytes per block */
+	uint32_t	max_inum;			/* maximum inode number */
+	uint32_t	max_dnum;			/* maximum data block number */
+	uint64_t	nblocks;			/* blocks in the image */
+	uint64_t	i_bitmap_blk;		/* start address of inode bitmap */
+	uint64_t	d_bitmap_blk;		/* start address of data block bitmap */
+	uint64_t	i_start_blk;		/* start address of inode region */
+	uint64_t	d_start_blk;		/* start address of data block region */
+	uint64_t	j_start_blk;		/* start address of the metadata journal */
+	uint32_t	j_nblocks;			/* blocks in the metadata journal */
+	uint32_t	grow_dnum;			/* data blocks the image may grow to */
 };
 
 struct inode {
 	uint16_t	ino;				/* inode number */
 	uint16_t	valid;				/* validity of the inode */
-	uint32_t	size;				/* size of the file */
+	uint64_t	size;				/* size of the file */
 	uint32_t	type;				/* type of the file */
 	uint32_t	link;				/* link count */
-	int			direct_ptr[16];		/* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
+	uint32_t	flags;				/* TFS_*_FL inode flags */
+	uint32_t	dir_depth;			/* global depth of an indexed directory */
 	struct stat	vstat;				/* inode stat */
 };
 
+/*
+ * A run of len blocks of a file: logical blocks [lblk, lblk + len) live in
+ * physical blocks [pblk, pblk + len).
+ */
+struct extent {
+	uint32_t	lblk;				/* first logical block */
+	uint32_t	len;				/* number of blocks */
+	uint64_t	pblk;				/* first physical block */
+};
+
+/*
+ * An inode maps its blocks with up to INODE_EXTENTS extents stored in the
+ * inode itself (ext_depth 0). Once a file needs more, the inode slots
+ * become index entries (ext_depth 1): lblk is the first logical block
+ * covered, pblk a leaf block holding a sorted array of extents and len the
+ * number of extents in that leaf.
+ */
+#define INODE_EXTENTS 8
+#define EXTENTS_PER_LEAF (BLOCK_SIZE / sizeof(struct extent))
+#define MAX_EXTENTS (INODE_EXTENTS * EXTENTS_PER_LEAF)
+
+/*
+ * A regular file of at most INLINE_DATA_MAX bytes keeps its data in the
+ * inode (TFS_INLINE_FL), where the extent root would otherwise be, so it
+ * takes no data block and is read along with its inode. It is moved to a
+ * data block of its own once it grows past that.
+ */
+#define TFS_INLINE_FL 0x2
+#define INLINE_DATA_MAX 184
+
+/*
+ * On-disk inode, packed INODES_PER_BLOCK to a block. Only the attributes
+ * that struct stat needs are kept; readi()/writei() convert to and from
+ * the in-memory struct inode.
+ */
+struct dinode {
+	uint16_t	ino;				/* inode number */
+	uint16_t	valid;				/* validity of the inode */
+	uint32_t	type;				/* type of the file */
+	uint32_t	link;				/* link count */
+	uint32_t	mode;				/* file type and permissions */
+	uint32_t	nlink;				/* number of hard links */
+	uint32_t	uid;				/* owner */
+	uint32_t	gid;				/* group */
+	uint32_t	flags;				/* TFS_*_FL inode flags */
+	uint64_t	size;				/* size of the file */
+	int64_t		atime;				/* access time */
+	int64_t		mtime;				/* modification time */
+	int64_t		ctime;				/* change time */
+	uint16_t	nextents;			/* used entries in extents[] */
+	uint16_t	ext_depth;			/* depth of the extent tree */
+	uint32_t	dir_depth;			/* global depth of an indexed directory */
+	union {
+		struct extent extents[INODE_EXTENTS];	/* extents, or extent leaves if ext_depth is 1 */
+		char	data[INLINE_DATA_MAX];	/* file data of a TFS_INLINE_FL inode */
+	};
+};
+
+_Static_assert(sizeof(struct dinode) == INODE_SIZE, "struct dinode must be INODE_SIZE bytes");
+
+//Longest file name a directory entry holds
+#define DIR_NAME_MAX 255
+
+/*
+ * A directory entry as dir_find() returns it. On disk, entries are
+ * struct dir_rec records.
+ */
 struct dirent {
 	uint16_t ino;					/* inode number of the directory entry */
 	uint16_t valid;					/* validity of the directory entry */
-	char name[252];					/* name of the directory entry */
+	char name[DIR_NAME_MAX + 1];	/* name of the directory entry */
 };
 
+/*
+ * Directory blocks hold variable-length records chained by rec_len, which
+ * together cover the whole block (in a leaf, everything after the header).
+ * A record with name_len 0 is free space. A removed entry is merged into
+ * the record before it, and a new one goes into the first record with
+ * enough room past its own name. Names are compared only when the stored
+ * hash matches.
+ */
+struct dir_rec {
+	uint32_t	hash;				/* name_hash() of the name */
+	uint32_t	rec_len;			/* bytes from this record to the next */
+	uint16_t	ino;				/* inode number of the entry */
+	uint16_t	name_len;			/* length of the name, 0 for free space */
+	char		name[];				/* the name, not NUL terminated */
+};
+
+#define DIR_REC_LEN(name_len) ((sizeof(struct dir_rec) + (name_len) + 3) & ~(size_t) 3)
+
+/*
+ * Directories start out linear: up to DIR_LINEAR_BLOCKS blocks of records
+ * scanned in order. Past that they are converted to an extendible hash
+ * index (TFS_INDEX_FL): logical blocks [0, DIR_INDEX_BLOCKS) hold a table
+ * of 2^dir_depth slots, selected by the top dir_depth bits of the name
+ * hash, each naming the logical block of a leaf. Leaves start with a
+ * struct dir_leaf header followed by records, and are split in two when
+ * they fill up.
+ */
+#define TFS_INDEX_FL 0x1
+
+#define DIR_LINEAR_BLOCKS 4
+#define DIR_INDEX_BLOCKS 8
+#define DIR_SLOTS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+
+struct dir_leaf {
+	uint32_t	depth;				/* number of hash bits shared by this leaf */
+	uint32_t	count;				/* valid entries in the leaf */
+};
+
+
 
 /*
  * bitmap operations